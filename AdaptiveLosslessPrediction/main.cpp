@@ -16,7 +16,19 @@
 
 #include <time.h>
 
+#include <chrono>
+
 #include "ColortableIter.hpp"
+
+#include "WavefrontDecode.hpp"
+
+#include "BatchPipeline.hpp"
+
+#include "ParallelEncode.hpp"
+
+#include <fcntl.h>
+
+#include "zlib.h"
  
 using namespace std;
 
@@ -115,14 +127,34 @@ post_process_iter(PngContext *cxt,
   return;
 }
 
+// Print error metrics for a residual buffer, the alpha channel
+// is reported on its own when numComp is 4.
+
+static
+void print_residual_stats(int numPixels, uint32_t *deltasPtr, int width, const int numComp)
+{
+  ResidualStats stats;
+  
+  calc_residual_stats(numPixels, deltasPtr, width, &stats);
+  
+  fprintf(stdout, "combined MAE %0.8f\n", stats.combinedMAE);
+  fprintf(stdout, "combined MSE %0.8f\n", stats.combinedMSE);
+  fprintf(stdout, "PSNR %0.4f : max error %d\n", stats.psnr, stats.maxError);
+  
+  if (numComp == 4) {
+    fprintf(stdout, "alpha MAE %0.8f : max error %d\n", ((double) stats.sumAbs[3]) / numPixels, stats.maxAbs[3]);
+  }
+}
+
 // Post process the output of a RGB prediction based on an input image and the
-// iteration order.
+// iteration order. The numComp argument is 4 when alpha was predicted.
 
 void
 post_process_rgb(PngContext *cxt,
                  int genDeltas,
                  uint32_t *deltasPtr,
-                 const vector<uint32_t> & iterOrder
+                 const vector<uint32_t> & iterOrder,
+                 const int numComp = 3
 )
 {
   int inputImageNumPixels = cxt->width * cxt->height;
@@ -156,39 +188,9 @@ post_process_rgb(PngContext *cxt,
   }
   
   if (genDeltas) {
-    // Out = Pred = orig + err
-    
-    // Write over the first 4 pixels in upper left to simplify
-    // delta calculations
+    // Calculate error metrics in one pass over the residuals
     
-    uint32_t *predPixelsPtr = new uint32_t[inputImageNumPixels]();
-    
-    for (int i = 0; i < inputImageNumPixels; i++)
-    {
-      if (i == 0 || i == 1 || (i == cxt->width) || (i == cxt->width+1)) {
-        // Skip abs and emit zero in the upper left corner pixels case
-        predPixelsPtr[i] = deltasPtr[i];
-      } else {
-        uint32_t origPixel = cxt->pixels[i];
-        uint32_t deltaPixel = deltasPtr[i];
-        uint32_t predPixel = pixel_component_sum(origPixel, deltaPixel, 3);
-        predPixelsPtr[i] = predPixel;
-      }
-    }
-    
-    // Calculate abs and mean err
-    
-    if ((genDeltas)) {
-      double cMAE = calc_combined_mean_abs_error(inputImageNumPixels, cxt->pixels, predPixelsPtr);
-      
-      fprintf(stdout, "combined MAE %0.8f\n", cMAE);
-      
-      double cMSE = calc_combined_mean_sqr_error(inputImageNumPixels, cxt->pixels, predPixelsPtr);
-      
-      fprintf(stdout, "combined MSE %0.8f\n", cMSE);
-    }
-    
-    delete [] predPixelsPtr;
+    print_residual_stats(inputImageNumPixels, deltasPtr, cxt->width, numComp);
   }
   
   // Based on the iter order and in delta gen mode, format the
@@ -228,7 +230,7 @@ post_process_rgb(PngContext *cxt,
     delete [] iterOrderedPixels;
   }
   
-  delete [] deltasPtr;
+  free(deltasPtr);
 
   // Emit step images based on iteration ordering
   
@@ -283,48 +285,695 @@ post_process_rgb(PngContext *cxt,
     }
     
     if (genDeltas) {
-      // Out = Pred = orig + err
-      
-      // Write over the first 4 pixels in upper left to simplify
-      // delta calculations
+      // Calculate error metrics in one pass over the residuals, gradclamp
+      // predicts the upper left pixels so every pixel is counted
       
-      uint32_t *predPixelsPtr = new uint32_t[inputImageNumPixels]();
-      
-      for (int i = 0; i < inputImageNumPixels; i++)
-      {
-        if (i == 0 || i == 1 || (i == cxt->width) || (i == cxt->width+1)) {
-          // Skip abs and emit zero in the upper left corner pixels case
-          predPixelsPtr[i] = deltasPtr[i];
-        } else {
-          uint32_t origPixel = cxt->pixels[i];
-          uint32_t deltaPixel = deltasPtr[i];
-          uint32_t predPixel = pixel_component_sum(origPixel, deltaPixel, 3);
-          predPixelsPtr[i] = predPixel;
-        }
+      print_residual_stats(inputImageNumPixels, deltasPtr, 0, numComp);
+    }
+  }
+  
+  return;
+}
+
+// Size of the residual bytes in iteration order after zlib compression,
+// this is used as a rough estimate of how well the residuals compress.
+
+static
+int zlib_size_of_iter_deltas(const uint32_t *deltasPtr, const vector<uint32_t> & iterOrder)
+{
+  vector<uint8_t> bytes;
+  bytes.reserve(iterOrder.size() * 3);
+  
+  for ( uint32_t offset : iterOrder ) {
+    uint32_t predErr = deltasPtr[offset];
+    bytes.push_back(predErr & 0xFF);
+    bytes.push_back((predErr >> 8) & 0xFF);
+    bytes.push_back((predErr >> 16) & 0xFF);
+  }
+  
+  uLongf compressedSize = compressBound((uLong) bytes.size());
+  vector<uint8_t> compressed(compressedSize);
+  
+  int result = compress2(compressed.data(), &compressedSize, bytes.data(), (uLong) bytes.size(), 9);
+  assert(result == Z_OK);
+  
+  return (int) compressedSize;
+}
+
+// Report the estimated bits per pixel for the CTI residuals, the estimate
+// is generated by the entropy sink as the iteration runs so no compressor
+// is needed. The gradclamp residuals are reported with the order 0 model
+// for comparison since raster order has no wait list prio.
+
+static
+void report_entropy_estimate(PngContext *cxt, const int numIterationLoops)
+{
+  const int width = cxt->width;
+  const int height = cxt->height;
+  const int numPixels = width * height;
+  
+  CTI_EntropyResidualSink<uint32_t, 3> sink;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    sink = CTI_EntropyResidualSink<uint32_t, 3>();
+    CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(cxt->pixels, width, height, sink);
+  }
+  
+  double elapsed = stop_timer(startT);
+  
+  printf("entropy CTI : elapsed %.2f : order0 %.4f bpp : prio context %.4f bpp\n", elapsed, sink.order0BitsPerPixel(), sink.contextBitsPerPixel());
+  
+  vector<uint32_t> predErr(numPixels);
+  
+  gradclamp8by4_encode_pred_error(cxt->pixels, predErr.data(), 0, numPixels, width);
+  
+  CTI_EntropyResidualSink<uint32_t, 3> gradSink;
+  
+  for (int offset = 0; offset < numPixels; offset++) {
+    gradSink.emit(offset, predErr[offset] & 0x00FFFFFF, 0);
+  }
+  
+  printf("entropy gradclamp : order0 %.4f bpp\n", gradSink.order0BitsPerPixel());
+}
+
+// Report iteration time with the split delta cache layout and the
+// interleaved layout. The iteration order and residuals must match.
+
+static
+void report_cache_layout(PngContext *cxt, const int numIterationLoops)
+{
+  const int numPixels = cxt->width * cxt->height;
+  
+  vector<uint32_t> iterOrder1;
+  vector<uint32_t> iterOrder2;
+  vector<uint32_t> deltas1(numPixels);
+  vector<uint32_t> deltas2(numPixels);
+  
+  typedef CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > OrderDeltasSink;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    CTI_ResetIterOrder(iterOrder1, numPixels);
+    OrderDeltasSink sink1(iterOrder1, deltas1.data());
+    CTI_IterateRGBWithSink<CTI_AdaptivePredictor, CTI_Struct>(cxt->pixels, cxt->width, cxt->height, sink1);
+  }
+  
+  double splitElapsed = stop_timer(startT);
+  
+  startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    CTI_ResetIterOrder(iterOrder2, numPixels);
+    OrderDeltasSink sink2(iterOrder2, deltas2.data());
+    CTI_IterateRGBWithSink<CTI_AdaptivePredictor, CTI_StructInterleaved>(cxt->pixels, cxt->width, cxt->height, sink2);
+  }
+  
+  double interleavedElapsed = stop_timer(startT);
+  
+  bool same = (iterOrder1 == iterOrder2) && (deltas1 == deltas2);
+  assert(same);
+  
+  printf("cache layout split : elapsed %.2f : interleaved : elapsed %.2f\n", splitElapsed, interleavedElapsed);
+}
+
+// Report the iteration time for BGRA pixels and for packed 24 bit
+// pixels. The image is repeated as a mirrored mosaic so that the
+// pixels and the iteration state are much larger than the caches
+// and the walk is limited by memory bandwidth. The mosaic has 16x the
+// pixels of the input image, so the loop count is divided by 16.
+
+static
+void report_packed_rgb24(PngContext *cxt, const int numIterationLoops)
+{
+  const int numLoops = max(numIterationLoops / 16, 1);
+  const int mosaicScale = 4;
+  const int width = cxt->width * mosaicScale;
+  const int height = cxt->height * mosaicScale;
+  const int numPixels = width * height;
+  
+  if (width > 0x7FFF || height > 0x7FFF) {
+    return;
+  }
+  
+  uint32_t *mosaicPixels = (uint32_t *) frame_alloc(numPixels * sizeof(uint32_t));
+  
+  for (int y = 0; y < height; y++) {
+    int srcY = y % cxt->height;
+    if ((y / cxt->height) & 0x1) {
+      srcY = cxt->height - 1 - srcY;
+    }
+    
+    for (int x = 0; x < width; x++) {
+      int srcX = x % cxt->width;
+      if ((x / cxt->width) & 0x1) {
+        srcX = cxt->width - 1 - srcX;
       }
       
-      // Calculate abs and mean err
-      
-      if ((genDeltas)) {
-        double cMAE = calc_combined_mean_abs_error(inputImageNumPixels, cxt->pixels, predPixelsPtr);
-        
-        fprintf(stdout, "combined MAE %0.8f\n", cMAE);
-        
-        double cMSE = calc_combined_mean_sqr_error(inputImageNumPixels, cxt->pixels, predPixelsPtr);
-        
-        fprintf(stdout, "combined MSE %0.8f\n", cMSE);
+      mosaicPixels[(y * width) + x] = cxt->pixels[(srcY * cxt->width) + srcX] & 0x00FFFFFF;
+    }
+  }
+  
+  uint8_t *packedPixels = (uint8_t *) frame_alloc(numPixels * 3);
+  rgb24_pack(mosaicPixels, numPixels, packedPixels);
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> packedIterOrder;
+  vector<uint32_t> deltas(numPixels);
+  vector<uint32_t> packedDeltas(numPixels);
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numLoops; i++) {
+    CTI_IterateRGB(mosaicPixels, width, height, iterOrder, deltas.data());
+  }
+  
+  double paddedElapsed = stop_timer(startT);
+  
+  startT = start_timer();
+  
+  for (int i = 0; i < numLoops; i++) {
+    CTI_IterateRGB24(packedPixels, width, height, packedIterOrder, packedDeltas.data());
+  }
+  
+  double packedElapsed = stop_timer(startT);
+  
+  bool same = (iterOrder == packedIterOrder) && (deltas == packedDeltas);
+  assert(same);
+  
+  printf("rgb %d x %d : padded 32 bit : elapsed %.2f : packed 24 bit : elapsed %.2f\n", width, height, paddedElapsed, packedElapsed);
+  
+  free(mosaicPixels);
+  free(packedPixels);
+}
+
+// Report the iteration time for BGRA pixels and for planar pixels.
+// The planar time includes the split into planes and the join of the
+// residual planes, since both are done once at the edges.
+
+static
+void report_planar_rgb(PngContext *cxt, const int numIterationLoops)
+{
+  const int width = cxt->width;
+  const int height = cxt->height;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> planarIterOrder;
+  vector<uint32_t> deltas(numPixels);
+  vector<uint32_t> planarResiduals(numPixels);
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    CTI_IterateRGB(cxt->pixels, width, height, iterOrder, deltas.data());
+  }
+  
+  double packedElapsed = stop_timer(startT);
+  
+  CTI_PlanarRGB planes;
+  CTI_PlanarRGB residualPlanes;
+  
+  startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    planes.fromPixels(cxt->pixels, numPixels);
+    CTI_IterateRGBPlanar(planes, width, height, planarIterOrder, &residualPlanes);
+    residualPlanes.toPixels(planarResiduals.data());
+  }
+  
+  double planarElapsed = stop_timer(startT);
+  
+  bool same = (iterOrder == planarIterOrder);
+  assert(same);
+  
+  for (int i = 0; i < numPixels; i++) {
+    same = (planarResiduals[i] == (deltas[iterOrder[i]] & 0x00FFFFFF));
+    assert(same);
+  }
+  
+  printf("rgb packed 32 bit : elapsed %.2f : planar : elapsed %.2f\n", packedElapsed, planarElapsed);
+}
+
+// Report the time for the scalar and the vector box delta sum over a
+// grid of H deltas where about 1/4 of the pixels are not processed.
+// Each box is centered on a pixel that is not processed with a
+// processed pixel on the left, as in CTI_BoxDeltaPredictH().
+
+static
+void report_box_delta_sum(PngContext *cxt, const int numIterationLoops)
+{
+  const int width = cxt->width;
+  const int height = cxt->height;
+  const int numPixels = width * height;
+  
+  if (width < 4 || height < 5) {
+    return;
+  }
+  
+  vector<int16_t> deltas(numPixels);
+  
+  uint32_t state = 1;
+  
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int offset = (y * width) + x;
+      state = (state * 1103515245) + 12345;
+      if (((state >> 16) & 0x3) == 0 || (x == (width - 1))) {
+        deltas[offset] = -1;
+      } else {
+        deltas[offset] = (int16_t) CTIPredict2(cxt->pixels, offset, offset + 1);
       }
-      
-      delete [] predPixelsPtr;
     }
   }
   
-  return;
+  vector<int> boxOrigins;
+  
+  for (int y = 2; y < (height - 2); y++) {
+    for (int x = 2; x < (width - 1); x++) {
+      int offset = (y * width) + x;
+      if (deltas[offset] == -1 && deltas[offset-1] != -1) {
+        boxOrigins.push_back(offset - 1 - (2 * width));
+      }
+    }
+  }
+  
+  const int numLoops = numIterationLoops * 10;
+  const int widthMinusX = width - 3;
+  
+  unsigned int scalarTotal = 0;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numLoops; i++) {
+    for ( int originOffset : boxOrigins ) {
+      scalarTotal += CTI_BoxDeltaSumScalar(deltas.data(), 3, 5, originOffset, widthMinusX, -2);
+    }
+  }
+  
+  double scalarElapsed = stop_timer(startT);
+  
+  unsigned int kernelTotal = 0;
+  
+  startT = start_timer();
+  
+  for (int i = 0; i < numLoops; i++) {
+    for ( int originOffset : boxOrigins ) {
+      kernelTotal += CTI_BoxDeltaSum(deltas.data(), 3, 5, originOffset, widthMinusX, -2);
+    }
+  }
+  
+  double kernelElapsed = stop_timer(startT);
+  
+  assert(scalarTotal == kernelTotal);
+  
+  printf("box delta sum %d boxes : scalar : elapsed %.2f : kernel : elapsed %.2f\n", (int) boxOrigins.size(), scalarElapsed, kernelElapsed);
+}
+
+// Report the time and size when the adaptive iteration is limited to
+// a fraction of the pixels and the rest are coded in raster order.
+
+static
+void report_iteration_budget(PngContext *cxt, const int numIterationLoops)
+{
+  const int numPixels = cxt->width * cxt->height;
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  
+  const int percents[] = { 100, 50, 25, 0 };
+  
+  for ( int percent : percents ) {
+    CTI_IterBudget budget(max(1, (int) (((int64_t) numPixels * percent) / 100)));
+    
+    if (percent == 100) {
+      budget = CTI_IterBudget();
+    }
+    
+    int switchPoint = 0;
+    
+    clock_t startT = start_timer();
+    
+    for (int i = 0; i < numIterationLoops; i++) {
+      CTI_ResetIterOrder(iterOrder, numPixels);
+      CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink(iterOrder, deltas.data());
+      switchPoint = CTI_IterateRGBWithBudget<CTI_AdaptivePredictor>(cxt->pixels, cxt->width, cxt->height, budget, sink);
+    }
+    
+    double elapsed = stop_timer(startT);
+    
+    int numBytes = zlib_size_of_iter_deltas(deltas.data(), iterOrder);
+    
+    printf("budget %3d%% : elapsed %.2f : switch point %d of %d : zlib residual bytes %d\n", percent, elapsed, switchPoint, numPixels, numBytes);
+  }
+}
+
+// Report the size of each level of a progressive pyramid and the size
+// of the prefix needed to decode up to that level, the single level
+// iteration is reported for comparison.
+
+static
+void report_pyramid(PngContext *cxt, const int numIterationLoops)
+{
+  const int numPixels = cxt->width * cxt->height;
+  const int numLevels = 4;
+  
+  vector<CTI_PyramidLevel> levels;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    CTI_IterateRGBPyramid(cxt->pixels, cxt->width, cxt->height, numLevels, levels);
+  }
+  
+  double elapsed = stop_timer(startT);
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  
+  CTI_IterateRGB(cxt->pixels, cxt->width, cxt->height, iterOrder, deltas.data());
+  
+  int singleBytes = zlib_size_of_iter_deltas(deltas.data(), iterOrder);
+  
+  int prefixBytes = 0;
+  
+  for ( CTI_PyramidLevel & level : levels ) {
+    int numBytes = zlib_size_of_iter_deltas(level.deltas.data(), level.iterOrder);
+    prefixBytes += numBytes;
+    printf("pyramid level %d : %d x %d : zlib residual bytes %d : prefix bytes %d\n", level.level, level.width, level.height, numBytes, prefixBytes);
+  }
+  
+  printf("pyramid : elapsed %.2f : prefix bytes %d : single level bytes %d\n", elapsed, prefixBytes, singleBytes);
+}
+
+// Report the size and time trade off for each reversible color transform
+// applied before RGB prediction. The transform kernels are timed on their
+// own and as part of the full iteration.
+
+static
+void report_color_transforms(PngContext *cxt, const int numIterationLoops)
+{
+  const int numPixels = cxt->width * cxt->height;
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  vector<uint32_t> transformed(numPixels);
+  vector<uint32_t> restored(numPixels);
+  
+  CTI_ColorTransform transforms[] = {
+    CTI_ColorTransformNone,
+    CTI_ColorTransformSubtractGreen,
+    CTI_ColorTransformYCoCgR
+  };
+  
+  for ( CTI_ColorTransform transform : transforms ) {
+    clock_t startT = start_timer();
+    
+    for (int i = 0; i < numIterationLoops; i++) {
+      color_transform_encode(transform, cxt->pixels, transformed.data(), numPixels);
+      color_transform_decode(transform, transformed.data(), restored.data(), numPixels);
+    }
+    
+    double kernelElapsed = stop_timer(startT);
+    
+    bool same = (memcmp(cxt->pixels, restored.data(), numPixels * sizeof(uint32_t)) == 0);
+    assert(same);
+    
+    startT = start_timer();
+    
+    for (int i = 0; i < numIterationLoops; i++) {
+      CTI_IterateRGBTransform(cxt->pixels,
+                              cxt->width, cxt->height,
+                              transform,
+                              iterOrder,
+                              deltas.data());
+    }
+    
+    double elapsed = stop_timer(startT);
+    
+    int numBytes = zlib_size_of_iter_deltas(deltas.data(), iterOrder);
+    
+    printf("transform %-8s : elapsed %.2f : kernel fwd+inv %.4f : zlib residual bytes %d\n", color_transform_name(transform), elapsed, kernelElapsed, numBytes);
+  }
+}
+
+// Report the size and time of tiled iteration where each tile chooses
+// between the adaptive iteration and raster MED prediction.
+
+static
+void report_tile_selection(PngContext *cxt, const int numIterationLoops)
+{
+  const int numPixels = cxt->width * cxt->height;
+  const int tileSize = 64;
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  vector<uint8_t> tileModes;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    CTI_IterateRGBTiles(cxt->pixels,
+                        cxt->width, cxt->height,
+                        tileSize,
+                        iterOrder,
+                        deltas.data(),
+                        tileModes);
+  }
+  
+  double elapsed = stop_timer(startT);
+  
+  int numMED = 0;
+  
+  for ( uint8_t mode : tileModes ) {
+    if (mode == CTI_TileModeRasterMED) {
+      numMED += 1;
+    }
+  }
+  
+  int numBytes = zlib_size_of_iter_deltas(deltas.data(), iterOrder);
+  
+  printf("tiles %dx%d : elapsed %.2f : %d of %d tiles MED : zlib residual bytes %d\n", tileSize, tileSize, elapsed, numMED, (int)tileModes.size(), numBytes);
+}
+
+// Report the time to decode a viewport from a tiled stream with a tile
+// index as compared to decoding every tile in the image.
+
+static
+void report_tile_rect_decode(PngContext *cxt, const int numIterationLoops)
+{
+  const int width = cxt->width;
+  const int height = cxt->height;
+  const int numPixels = width * height;
+  const int tileSize = 64;
+  
+  vector<uint32_t> stream;
+  CTI_TileIndex index;
+  
+  CTI_EncodeRGBTileStream(cxt->pixels, width, height, tileSize, stream, index);
+  
+  vector<uint32_t> decoded(numPixels);
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    CTI_DecodeRGBTileRect(stream.data(), index, 0, 0, width, height, decoded.data());
+  }
+  
+  double fullElapsed = stop_timer(startT);
+  
+  for (int i = 0; i < numPixels; i++) {
+    assert(decoded[i] == (cxt->pixels[i] & 0x00FFFFFF));
+  }
+  
+  // Viewport in the center of the image
+  
+  const int rectWidth = min(width, 128);
+  const int rectHeight = min(height, 128);
+  const int rectX = (width - rectWidth) / 2;
+  const int rectY = (height - rectHeight) / 2;
+  
+  vector<uint32_t> rectPixels(rectWidth * rectHeight);
+  
+  int numTiles = 0;
+  
+  startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    numTiles = CTI_DecodeRGBTileRect(stream.data(), index, rectX, rectY, rectWidth, rectHeight, rectPixels.data());
+  }
+  
+  double rectElapsed = stop_timer(startT);
+  
+  printf("tile decode full : elapsed %.2f : %d tiles : rect %dx%d : elapsed %.2f : %d tiles\n", fullElapsed, (int) (index.tileStarts.size() - 1), rectWidth, rectHeight, rectElapsed, numTiles);
+}
+
+// Report banded encoding under a memory budget, the residuals for each
+// band are written to a temp file as the band is finished.
+
+static
+void report_banded_encode(PngContext *cxt, const int numIterationLoops)
+{
+  const int width = cxt->width;
+  const int height = cxt->height;
+  const size_t memoryBudget = 1024 * 1024;
+  
+  const uint32_t * const pixelsPtr = cxt->pixels;
+  
+  auto readRowsL = [pixelsPtr, width](int y, int numRows, uint32_t * rowsPtr) {
+    memcpy(rowsPtr, &pixelsPtr[y * width], width * numRows * sizeof(uint32_t));
+  };
+  
+  CTI_TileIndex index;
+  size_t peakBytes = 0;
+  bool worked = false;
+  long numBytes = 0;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    FILE *fp = tmpfile();
+    worked = CTI_EncodeRGBBandedTileStream(readRowsL, width, height, 128, memoryBudget, fp, index, &peakBytes);
+    numBytes = ftell(fp);
+    fclose(fp);
+  }
+  
+  double elapsed = stop_timer(startT);
+  
+  printf("banded budget %d : %s : elapsed %.2f : tile size %d : peak estimate %d : wrote %ld bytes\n", (int) memoryBudget, worked ? "ok" : "failed", elapsed, index.tileSize, (int) peakBytes, numBytes);
+}
+
+// Wall clock timer, clock() measures CPU time summed over all threads
+// so it cannot be used to time multi-threaded logic.
+
+static
+double
+wall_elapsed ( const chrono::steady_clock::time_point start_time )
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+}
+
+// Report the time for the tiled stream encoded with 1, 2, 4 threads,
+// the stream and index must be identical for every thread count.
+
+static
+void report_parallel_encode(PngContext *cxt, const int numIterationLoops)
+{
+  const int tileSize = 64;
+  
+  vector<uint32_t> serialStream;
+  CTI_TileIndex serialIndex;
+  
+  CTI_EncodeRGBTileStreamParallel(cxt->pixels, cxt->width, cxt->height, tileSize, 1, serialStream, serialIndex);
+  
+  int maxThreads = (int) thread::hardware_concurrency();
+  
+  for (int numThreads = 1; numThreads <= max(maxThreads, 4); numThreads *= 2) {
+    vector<uint32_t> stream;
+    CTI_TileIndex index;
+    
+    chrono::steady_clock::time_point startT = chrono::steady_clock::now();
+    
+    for (int i = 0; i < numIterationLoops; i++) {
+      CTI_EncodeRGBTileStreamParallel(cxt->pixels, cxt->width, cxt->height, tileSize, numThreads, stream, index);
+    }
+    
+    printf("parallel tile encode %d threads : elapsed %.4f\n", numThreads, wall_elapsed(startT));
+    
+    bool same = (stream == serialStream) && (index.tileModes == serialIndex.tileModes) && (index.tileStarts == serialIndex.tileStarts);
+    assert(same);
+  }
+}
+
+// Report gradclamp decode time for the serial path and the wavefront
+// path with a range of thread counts, the output must be identical.
+
+static
+void report_gradclamp_decode(PngContext *cxt, const int numIterationLoops)
+{
+  const int width = cxt->width;
+  const int height = cxt->height;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> predErr(numPixels);
+  vector<uint32_t> serial(numPixels);
+  vector<uint32_t> decoded(numPixels);
+  
+  gradclamp8by4_encode_pred_error_rows(cxt->pixels, predErr.data(), width, 0, height);
+  
+  chrono::steady_clock::time_point startT = chrono::steady_clock::now();
+  
+  for (int i = 0; i < numIterationLoops; i++) {
+    gradclamp8by4_decode_pred_error_rows(predErr.data(), serial.data(), width, height);
+  }
+  
+  printf("gradclamp decode serial : elapsed %.4f\n", wall_elapsed(startT));
+  
+  bool same = (memcmp(cxt->pixels, serial.data(), numPixels * sizeof(uint32_t)) == 0);
+  assert(same);
+  
+  int maxThreads = (int) thread::hardware_concurrency();
+  
+  for (int numThreads = 1; numThreads <= max(maxThreads, 4); numThreads *= 2) {
+    startT = chrono::steady_clock::now();
+    
+    for (int i = 0; i < numIterationLoops; i++) {
+      gradclamp8by4_decode_pred_error_wavefront(predErr.data(), decoded.data(), width, height, numThreads);
+    }
+    
+    printf("gradclamp decode wavefront %d threads : elapsed %.4f\n", numThreads, wall_elapsed(startT));
+    
+    same = (serial == decoded);
+    assert(same);
+  }
+}
+
+// Process a palette image read with read_png_file_indexed(). The
+// palette and the index plane from the PNG are passed to
+// CTI_IterateTable256() as is, so the pixels are not expanded and the
+// palette is not rebuilt from a histogram. The pixels are expanded
+// after the timed iteration only for the iteration step dumps.
+
+void
+__attribute__ ((noinline))
+process_indexed_file(PngContext *cxt)
+{
+  int inputImageNumPixels = cxt->width * cxt->height;
+  
+  printf("read  %d palette indexes from input image : %d colors\n", inputImageNumPixels, cxt->numPaletteColors);
+  
+  vector<uint32_t> iterOrder;
+  
+  const int numIterationLoops = 10;
+  
+  clock_t startT = start_timer();
+  
+  for (int i = 0; i < numIterationLoops; i++)
+  {
+    CTI_IterateTable256(
+                cxt->palette,
+                cxt->numPaletteColors,
+                cxt->indexes,
+                cxt->width, cxt->height,
+                iterOrder);
+  }
+  
+  double elapsed = stop_timer(startT);
+  
+  printf("elapsed %.2f\n", elapsed);
+  
+  cout << "done : processed " << iterOrder.size() << endl;
+  
+  PngContext_expand_indexes(cxt);
+  
+  post_process_iter(cxt, iterOrder);
 }
 
 void
 __attribute__ ((noinline))
-process_file(PngContext *cxt)
+process_file(PngContext *cxt, const bool bench = false)
 {
   int inputImageNumPixels = cxt->width * cxt->height;
   
@@ -452,7 +1101,7 @@ process_file(PngContext *cxt)
     const bool genDeltas = true;
     
     if (genDeltas) {
-      deltasPtr = new uint32_t[inputImageNumPixels]();
+      deltasPtr = (uint32_t *) frame_calloc(inputImageNumPixels, sizeof(uint32_t));
     }
     
     // Dump indexes output
@@ -519,6 +1168,51 @@ process_file(PngContext *cxt)
     cout << "done : processed " << iterOrder.size() << endl;
     
     post_process_iter(cxt, iterOrder);
+  } else if (cxt->hasAlpha) {
+    // 4 component RGBA processing, the 3 component RGB path is
+    // also timed on the same input as a baseline comparison.
+    
+    const bool genDeltas = true;
+    
+    if (genDeltas) {
+      deltasPtr = (uint32_t *) frame_calloc(inputImageNumPixels, sizeof(uint32_t));
+    }
+    
+    startT = start_timer();
+    
+    for (int i = 0; i < numIterationLoops; i++)
+    {
+      CTI_IterateRGB(cxt->pixels,
+                  cxt->width, cxt->height,
+                  iterOrder,
+                  deltasPtr);
+    }
+    
+    elapsed = stop_timer(startT);
+    
+    printf("elapsed RGB %.2f\n", elapsed);
+    
+    startT = start_timer();
+    
+    for (int i = 0; i < numIterationLoops; i++)
+    {
+      CTI_IterateRGBA(cxt->pixels,
+                  cxt->width, cxt->height,
+                  iterOrder,
+                  deltasPtr);
+    }
+    
+    elapsed = stop_timer(startT);
+    
+    printf("elapsed RGBA %.2f\n", elapsed);
+    
+    cout << "done : processed " << iterOrder.size() << endl;
+    
+    post_process_rgb(cxt,
+                     genDeltas,
+                     deltasPtr,
+                     iterOrder,
+                     4);
   } else {
     // 3 component RGB processing
     
@@ -528,7 +1222,7 @@ process_file(PngContext *cxt)
     const bool genDeltas = true;
     
     if (genDeltas) {
-      deltasPtr = new uint32_t[inputImageNumPixels]();
+      deltasPtr = (uint32_t *) frame_calloc(inputImageNumPixels, sizeof(uint32_t));
     }
     
     startT = start_timer();
@@ -548,6 +1242,36 @@ process_file(PngContext *cxt)
     
     cout << "done : processed " << iterOrder.size() << endl;
     
+    // The benchmark reports run only with -bench
+    
+    if (bench) {
+      report_entropy_estimate(cxt, numIterationLoops);
+      
+      report_cache_layout(cxt, numIterationLoops);
+      
+      report_packed_rgb24(cxt, numIterationLoops);
+      
+      report_planar_rgb(cxt, numIterationLoops);
+      
+      report_box_delta_sum(cxt, numIterationLoops);
+      
+      report_iteration_budget(cxt, numIterationLoops);
+      
+      report_pyramid(cxt, numIterationLoops);
+      
+      report_color_transforms(cxt, numIterationLoops);
+      
+      report_tile_selection(cxt, numIterationLoops);
+      
+      report_tile_rect_decode(cxt, numIterationLoops);
+      
+      report_parallel_encode(cxt, numIterationLoops);
+      
+      report_banded_encode(cxt, numIterationLoops);
+      
+      report_gradclamp_decode(cxt, numIterationLoops);
+    }
+    
     post_process_rgb(cxt,
                      genDeltas,
                      deltasPtr,
@@ -700,14 +1424,443 @@ void cleanup(PngContext *cxt)
   PngContext_dealloc(cxt);
 }
 
+// Process a raw buffer of 16 bit samples such as a DICOM export.
+// The file contains (width * height * numChannels) little endian
+// 16 bit samples where numChannels is 1 for Gray16 or 3 for RGB48
+// in (R G B) order.
+
+void
+__attribute__ ((noinline))
+process_raw16_file(const char *filename, int width, int height, int numChannels)
+{
+  int numPixels = width * height;
+  int numSamples = numPixels * numChannels;
+  
+  vector<uint16_t> samples(numSamples);
+  
+  FILE *fp = fopen(filename, "rb");
+  
+  if (fp == NULL) {
+    fprintf(stderr, "could not open raw file \"%s\"\n", filename);
+    exit(1);
+  }
+  
+  size_t numRead = fread(samples.data(), sizeof(uint16_t), numSamples, fp);
+  fclose(fp);
+  
+  if (numRead != (size_t) numSamples) {
+    fprintf(stderr, "raw file \"%s\" contains %d samples, expected %d\n", filename, (int)numRead, numSamples);
+    exit(1);
+  }
+  
+  vector<uint32_t> iterOrder;
+  uint64_t *deltasPtr = new uint64_t[numPixels]();
+  
+  clock_t startT;
+  double elapsed;
+  
+  const int numIterationLoops = 10;
+  
+  startT = start_timer();
+  
+  if (numChannels == 1) {
+    for (int i = 0; i < numIterationLoops; i++) {
+      CTI_IterateGray16(samples.data(),
+                        width, height,
+                        iterOrder,
+                        deltasPtr);
+    }
+  } else {
+    vector<uint64_t> pixels(numPixels);
+    
+    for (int i = 0; i < numPixels; i++) {
+      uint64_t R = samples[(i * 3) + 0];
+      uint64_t G = samples[(i * 3) + 1];
+      uint64_t B = samples[(i * 3) + 2];
+      pixels[i] = (R << 32) | (G << 16) | B;
+    }
+    
+    for (int i = 0; i < numIterationLoops; i++) {
+      CTI_IterateRGB48(pixels.data(),
+                       width, height,
+                       iterOrder,
+                       deltasPtr);
+    }
+  }
+  
+  elapsed = stop_timer(startT);
+  
+  printf("elapsed %.2f\n", elapsed);
+  
+  cout << "done : processed " << iterOrder.size() << endl;
+  
+  // Mean abs residual over each component, not counting the upper left pixels
+  
+  double sumAbs = 0.0;
+  
+  for (int i = 0; i < numPixels; i++) {
+    if (i == 0 || i == 1 || (i == width) || (i == width+1)) {
+      continue;
+    }
+    
+    for (int comp = 0; comp < numChannels; comp++) {
+      int16_t residual = (int16_t) pixel16_component(deltasPtr[i], comp);
+      sumAbs += abs((int)residual);
+    }
+  }
+  
+  fprintf(stdout, "residual MAE %0.8f\n", sumAbs / ((numPixels - 4) * (double)numChannels));
+  
+  delete [] deltasPtr;
+}
+
+// An image in a batch, the pixels are read into the context and the
+// encode stage writes the residual bytes in iteration order along with
+// the number of bytes for each residual.
+
+typedef struct {
+  PngContext cxt;
+  vector<uint8_t> residualBytes;
+  int bytesPerResidual;
+} BatchItem;
+
+// Ask the OS to start reading a file into the page cache so that the
+// read of the next image does not wait on the disk.
+
+static
+void readahead_file(const char *filename)
+{
+#if defined(POSIX_FADV_WILLNEED)
+  int fd = open(filename, O_RDONLY);
+  
+  if (fd == -1) {
+    return;
+  }
+  
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#endif // POSIX_FADV_WILLNEED
+}
+
+// Both batch modes code an opaque image where R G B are equal for
+// every pixel as gray bytes.
+
+static
+bool batch_is_gray(const PngContext *cxt)
+{
+  if (cxt->hasAlpha) {
+    return false;
+  }
+  
+  const int numPixels = cxt->width * cxt->height;
+  
+  for (int p = 0; p < numPixels; p++) {
+    uint32_t pixel = cxt->pixels[p];
+    uint32_t B = pixel & 0xFF;
+    
+    if ((((pixel >> 8) & 0xFF) != B) || (((pixel >> 16) & 0xFF) != B)) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+static
+void batch_gray_bytes(const PngContext *cxt, vector<uint8_t> & grayBytes)
+{
+  const int numPixels = cxt->width * cxt->height;
+  
+  grayBytes.resize(numPixels);
+  
+  for (int p = 0; p < numPixels; p++) {
+    grayBytes[p] = cxt->pixels[p] & 0xFF;
+  }
+}
+
+// A tiled batch image has its tile index ahead of the residuals. The
+// index is the tile size as 4 bytes, one mode byte for each tile, and
+// then the numTiles+1 tile starts as 8 bytes each, all little endian.
+// The number of tiles follows from the width and height in the file
+// header and the tile size.
+
+static
+void append_tile_index(const CTI_TileIndex & index, vector<uint8_t> & bytes)
+{
+  for (int b = 0; b < 4; b++) {
+    bytes.push_back((index.tileSize >> (b * 8)) & 0xFF);
+  }
+  
+  bytes.insert(bytes.end(), index.tileModes.begin(), index.tileModes.end());
+  
+  for ( uint64_t start : index.tileStarts ) {
+    for (int b = 0; b < 8; b++) {
+      bytes.push_back((start >> (b * 8)) & 0xFF);
+    }
+  }
+}
+
+// Compress the residual bytes for batch image i with zlib and write
+// them as batch_N.ctiz in the current directory. Both batch modes
+// write the same layout, a 16 byte header and then the zlib data. The
+// header is the magic "CTIB", the width and height as 4 bytes each
+// little endian, the number of bytes for each residual (1 gray, 3 RGB,
+// 4 RGBA), a tiled flag, and 2 zero bytes. When the tiled flag is set
+// the zlib data starts with the tile index from append_tile_index().
+
+#define BATCH_FILE_HEADER_SIZE 16
+
+static
+void write_batch_file(const char *filename, int i, int width, int height, int bytesPerResidual, bool isTiled, const vector<uint8_t> & residualBytes)
+{
+  uint8_t header[BATCH_FILE_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  memcpy(header, "CTIB", 4);
+  
+  for (int b = 0; b < 4; b++) {
+    header[4 + b] = (width >> (b * 8)) & 0xFF;
+    header[8 + b] = (height >> (b * 8)) & 0xFF;
+  }
+  
+  header[12] = (uint8_t) bytesPerResidual;
+  header[13] = isTiled ? 1 : 0;
+  
+  uLongf compressedSize = compressBound((uLong) residualBytes.size());
+  vector<uint8_t> compressed(compressedSize);
+  
+  int result = compress2(compressed.data(), &compressedSize, residualBytes.data(), (uLong) residualBytes.size(), 9);
+  assert(result == Z_OK);
+  
+  char outFilename[64];
+  snprintf(outFilename, sizeof(outFilename), "batch_%d.ctiz", i);
+  
+  FILE *fp = fopen(outFilename, "wb");
+  
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for writing\n", outFilename);
+    exit(1);
+  }
+  
+  fwrite(header, 1, sizeof(header), fp);
+  fwrite(compressed.data(), 1, compressedSize, fp);
+  fclose(fp);
+  
+  printf("%s : %d x %d : wrote %s : %d bytes\n", filename, width, height, outFilename, (int) (sizeof(header) + compressedSize));
+}
+
+// Encode a batch of PNG images where reading, encoding, and writing
+// overlap. Image N is encoded while image N+1 is read and decoded and
+// image N-1 is compressed with zlib and written as batch_N.ctiz in the
+// current directory.
+
+void
+process_batch(int numFiles, char **filenames)
+{
+  auto readL = [numFiles, filenames](int i, BatchItem & item) {
+    if ((i + 1) < numFiles) {
+      readahead_file(filenames[i + 1]);
+    }
+    
+    read_png_file(filenames[i], &item.cxt);
+  };
+  
+  auto encodeL = [](int i, BatchItem & item) {
+    PngContext *cxt = &item.cxt;
+    const int numPixels = cxt->width * cxt->height;
+    
+    if (batch_is_gray(cxt)) {
+      vector<uint8_t> grayBytes;
+      batch_gray_bytes(cxt, grayBytes);
+      
+      vector<uint32_t> iterOrder;
+      vector<uint32_t> deltas(numPixels);
+      
+      CTI_IterateGray(grayBytes.data(), cxt->width, cxt->height, iterOrder, deltas.data());
+      
+      item.bytesPerResidual = 1;
+      item.residualBytes.reserve(numPixels);
+      
+      for ( uint32_t offset : iterOrder ) {
+        item.residualBytes.push_back(deltas[offset] & 0xFF);
+      }
+    } else if (cxt->hasAlpha) {
+      vector<uint32_t> iterOrder;
+      vector<uint32_t> deltas(numPixels);
+      
+      CTI_IterateRGBA(cxt->pixels, cxt->width, cxt->height, iterOrder, deltas.data());
+      
+      item.bytesPerResidual = 4;
+      item.residualBytes.reserve(numPixels * 4);
+      
+      for ( uint32_t offset : iterOrder ) {
+        uint32_t predErr = deltas[offset];
+        item.residualBytes.push_back(predErr & 0xFF);
+        item.residualBytes.push_back((predErr >> 8) & 0xFF);
+        item.residualBytes.push_back((predErr >> 16) & 0xFF);
+        item.residualBytes.push_back((predErr >> 24) & 0xFF);
+      }
+    } else {
+      vector<uint32_t> stream;
+      stream.reserve(numPixels);
+      
+      CTI_StreamResidualSink sink(stream);
+      CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(cxt->pixels, cxt->width, cxt->height, sink);
+      
+      item.bytesPerResidual = 3;
+      item.residualBytes.reserve(numPixels * 3);
+      
+      for ( uint32_t predErr : stream ) {
+        item.residualBytes.push_back(predErr & 0xFF);
+        item.residualBytes.push_back((predErr >> 8) & 0xFF);
+        item.residualBytes.push_back((predErr >> 16) & 0xFF);
+      }
+    }
+  };
+  
+  auto writeL = [filenames](int i, BatchItem & item) {
+    write_batch_file(filenames[i], i, item.cxt.width, item.cxt.height, item.bytesPerResidual, false, item.residualBytes);
+    
+    PngContext_dealloc(&item.cxt);
+  };
+  
+  PipelineStageStats stats[3];
+  
+  double wallSeconds = batch_pipeline_run<BatchItem>(numFiles, readL, encodeL, writeL, stats);
+  
+  const char *stageNames[] = { "read", "encode", "write" };
+  
+  double sumBusy = 0.0;
+  
+  for (int stage = 0; stage < 3; stage++) {
+    printf("stage %-6s : busy %.2f : utilisation %.1f%%\n", stageNames[stage], stats[stage].busySeconds, stats[stage].utilisation(wallSeconds) * 100.0);
+    sumBusy += stats[stage].busySeconds;
+  }
+  
+  printf("batch %d images : wall %.2f : serial estimate %.2f\n", numFiles, wallSeconds, sumBusy);
+}
+
+// Encode a batch of PNG images of mixed sizes on all cores. Every image
+// is read first, a large RGB image is split into tile jobs, and small
+// images are grouped. Idle workers steal jobs from busy workers and the
+// number of steals and the utilisation of each worker are reported.
+
+void
+process_batch_steal(int numFiles, char **filenames)
+{
+  vector<PngContext> contexts(numFiles);
+  vector<vector<uint8_t> > grayPlanes(numFiles);
+  vector<CTI_BatchImage> images(numFiles);
+  
+  for (int i = 0; i < numFiles; i++) {
+    PngContext *cxt = &contexts[i];
+    read_png_file(filenames[i], cxt);
+    
+    images[i].width = cxt->width;
+    images[i].height = cxt->height;
+    
+    if (batch_is_gray(cxt)) {
+      batch_gray_bytes(cxt, grayPlanes[i]);
+      images[i].grayPixels = grayPlanes[i].data();
+    } else {
+      images[i].rgbPixels = cxt->pixels;
+      images[i].hasAlpha = cxt->hasAlpha;
+    }
+  }
+  
+  const int numThreads = max((int) thread::hardware_concurrency(), 1);
+  
+  WorkStealingStats stats;
+  
+  CTI_EncodeBatch(images, numThreads, stats);
+  
+  for (int i = 0; i < numFiles; i++) {
+    const int bytesPerResidual = images[i].grayPixels ? 1 : (images[i].hasAlpha ? 4 : 3);
+    
+    vector<uint8_t> residualBytes;
+    residualBytes.reserve(images[i].stream.size() * bytesPerResidual);
+    
+    if (images[i].isTiled) {
+      append_tile_index(images[i].index, residualBytes);
+    }
+    
+    for ( uint32_t predErr : images[i].stream ) {
+      for (int b = 0; b < bytesPerResidual; b++) {
+        residualBytes.push_back((predErr >> (b * 8)) & 0xFF);
+      }
+    }
+    
+    write_batch_file(filenames[i], i, images[i].width, images[i].height, bytesPerResidual, images[i].isTiled, residualBytes);
+    
+    PngContext_dealloc(&contexts[i]);
+  }
+  
+  int numJobs = 0;
+  
+  for (int worker = 0; worker < numThreads; worker++) {
+    printf("worker %2d : jobs %d : steals %d : busy %.2f : utilisation %.1f%%\n", worker, stats.numJobs[worker], stats.numSteals[worker], stats.busySeconds[worker], stats.utilisation(worker) * 100.0);
+    numJobs += stats.numJobs[worker];
+  }
+  
+  printf("batch %d images : %d jobs : %d steals : wall %.2f\n", numFiles, numJobs, stats.totalSteals(), stats.wallSeconds);
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  if (argc >= 3 && strcmp(argv[1], "-batch") == 0) {
+    process_batch(argc - 2, &argv[2]);
+    return 0;
+  }
+  
+  if (argc >= 3 && strcmp(argv[1], "-batchsteal") == 0) {
+    process_batch_steal(argc - 2, &argv[2]);
+    return 0;
+  }
+  
+  if (argc == 3 && strcmp(argv[1], "-indexed") == 0) {
+    PngContext cxt;
+    fprintf(stdout, "reading PNG \"%s\"\n", argv[2]);
+    read_png_file_indexed(argv[2], &cxt);
+    
+    if (cxt.indexes != NULL) {
+      process_indexed_file(&cxt);
+    } else {
+      process_file(&cxt);
+    }
+    
+    cleanup(&cxt);
+    return 0;
+  }
+  
+  if (argc >= 2 && strcmp(argv[1], "-raw16") == 0) {
+    int width = (argc == 6) ? atoi(argv[3]) : 0;
+    int height = (argc == 6) ? atoi(argv[4]) : 0;
+    int numChannels = (argc == 6) ? atoi(argv[5]) : 0;
+    
+    if (width < 2 || height < 2 || (numChannels != 1 && numChannels != 3)) {
+      fprintf(stderr, "usage miniterorder -raw16 RAW16 WIDTH HEIGHT (1|3)\n");
+      exit(1);
+    }
+    
+    fprintf(stdout, "reading raw 16 bit \"%s\"\n", argv[2]);
+    process_raw16_file(argv[2], width, height, numChannels);
+    return 0;
+  }
+  
+  const bool bench = (argc == 3 && strcmp(argv[1], "-bench") == 0);
+  
+  if (argc != 2 && !bench) {
     fprintf(stderr, "usage miniterorder PNG\n");
+    fprintf(stderr, "usage miniterorder -bench PNG\n");
+    fprintf(stderr, "usage miniterorder -raw16 RAW16 WIDTH HEIGHT (1|3)\n");
+    fprintf(stderr, "usage miniterorder -batch PNG ...\n");
+    fprintf(stderr, "usage miniterorder -batchsteal PNG ...\n");
+    fprintf(stderr, "usage miniterorder -indexed PNG\n");
     exit(1);
   }
+  char *filename = argv[argc - 1];
+  
   PngContext cxt;
-  fprintf(stdout, "reading PNG \"%s\"\n", argv[1]);
-  read_png_file(argv[1], &cxt);
+  fprintf(stdout, "reading PNG \"%s\"\n", filename);
+  read_png_file(filename, &cxt);
   
   if ((0)) {
     // Write input data just read back out to a PNG image to make sure read/write logic
@@ -736,7 +1889,7 @@ int main(int argc, char **argv) {
 
   printf("processing %d pixels from image of dimensions %d x %d\n", cxt.width*cxt.height, cxt.width, cxt.height);
   
-  process_file(&cxt);
+  process_file(&cxt, bench);
   
   cleanup(&cxt);
   return 0;
@@ -0,0 +1,201 @@
+//
+//  BatchPipeline.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  A three stage pipeline for batch processing of images. Each stage
+//  runs on its own thread and the stages are connected by bounded
+//  queues, so while image N is being encoded image N+1 is being read
+//  and image N-1 is being written. A bounded queue blocks the stage
+//  that gets ahead, this caps the number of images held in memory.
+
+#ifndef BATCH_PIPELINE_H
+#define BATCH_PIPELINE_H
+
+#include "assert.h"
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+
+using namespace std;
+
+// Default number of items that can wait between two stages
+
+#define BATCH_PIPELINE_QUEUE_SIZE 2
+
+// Queue with a fixed capacity where push() blocks while the queue is
+// full and pop() blocks while the queue is empty. Once the producer
+// invokes close() pop() returns false after the last item.
+
+template <typename T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(int inCapacity)
+  : capacity(inCapacity), maxItems(0), isClosed(false)
+  {
+#if defined(DEBUG)
+    assert(capacity > 0);
+#endif // DEBUG
+  }
+
+  void push(T item) {
+    unique_lock<mutex> lock(queueMutex);
+    notFull.wait(lock, [this]{ return ((int) items.size()) < capacity; });
+    items.push_back(move(item));
+    if (((int) items.size()) > maxItems) {
+      maxItems = (int) items.size();
+    }
+    notEmpty.notify_one();
+  }
+
+  bool pop(T & item) {
+    unique_lock<mutex> lock(queueMutex);
+    notEmpty.wait(lock, [this]{ return !items.empty() || isClosed; });
+
+    if (items.empty()) {
+      return false;
+    }
+
+    item = move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> lock(queueMutex);
+    isClosed = true;
+    notEmpty.notify_all();
+  }
+
+  // Largest number of items held at once
+
+  int maxSize() {
+    lock_guard<mutex> lock(queueMutex);
+    return maxItems;
+  }
+
+private:
+  const int capacity;
+  int maxItems;
+  bool isClosed;
+  deque<T> items;
+  mutex queueMutex;
+  condition_variable notFull;
+  condition_variable notEmpty;
+};
+
+// Time that a stage spends working on items, the rest of the
+// wall time the stage is blocked on a queue.
+
+class PipelineStageStats
+{
+public:
+  int numItems;
+  double busySeconds;
+
+  PipelineStageStats()
+  : numItems(0), busySeconds(0.0)
+  {
+  }
+
+  // Fraction of the wall time that the stage was working
+
+  double utilisation(double wallSeconds) const {
+    if (wallSeconds <= 0.0) {
+      return 0.0;
+    }
+    return busySeconds / wallSeconds;
+  }
+};
+
+// Run numItems items through the read, encode, and write stages. Each
+// function is invoked with the item index and a reference to the item,
+// the read stage allocates the item and each item is passed to the
+// encode and write stages in order. The calling thread runs the encode
+// stage. Stats for the 3 stages are written to stats and the wall time
+// is returned.
+
+template <typename Item, typename ReadFunc, typename EncodeFunc, typename WriteFunc>
+static inline
+double batch_pipeline_run(const int numItems,
+                          ReadFunc readFunc,
+                          EncodeFunc encodeFunc,
+                          WriteFunc writeFunc,
+                          PipelineStageStats stats[3],
+                          const int queueSize = BATCH_PIPELINE_QUEUE_SIZE)
+{
+  const bool debug = false;
+
+  typedef chrono::steady_clock Clock;
+  typedef pair<int, unique_ptr<Item> > IndexedItem;
+
+  BoundedQueue<IndexedItem> readQueue(queueSize);
+  BoundedQueue<IndexedItem> writeQueue(queueSize);
+
+  for (int i = 0; i < 3; i++) {
+    stats[i] = PipelineStageStats();
+  }
+
+  auto secondsSince = [](Clock::time_point startT)->double {
+    chrono::duration<double> elapsed = Clock::now() - startT;
+    return elapsed.count();
+  };
+
+  Clock::time_point wallStartT = Clock::now();
+
+  thread readThread([&]() {
+    for (int i = 0; i < numItems; i++) {
+      Clock::time_point startT = Clock::now();
+      unique_ptr<Item> item(new Item());
+      readFunc(i, *item);
+      stats[0].busySeconds += secondsSince(startT);
+      stats[0].numItems += 1;
+      readQueue.push(IndexedItem(i, move(item)));
+    }
+    readQueue.close();
+  });
+
+  thread writeThread([&]() {
+    IndexedItem indexedItem;
+    while (writeQueue.pop(indexedItem)) {
+      Clock::time_point startT = Clock::now();
+      writeFunc(indexedItem.first, *indexedItem.second);
+      indexedItem.second.reset();
+      stats[2].busySeconds += secondsSince(startT);
+      stats[2].numItems += 1;
+    }
+  });
+
+  IndexedItem indexedItem;
+
+  while (readQueue.pop(indexedItem)) {
+    Clock::time_point startT = Clock::now();
+    encodeFunc(indexedItem.first, *indexedItem.second);
+    stats[1].busySeconds += secondsSince(startT);
+    stats[1].numItems += 1;
+    writeQueue.push(move(indexedItem));
+  }
+
+  writeQueue.close();
+
+  readThread.join();
+  writeThread.join();
+
+  double wallSeconds = secondsSince(wallStartT);
+
+  if (debug) {
+    printf("batch_pipeline_run %d items : wall %.2f : read %.2f : encode %.2f : write %.2f\n", numItems, wallSeconds, stats[0].busySeconds, stats[1].busySeconds, stats[2].busySeconds);
+  }
+
+  return wallSeconds;
+}
+
+#endif // BATCH_PIPELINE_H
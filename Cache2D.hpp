@@ -33,6 +33,8 @@
 
 #include "PredFuncs.hpp"
 
+#include "FrameAlloc.h"
+
 using namespace std;
 
 template <class T, const bool isHorizontal>
@@ -55,6 +57,10 @@ public:
     
     values.reserve(N);
     
+    // Advise before the values are written so that huge pages can be used
+    
+    frame_buffer_advise(values.data(), N * sizeof(T));
+    
     for (int i = 0; i < N; i++) {
       values.push_back(defaultValue); // copy of default object state
     }
@@ -3,6 +3,17 @@
 //
 // See LICENSE for terms.
 
+#include "assert.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif // __SSE2__
+
 // Signed add/sub for each component
 
 #define RSHIFT_MASK(num, shift, mask) ((num >> shift) & mask)
@@ -262,3 +273,207 @@ double calc_combined_mean_sqr_error(uint32_t numPixels,
   
   return cMAE;
 }
+
+// Statistics for a buffer of residuals where each residual is the
+// signed 8 bit error (actual - predicted) for each component. The
+// sums and max are per channel in (B G R A) order while the
+// combined values are over the 3 color channels to match
+// calc_combined_mean_abs_error() and calc_combined_mean_sqr_error().
+
+typedef struct {
+  uint32_t numPixels;
+  
+  uint64_t sumAbs[4];
+  uint64_t sumSqr[4];
+  uint32_t maxAbs[4];
+  
+  // Count of each residual byte value for each channel, the
+  // index is the residual as an unsigned byte.
+  
+  uint32_t histogram[4][256];
+  
+  double combinedMAE;
+  double combinedMSE;
+  double psnr;
+  uint32_t maxError;
+} ResidualStats;
+
+// Add the abs, square, max, and histogram values for one residual pixel
+
+static inline
+void residual_stats_add_pixel(ResidualStats *stats, uint32_t residual) {
+  for (int comp = 0; comp < 4; comp++) {
+    uint32_t byteVal = (residual >> (comp * 8)) & 0xFF;
+    uint32_t absVal = abs((int)((int8_t) byteVal));
+    stats->sumAbs[comp] += absVal;
+    stats->sumSqr[comp] += absVal * absVal;
+    stats->histogram[comp][byteVal] += 1;
+    if (absVal > stats->maxAbs[comp]) {
+      stats->maxAbs[comp] = absVal;
+    }
+  }
+}
+
+// Accumulate stats for the residuals in the range (start, end)
+
+static inline
+void calc_residual_stats_range(const uint32_t * const residuals,
+                               int start,
+                               const int end,
+                               ResidualStats *stats)
+{
+  int i = start;
+  
+#if defined(__SSE2__)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    
+    // 32 bit lanes hold (B G R A) sums for a group of pixels, the square
+    // lanes can add at most (4 * 128 * 128) per step so these are flushed
+    // into the 64 bit totals before a lane can overflow.
+    
+    const int flushSteps = 16384;
+    
+    __m128i maxVec = zero;
+    
+    uint32_t histogram2[4][256];
+    memset(histogram2, 0, sizeof(histogram2));
+    
+    while ((i + 4) <= end) {
+      __m128i absAcc = zero;
+      __m128i sqrAcc = zero;
+      
+      for (int step = 0; step < flushSteps && (i + 4) <= end; step++, i += 4) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) &residuals[i]);
+        
+        // abs() of each signed byte, -128 becomes 128 as an unsigned byte
+        
+        __m128i negMask = _mm_cmpgt_epi8(zero, vec);
+        __m128i absVec = _mm_sub_epi8(_mm_xor_si128(vec, negMask), negMask);
+        
+        maxVec = _mm_max_epu8(maxVec, absVec);
+        
+        __m128i abs01 = _mm_unpacklo_epi8(absVec, zero);
+        __m128i abs23 = _mm_unpackhi_epi8(absVec, zero);
+        
+        __m128i sqr01 = _mm_mullo_epi16(abs01, abs01);
+        __m128i sqr23 = _mm_mullo_epi16(abs23, abs23);
+        
+        absAcc = _mm_add_epi32(absAcc, _mm_add_epi32(_mm_unpacklo_epi16(abs01, zero), _mm_unpackhi_epi16(abs01, zero)));
+        absAcc = _mm_add_epi32(absAcc, _mm_add_epi32(_mm_unpacklo_epi16(abs23, zero), _mm_unpackhi_epi16(abs23, zero)));
+        
+        sqrAcc = _mm_add_epi32(sqrAcc, _mm_add_epi32(_mm_unpacklo_epi16(sqr01, zero), _mm_unpackhi_epi16(sqr01, zero)));
+        sqrAcc = _mm_add_epi32(sqrAcc, _mm_add_epi32(_mm_unpacklo_epi16(sqr23, zero), _mm_unpackhi_epi16(sqr23, zero)));
+        
+        // Alternate pixels are counted in a second histogram so that
+        // increments of the same bin do not stall on each other.
+        
+        for (int j = 0; j < 4; j += 2) {
+          uint32_t residual = residuals[i + j];
+          stats->histogram[0][residual & 0xFF] += 1;
+          stats->histogram[1][(residual >> 8) & 0xFF] += 1;
+          stats->histogram[2][(residual >> 16) & 0xFF] += 1;
+          stats->histogram[3][residual >> 24] += 1;
+          
+          residual = residuals[i + j + 1];
+          histogram2[0][residual & 0xFF] += 1;
+          histogram2[1][(residual >> 8) & 0xFF] += 1;
+          histogram2[2][(residual >> 16) & 0xFF] += 1;
+          histogram2[3][residual >> 24] += 1;
+        }
+      }
+      
+      uint32_t absLanes[4];
+      uint32_t sqrLanes[4];
+      _mm_storeu_si128((__m128i *) absLanes, absAcc);
+      _mm_storeu_si128((__m128i *) sqrLanes, sqrAcc);
+      
+      for (int comp = 0; comp < 4; comp++) {
+        stats->sumAbs[comp] += absLanes[comp];
+        stats->sumSqr[comp] += sqrLanes[comp];
+      }
+    }
+    
+    for (int comp = 0; comp < 4; comp++) {
+      for (int bin = 0; bin < 256; bin++) {
+        stats->histogram[comp][bin] += histogram2[comp][bin];
+      }
+    }
+    
+    uint32_t maxLanes[4];
+    _mm_storeu_si128((__m128i *) maxLanes, maxVec);
+    
+    for (int j = 0; j < 4; j++) {
+      for (int comp = 0; comp < 4; comp++) {
+        uint32_t maxVal = (maxLanes[j] >> (comp * 8)) & 0xFF;
+        if (maxVal > stats->maxAbs[comp]) {
+          stats->maxAbs[comp] = maxVal;
+        }
+      }
+    }
+  }
+#endif // __SSE2__
+  
+  for ( ; i < end; i++) {
+    residual_stats_add_pixel(stats, residuals[i]);
+  }
+  
+  return;
+}
+
+// Fill in stats in one pass over a residual buffer without creating a
+// predicted frame. When width is not zero the 2x2 block of pixels in
+// the upper left corner is counted as a zero residual since those
+// pixels are emitted directly and not as a prediction error.
+
+static inline
+void calc_residual_stats(const uint32_t numPixels,
+                         const uint32_t * const residuals,
+                         const int width,
+                         ResidualStats *stats)
+{
+  memset(stats, 0, sizeof(ResidualStats));
+  stats->numPixels = numPixels;
+  
+  if (width > 0) {
+#if defined(DEBUG)
+    assert(width >= 2);
+    assert(numPixels >= (width * 2));
+#endif // DEBUG
+    
+    calc_residual_stats_range(residuals, 2, width, stats);
+    calc_residual_stats_range(residuals, width + 2, numPixels, stats);
+    
+    for (int comp = 0; comp < 4; comp++) {
+      stats->histogram[comp][0] += 4;
+    }
+  } else {
+    calc_residual_stats_range(residuals, 0, numPixels, stats);
+  }
+  
+  uint64_t sumAbs = stats->sumAbs[0] + stats->sumAbs[1] + stats->sumAbs[2];
+  uint64_t sumSqr = stats->sumSqr[0] + stats->sumSqr[1] + stats->sumSqr[2];
+  
+  stats->combinedMAE = ((double) sumAbs) / numPixels;
+  stats->combinedMSE = ((double) sumSqr) / numPixels;
+  
+  // PSNR is in terms of the mean squared error of one component
+  
+  double componentMSE = stats->combinedMSE / 3.0;
+  
+  if (componentMSE == 0.0) {
+    stats->psnr = INFINITY;
+  } else {
+    stats->psnr = 10.0 * log10((255.0 * 255.0) / componentMSE);
+  }
+  
+  stats->maxError = stats->maxAbs[0];
+  if (stats->maxAbs[1] > stats->maxError) {
+    stats->maxError = stats->maxAbs[1];
+  }
+  if (stats->maxAbs[2] > stats->maxError) {
+    stats->maxError = stats->maxAbs[2];
+  }
+  
+  return;
+}
@@ -0,0 +1,270 @@
+//
+//  ColorTransform.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Reversible color transforms applied to BGRA pixels before
+//  prediction so that the correlation between the R, G, and B
+//  channels is not left in the residuals. Each transform is lossless
+//  on 8 bit components since every step is a lifting step computed
+//  mod 256. Chroma components are biased by 128 so that a small
+//  signed chroma value does not wrap around to a large unsigned one.
+//  Alpha is passed through unchanged.
+
+#include "assert.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif // __SSE2__
+
+typedef enum {
+  CTI_ColorTransformNone = 0,
+  CTI_ColorTransformSubtractGreen,
+  CTI_ColorTransformYCoCgR
+} CTI_ColorTransform;
+
+static inline
+const char * color_transform_name(CTI_ColorTransform transform) {
+  switch (transform) {
+    case CTI_ColorTransformNone:
+      return "none";
+    case CTI_ColorTransformSubtractGreen:
+      return "subgreen";
+    case CTI_ColorTransformYCoCgR:
+      return "ycocgr";
+  }
+  return "unknown";
+}
+
+// Subtract green : (R G B) -> (R-G, G, B-G)
+
+static inline
+uint32_t subgreen_encode_pixel(uint32_t pixel) {
+  uint32_t B = pixel & 0xFF;
+  uint32_t G = (pixel >> 8) & 0xFF;
+  uint32_t R = (pixel >> 16) & 0xFF;
+
+  R = (R - G + 128) & 0xFF;
+  B = (B - G + 128) & 0xFF;
+
+  return (pixel & 0xFF000000) | (R << 16) | (G << 8) | B;
+}
+
+static inline
+uint32_t subgreen_decode_pixel(uint32_t pixel) {
+  uint32_t B = pixel & 0xFF;
+  uint32_t G = (pixel >> 8) & 0xFF;
+  uint32_t R = (pixel >> 16) & 0xFF;
+
+  R = (R + G - 128) & 0xFF;
+  B = (B + G - 128) & 0xFF;
+
+  return (pixel & 0xFF000000) | (R << 16) | (G << 8) | B;
+}
+
+// YCoCg-R : (R G B) -> (Co Y Cg) where Co is stored in the R slot,
+// Y in the G slot, and Cg in the B slot. With the bias of 128 the
+// signed shift (Co >> 1) becomes ((Co' >> 1) - 64).
+
+static inline
+uint32_t ycocgr_encode_pixel(uint32_t pixel) {
+  uint32_t B = pixel & 0xFF;
+  uint32_t G = (pixel >> 8) & 0xFF;
+  uint32_t R = (pixel >> 16) & 0xFF;
+
+  uint32_t Co = (R - B + 128) & 0xFF;
+  uint32_t t = (B + (Co >> 1) - 64) & 0xFF;
+  uint32_t Cg = (G - t + 128) & 0xFF;
+  uint32_t Y = (t + (Cg >> 1) - 64) & 0xFF;
+
+  return (pixel & 0xFF000000) | (Co << 16) | (Y << 8) | Cg;
+}
+
+static inline
+uint32_t ycocgr_decode_pixel(uint32_t pixel) {
+  uint32_t Cg = pixel & 0xFF;
+  uint32_t Y = (pixel >> 8) & 0xFF;
+  uint32_t Co = (pixel >> 16) & 0xFF;
+
+  uint32_t t = (Y - (Cg >> 1) + 64) & 0xFF;
+  uint32_t G = (Cg + t - 128) & 0xFF;
+  uint32_t B = (t - (Co >> 1) + 64) & 0xFF;
+  uint32_t R = (Co + B - 128) & 0xFF;
+
+  return (pixel & 0xFF000000) | (R << 16) | (G << 8) | B;
+}
+
+#if defined(__SSE2__)
+
+// SSE2 kernels process 4 pixels at a time. Subtract green works on
+// bytes directly since each lane wraps mod 256. YCoCg-R unpacks each
+// component into a 32 bit lane so that the (>> 1) steps do not
+// shift bits in from the neighboring component.
+
+static inline
+__m128i subgreen_green_rb_sse2(__m128i vec) {
+  const __m128i greenMask = _mm_set1_epi32(0x0000FF00);
+  __m128i G = _mm_srli_epi32(_mm_and_si128(vec, greenMask), 8);
+  return _mm_or_si128(G, _mm_slli_epi32(G, 16));
+}
+
+static inline
+__m128i subgreen_encode_sse2(__m128i vec) {
+  const __m128i bias = _mm_set1_epi32(0x00800080);
+  __m128i GG = subgreen_green_rb_sse2(vec);
+  return _mm_add_epi8(_mm_sub_epi8(vec, GG), bias);
+}
+
+static inline
+__m128i subgreen_decode_sse2(__m128i vec) {
+  const __m128i bias = _mm_set1_epi32(0x00800080);
+  __m128i GG = subgreen_green_rb_sse2(vec);
+  return _mm_sub_epi8(_mm_add_epi8(vec, GG), bias);
+}
+
+static inline
+__m128i ycocgr_encode_sse2(__m128i vec) {
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  const __m128i bias128 = _mm_set1_epi32(128);
+  const __m128i bias64 = _mm_set1_epi32(64);
+  const __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+
+  __m128i B = _mm_and_si128(vec, mask);
+  __m128i G = _mm_and_si128(_mm_srli_epi32(vec, 8), mask);
+  __m128i R = _mm_and_si128(_mm_srli_epi32(vec, 16), mask);
+
+  __m128i Co = _mm_and_si128(_mm_add_epi32(_mm_sub_epi32(R, B), bias128), mask);
+  __m128i t = _mm_and_si128(_mm_sub_epi32(_mm_add_epi32(B, _mm_srli_epi32(Co, 1)), bias64), mask);
+  __m128i Cg = _mm_and_si128(_mm_add_epi32(_mm_sub_epi32(G, t), bias128), mask);
+  __m128i Y = _mm_and_si128(_mm_sub_epi32(_mm_add_epi32(t, _mm_srli_epi32(Cg, 1)), bias64), mask);
+
+  __m128i out = _mm_and_si128(vec, alphaMask);
+  out = _mm_or_si128(out, _mm_slli_epi32(Co, 16));
+  out = _mm_or_si128(out, _mm_slli_epi32(Y, 8));
+  out = _mm_or_si128(out, Cg);
+  return out;
+}
+
+static inline
+__m128i ycocgr_decode_sse2(__m128i vec) {
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  const __m128i bias128 = _mm_set1_epi32(128);
+  const __m128i bias64 = _mm_set1_epi32(64);
+  const __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+
+  __m128i Cg = _mm_and_si128(vec, mask);
+  __m128i Y = _mm_and_si128(_mm_srli_epi32(vec, 8), mask);
+  __m128i Co = _mm_and_si128(_mm_srli_epi32(vec, 16), mask);
+
+  __m128i t = _mm_and_si128(_mm_add_epi32(_mm_sub_epi32(Y, _mm_srli_epi32(Cg, 1)), bias64), mask);
+  __m128i G = _mm_and_si128(_mm_sub_epi32(_mm_add_epi32(Cg, t), bias128), mask);
+  __m128i B = _mm_and_si128(_mm_add_epi32(_mm_sub_epi32(t, _mm_srli_epi32(Co, 1)), bias64), mask);
+  __m128i R = _mm_and_si128(_mm_sub_epi32(_mm_add_epi32(Co, B), bias128), mask);
+
+  __m128i out = _mm_and_si128(vec, alphaMask);
+  out = _mm_or_si128(out, _mm_slli_epi32(R, 16));
+  out = _mm_or_si128(out, _mm_slli_epi32(G, 8));
+  out = _mm_or_si128(out, B);
+  return out;
+}
+
+#endif // __SSE2__
+
+// Apply the forward transform to numPixels, inPixels and outPixels
+// can point to the same buffer.
+
+static inline
+void color_transform_encode(CTI_ColorTransform transform,
+                            const uint32_t * const inPixels,
+                            uint32_t * const outPixels,
+                            const int numPixels)
+{
+  int i = 0;
+
+  switch (transform) {
+    case CTI_ColorTransformNone: {
+      if (inPixels != outPixels) {
+        memcpy(outPixels, inPixels, numPixels * sizeof(uint32_t));
+      }
+      return;
+    }
+    case CTI_ColorTransformSubtractGreen: {
+#if defined(__SSE2__)
+      for ( ; i + 4 <= numPixels; i += 4) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) &inPixels[i]);
+        _mm_storeu_si128((__m128i *) &outPixels[i], subgreen_encode_sse2(vec));
+      }
+#endif // __SSE2__
+      for ( ; i < numPixels; i++) {
+        outPixels[i] = subgreen_encode_pixel(inPixels[i]);
+      }
+      return;
+    }
+    case CTI_ColorTransformYCoCgR: {
+#if defined(__SSE2__)
+      for ( ; i + 4 <= numPixels; i += 4) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) &inPixels[i]);
+        _mm_storeu_si128((__m128i *) &outPixels[i], ycocgr_encode_sse2(vec));
+      }
+#endif // __SSE2__
+      for ( ; i < numPixels; i++) {
+        outPixels[i] = ycocgr_encode_pixel(inPixels[i]);
+      }
+      return;
+    }
+  }
+
+  assert(0);
+}
+
+// Apply the inverse transform to numPixels, inPixels and outPixels
+// can point to the same buffer.
+
+static inline
+void color_transform_decode(CTI_ColorTransform transform,
+                            const uint32_t * const inPixels,
+                            uint32_t * const outPixels,
+                            const int numPixels)
+{
+  int i = 0;
+
+  switch (transform) {
+    case CTI_ColorTransformNone: {
+      if (inPixels != outPixels) {
+        memcpy(outPixels, inPixels, numPixels * sizeof(uint32_t));
+      }
+      return;
+    }
+    case CTI_ColorTransformSubtractGreen: {
+#if defined(__SSE2__)
+      for ( ; i + 4 <= numPixels; i += 4) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) &inPixels[i]);
+        _mm_storeu_si128((__m128i *) &outPixels[i], subgreen_decode_sse2(vec));
+      }
+#endif // __SSE2__
+      for ( ; i < numPixels; i++) {
+        outPixels[i] = subgreen_decode_pixel(inPixels[i]);
+      }
+      return;
+    }
+    case CTI_ColorTransformYCoCgR: {
+#if defined(__SSE2__)
+      for ( ; i + 4 <= numPixels; i += 4) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) &inPixels[i]);
+        _mm_storeu_si128((__m128i *) &outPixels[i], ycocgr_decode_sse2(vec));
+      }
+#endif // __SSE2__
+      for ( ; i < numPixels; i++) {
+        outPixels[i] = ycocgr_decode_pixel(inPixels[i]);
+      }
+      return;
+    }
+  }
+
+  assert(0);
+}
@@ -10,6 +10,7 @@
 //  does calculation based on a colortable lookup.
 
 #include "assert.h"
+#include <math.h>
 
 #include <vector>
 #include <list>
@@ -17,6 +18,7 @@
 #include <set>
 
 #include <unordered_map>
+#include <chrono>
 
 //#define BOX_DELTA_SUM_WITH_CACHE
 
@@ -31,6 +33,11 @@
 
 #import "StaticPrioStack.hpp"
 
+#import "ColorTransform.hpp"
+
+#import "FrameAlloc.h"
+#import "PlanarRGB.hpp"
+
 using namespace std;
 
 static inline
@@ -139,22 +146,262 @@ private:
   unsigned int _isHorizontal : 1;
 };
 
+// Sample traits define the pixel word, the cached delta type and
+// the wait list type for a sample size. An 8 bit sample uses a
+// uint32_t word and a wait list with a node for every prio value.
+// A 16 bit sample uses a uint64_t word and the delta sum for 3
+// components can be as large as (3 * 65535), so deltas are cached
+// as int32_t values and the wait list is a sparse prio stack.
+
+template <typename S>
+class CTI_SampleTraits;
+
+template <>
+class CTI_SampleTraits<uint8_t>
+{
+public:
+  typedef uint32_t Word;
+  typedef int16_t CacheT;
+  typedef StaticPrioStack<CoordDelta> WaitList;
+  
+  static Word componentDelta(Word p1, Word p2, const int numComp) {
+    return pixel_component_delta(p1, p2, numComp);
+  }
+};
+
+template <>
+class CTI_SampleTraits<uint16_t>
+{
+public:
+  typedef uint64_t Word;
+  typedef int32_t CacheT;
+  typedef SparsePrioStack<CoordDelta> WaitList;
+  
+  static Word componentDelta(Word p1, Word p2, const int numComp) {
+    return pixel16_component_delta(p1, p2, numComp);
+  }
+};
+
+// Delta cache storage holds the cached H and V deltas and the processed
+// state for each pixel. The layout is selected at compile time, the
+// iteration logic reads and writes the cache only through the methods
+// defined here so that each layout produces identical results. Offsets
+// passed to the storage are always row major offsets.
+
+typedef enum {
+  CTI_CacheLayoutSplit = 0,
+  CTI_CacheLayoutInterleaved
+} CTI_CacheLayout;
+
+template <typename CacheT, int CacheLayout>
+class CTI_DeltaCacheStorage;
+
+template<typename T>
+static inline
+unsigned int CTI_BoxDeltaSum(
+                             const T * const deltaVec,
+                             int numCols,
+                             int numRows,
+                             int originOffset,
+                             int widthMinusX,
+                             int rowOff,
+                             const int colStep = 1);
+
+// Split layout, H deltas are stored in row major order while V deltas
+// are stored transposed so that a box of V deltas is read in the same
+// memory order as a box of H deltas. The processed flags are a third
+// grid. An update to one pixel touches three distant memory regions.
+
+template <typename CacheT>
+class CTI_DeltaCacheStorage<CacheT, CTI_CacheLayoutSplit>
+{
+public:
+  Cache2D<CacheT, true> cachedHDeltaSums;
+  Cache2D<CacheT, false> cachedVDeltaSums;
+  
+  // grid of true or false state for each pixel
+  
+  vector<uint8_t> processedFlags;
+  
+  void allocCache(const int width, const int height) {
+    const int numPixels = width * height;
+    
+    cachedHDeltaSums.allocValues(width, height, -1);
+    cachedVDeltaSums.allocValues(width, height, -1);
+    
+    if (processedFlags.size() != (size_t) numPixels) {
+      processedFlags = vector<uint8_t>();
+      processedFlags.reserve(numPixels);
+      frame_buffer_advise(processedFlags.data(), numPixels);
+      processedFlags.resize(numPixels, 0);
+    }
+  }
+  
+  bool processedAt(const int offset) const {
+    return (processedFlags[offset] != 0);
+  }
+  
+  void setProcessedAt(const int offset) {
+    processedFlags[offset] = 1;
+  }
+  
+  // H delta from the pixel at offset to the pixel on the right
+  
+  CacheT & hDeltaAt(const int offset) {
+    return cachedHDeltaSums.values[offset];
+  }
+  
+  // V delta from the pixel at offset to the pixel below,
+  // offsetT is the transposed offset of the same pixel.
+  
+  CacheT & vDeltaAt(const int offset, const int offsetT) {
+    return cachedVDeltaSums.values[offsetT];
+  }
+  
+  unsigned int boxDeltaSumH(const int originX, const int originY,
+                            const int numCols, const int numRows,
+                            const int rowOff,
+                            const int width, const int height) const
+  {
+    return CTI_BoxDeltaSum(cachedHDeltaSums.values.data(),
+                           numCols,
+                           numRows,
+                           CTIOffset2d(originX, originY, width),
+                           width - numCols,
+                           rowOff);
+  }
+  
+  // Note that numCols and numRows are swapped since the V
+  // deltas are read in transposed order.
+  
+  unsigned int boxDeltaSumV(const int originX, const int originY,
+                            const int numCols, const int numRows,
+                            const int colOff,
+                            const int width, const int height) const
+  {
+    return CTI_BoxDeltaSum(cachedVDeltaSums.values.data(),
+                           numRows,
+                           numCols,
+                           CTIOffset2d(originY, originX, height),
+                           height - numRows,
+                           colOff);
+  }
+};
+
+// Interleaved layout, the H delta, the V delta, and the processed
+// state for a pixel are stored next to each other in row major order.
+// The update after a pixel is processed reads and writes a single
+// neighborhood, a V box is read by stepping over rows.
+
+template <typename CacheT>
+class CTI_DeltaCacheStorage<CacheT, CTI_CacheLayoutInterleaved>
+{
+public:
+  enum {
+    cellHDelta = 0,
+    cellVDelta = 1,
+    cellProcessed = 2,
+    cellSize = 3
+  };
+  
+  vector<CacheT> deltaCells;
+  
+  int cellRowSize;
+  
+  void allocCache(const int width, const int height) {
+    const int numPixels = width * height;
+    
+    cellRowSize = width * cellSize;
+    
+    if (deltaCells.capacity() < (size_t) (numPixels * cellSize)) {
+      deltaCells = vector<CacheT>();
+      deltaCells.reserve(numPixels * cellSize);
+      frame_buffer_advise(deltaCells.data(), numPixels * cellSize * sizeof(CacheT));
+    }
+    
+    deltaCells.resize(numPixels * cellSize);
+    
+    CacheT * cellPtr = deltaCells.data();
+    
+    for ( int i = 0; i < numPixels; i++ ) {
+      cellPtr[cellHDelta] = -1;
+      cellPtr[cellVDelta] = -1;
+      cellPtr[cellProcessed] = 0;
+      cellPtr += cellSize;
+    }
+  }
+  
+  bool processedAt(const int offset) const {
+    return (deltaCells[(offset * cellSize) + cellProcessed] != 0);
+  }
+  
+  void setProcessedAt(const int offset) {
+    deltaCells[(offset * cellSize) + cellProcessed] = 1;
+  }
+  
+  CacheT & hDeltaAt(const int offset) {
+    return deltaCells[(offset * cellSize) + cellHDelta];
+  }
+  
+  CacheT & vDeltaAt(const int offset, const int offsetT) {
+    return deltaCells[(offset * cellSize) + cellVDelta];
+  }
+  
+  unsigned int boxDeltaSumH(const int originX, const int originY,
+                            const int numCols, const int numRows,
+                            const int rowOff,
+                            const int width, const int height) const
+  {
+    return CTI_BoxDeltaSum(deltaCells.data() + cellHDelta,
+                           numCols,
+                           numRows,
+                           CTIOffset2d(originX, originY, width) * cellSize,
+                           (width - numCols) * cellSize,
+                           rowOff,
+                           cellSize);
+  }
+  
+  // A transposed row is a column of cells, so each step moves
+  // down one row and the end of a column moves back to the top
+  // of the next column.
+  
+  unsigned int boxDeltaSumV(const int originX, const int originY,
+                            const int numCols, const int numRows,
+                            const int colOff,
+                            const int width, const int height) const
+  {
+    return CTI_BoxDeltaSum(deltaCells.data() + cellVDelta,
+                           numRows,
+                           numCols,
+                           CTIOffset2d(originX, originY, width) * cellSize,
+                           cellSize - (numRows * cellRowSize),
+                           colOff,
+                           cellRowSize);
+  }
+};
+
 // Each wait list is represented by a vector<CoordDelta> so that the size
-// of an allocation is a multiple of the sizeof(CoordDelta).
+// of an allocation is a multiple of the sizeof(CoordDelta). The struct
+// is specialized on the sample type and the number of components so
+// that component checks are resolved at compile time. The delta cache
+// and processed flags are stored in the split layout by default, the
+// CacheLayout argument selects one of the CTI_CacheLayout values.
 
-class CTI_Struct
+template <typename S, int NumComp = 3, int CacheLayout = CTI_CacheLayoutSplit>
+class CTI_StructT : public CTI_DeltaCacheStorage<typename CTI_SampleTraits<S>::CacheT, CacheLayout>
 {
 public:
+  typedef CTI_SampleTraits<S> Traits;
+  typedef typename Traits::Word Word;
+  typedef typename Traits::CacheT CacheT;
+  
   // The wait list is a statically defined prio stack
   
-  StaticPrioStack<CoordDelta> waitList;
+  typename Traits::WaitList waitList;
 
-  // Cached H and V delta calculations, these need only
-  // be executed once and then they can be reused by
-  // multiple pixels.
-  
-  Cache2D<int16_t, true> cachedHDeltaSums;
-  Cache2D<int16_t, false> cachedVDeltaSums;
+  // Cached H and V delta calculations are defined in the
+  // storage base class, these need only be executed once
+  // and then they can be reused by multiple pixels.
 
   // Both H and V cached deltas are stored in memory in
   // the same orientation. This makes it possible to
@@ -162,14 +409,10 @@ public:
   // a memory optimal fasion.
   
 # if defined(BOX_DELTA_SUM_WITH_CACHE)
-  Cache2DSum3<int16_t, true> cachedHDeltaRows;
-  Cache2DSum3<int16_t, false> cachedVDeltaRows;
+  Cache2DSum3<CacheT, true> cachedHDeltaRows;
+  Cache2DSum3<CacheT, false> cachedVDeltaRows;
 # endif // BOX_DELTA_SUM_WITH_CACHE
 
-  // grid of true or false state for each pixel
-  
-  vector<uint8_t> processedFlags;
-
 #if defined(DEBUG)
   unordered_map<string,int> results;
 #endif // DEBUG
@@ -177,16 +420,26 @@ public:
   int width;
   int height;
   
-  CTI_Struct()
+  // Number of components that are predicted for each pixel,
+  // 3 for RGB pixels or 4 when alpha is a predicted channel.
+  // A 16 bit grayscale pixel is predicted as 1 component.
+  
+  static const int numComp = NumComp;
+  
+  CTI_StructT()
   {
   }
   
-  ~CTI_Struct() {
+  ~CTI_StructT() {
   }
   
   void initWaitList(int numErrs) {
     waitList.allocateN(numErrs);
   }
+  
+  void initWaitList(int numErrs, int elemInitSize) {
+    waitList.allocateN(numErrs, elemInitSize);
+  }
 
   bool isWaitListEmpty() {
     return waitList.isEmpty();
@@ -201,21 +454,16 @@ public:
   string waitListToString(unsigned int err) {
     stringstream s;
     
-    if (err == -1) {
-      err = 0;
-      for ( vector<CoordDelta> & errTable : waitList.elemTable ) {
-        for ( auto it = errTable.rbegin(); it != errTable.rend(); it++ ) {
-          //const CoordDelta & cd = *it;
-          s << err << ",";
-        }
-        err += 1;
+    for ( int prio = waitList.head(); prio != -1; prio = waitList.nextPrio(prio) ) {
+      if (err != -1 && prio != err) {
+        continue;
       }
-    } else {
-      vector<CoordDelta> & errTable = waitList.elemTable[err];
+      
+      vector<CoordDelta> & errTable = waitList.elemsAt(prio);
       
       for ( auto it = errTable.rbegin(); it != errTable.rend(); it++ ) {
         //const CoordDelta & cd = *it;
-        s << err << ",";
+        s << prio << ",";
       }
     }
     
@@ -274,10 +522,7 @@ public:
 #endif // DEBUG
     
     int offset = CTIOffset2d(x, y, width);
-#if defined(DEBUG)
-    assert(offset < processedFlags.size());
-#endif // DEBUG
-    bool wasTargetPixelProcessed = (processedFlags[offset] != 0);
+    bool wasTargetPixelProcessed = this->processedAt(offset);
     return wasTargetPixelProcessed;
   }
 
@@ -289,9 +534,8 @@ public:
 #if defined(DEBUG)
     assert(offset >= 0);
     assert(offset < width*height);
-    assert(offset < processedFlags.size());
 #endif // DEBUG
-    bool wasTargetPixelProcessed = (processedFlags[offset] != 0);
+    bool wasTargetPixelProcessed = this->processedAt(offset);
     return wasTargetPixelProcessed;
   }
   
@@ -307,14 +551,14 @@ public:
 #endif // DEBUG
     
     int offset = CTIOffset2d(x, y, width);
-    processedFlags[offset] = 1;
+    this->setProcessedAt(offset);
   }
   
   // Faster version of setProcessed in the case where the offset was already computed
   
   void setProcessed(int offset)
   {
-    processedFlags[offset] = 1;
+    this->setProcessedAt(offset);
   }
 
   // Debug print results hashtable
@@ -367,8 +611,7 @@ public:
     int countVSum = 0;
 
     for ( auto err = waitListHead(); err != -1; ) {
-      auto & node = waitList.nodeTable[err];
-      vector<CoordDelta> & errTable = waitList.elemTable[err];
+      vector<CoordDelta> & errTable = waitList.elemsAt(err);
       
       for ( CoordDelta cd : errTable ) {
         if (cd.isHorizontal()) {
@@ -382,7 +625,7 @@ public:
         }
       }
       
-      err = node.next;
+      err = waitList.nextPrio(err);
     }
     
     return countHSum + countVSum;
@@ -390,9 +633,9 @@ public:
 
   // Calculate delta between 2 pixels
 
-  unsigned int componentDelta(
-                          unsigned int p1,
-                          unsigned int p2)
+  Word componentDelta(
+                      Word p1,
+                      Word p2)
   {
     const bool debug = false;
     
@@ -403,13 +646,13 @@ public:
     // Component delta is a simple SUB each component from p1 -> p2
     
     if (debug) {
-      printf("predict : 0x%08X -> 0x%08X\n", p1, p2);
+      printf("predict : 0x%016llX -> 0x%016llX\n", (unsigned long long) p1, (unsigned long long) p2);
     }
     
-    uint32_t deltaPixel = pixel_component_delta(p1, p2, 3);
+    Word deltaPixel = Traits::componentDelta(p1, p2, numComp);
     
     if (debug) {
-      printf("comp delta     : 0x%08X\n", deltaPixel);
+      printf("comp delta     : 0x%016llX\n", (unsigned long long) deltaPixel);
     }
     
     return deltaPixel;
@@ -451,11 +694,7 @@ public:
 #endif // DEBUG
 
 #if defined(DEBUG)
-        cachedHDeltaSums.assertIfInvalidOffset(leftOffset);
-#endif // DEBUG
-        
-#if defined(DEBUG)
-        assert(cachedHDeltaSums.values[leftOffset] == -1);
+        assert(this->hDeltaAt(leftOffset) == -1);
 #endif // DEBUG
         
         // FIXME: If L has been cached, then it would be possible to know
@@ -464,7 +703,7 @@ public:
         
         // Hold ref to L
         
-        auto & cachedDelta = cachedHDeltaSums.values[leftOffset];
+        auto & cachedDelta = this->hDeltaAt(leftOffset);
         
         //bool pixelWasProcessed = wasProcessed(prevCol, cacheRow);
         bool pixelWasProcessed = wasProcessed(leftOffset);
@@ -472,7 +711,7 @@ public:
           int delta = deltaFunc(leftOffset, centerOffset);
           
 #if defined(DEBUG)
-          assert(delta < 0xFFFF);
+          assert(delta >= 0 && delta == (int) ((CacheT) delta));
 #endif // DEBUG
           
           cachedDelta = delta;
@@ -497,13 +736,12 @@ public:
 #endif // DEBUG
         
 #if defined(DEBUG)
-        cachedHDeltaSums.assertIfInvalidOffset(centerOffset);
-        assert(cachedHDeltaSums.values[centerOffset] == -1);
+        assert(this->hDeltaAt(centerOffset) == -1);
 #endif // DEBUG
         
         // FIXME: If RR has been cached, then (R -> RR) R is processed without invoking wasProcessed().
         
-        auto & cachedDelta = cachedHDeltaSums.values[centerOffset];
+        auto & cachedDelta = this->hDeltaAt(centerOffset);
         
         //bool pixelWasProcessed = wasProcessed(nextCol, cacheRow);
         bool pixelWasProcessed = wasProcessed(rightOffset);
@@ -511,7 +749,7 @@ public:
           int delta = deltaFunc(centerOffset, rightOffset);
           
 #if defined(DEBUG)
-          assert(delta < 0xFFFF);
+          assert(delta >= 0 && delta == (int) ((CacheT) delta));
 #endif // DEBUG
           
           cachedDelta = delta;
@@ -543,11 +781,10 @@ public:
 #endif // DEBUG
         
 #if defined(DEBUG)
-        cachedHDeltaSums.assertIfInvalidOffset(upOffsetT);
-        assert(cachedVDeltaSums.values[upOffsetT] == -1);
+        assert(this->vDeltaAt(upOffset, upOffsetT) == -1);
 #endif // DEBUG
         
-        auto & cachedDelta = cachedVDeltaSums.values[upOffsetT];
+        auto & cachedDelta = this->vDeltaAt(upOffset, upOffsetT);
         
         //bool pixelWasProcessed = wasProcessed(cacheCol, prevRow);
         bool pixelWasProcessed = wasProcessed(upOffset);
@@ -555,7 +792,7 @@ public:
           int delta = deltaFunc(upOffset, centerOffset);
           
 #if defined(DEBUG)
-          assert(delta < 0xFFFF);
+          assert(delta >= 0 && delta == (int) ((CacheT) delta));
 #endif // DEBUG
           
           cachedDelta = delta;
@@ -586,11 +823,10 @@ public:
         //int centerOffsetT = CTIOffset2d(cacheRow, cacheCol, height);
         
 #if defined(DEBUG)
-        cachedHDeltaSums.assertIfInvalidOffset(centerOffsetT);
-        assert(cachedVDeltaSums.values[centerOffsetT] == -1);
+        assert(this->vDeltaAt(centerOffset, centerOffsetT) == -1);
 #endif // DEBUG
         
-        auto & cachedDelta = cachedVDeltaSums.values[centerOffsetT];
+        auto & cachedDelta = this->vDeltaAt(centerOffset, centerOffsetT);
         
         //bool pixelWasProcessed = wasProcessed(cacheCol, nextRow);
         bool pixelWasProcessed = wasProcessed(downOffset);
@@ -598,7 +834,7 @@ public:
           int delta = deltaFunc(centerOffset, downOffset);
           
 #if defined(DEBUG)
-          assert(delta < 0xFFFF);
+          assert(delta >= 0 && delta == (int) ((CacheT) delta));
 #endif // DEBUG
           
           cachedDelta = delta;
@@ -644,7 +880,7 @@ public:
   
   // Get the current cached value at an offset
   
-  int16_t getRow3CacheValue(
+  CacheT getRow3CacheValue(
                             const bool isHorizontal,
                             const int cacheCol,
                             const int cacheRow)
@@ -656,14 +892,317 @@ public:
     }
     
     if (isHorizontal) {
-      return cachedHDeltaRows.getCachedValue(cachedHDeltaSums, cacheCol, cacheRow);
+      return cachedHDeltaRows.getCachedValue(this->cachedHDeltaSums, cacheCol, cacheRow);
     } else {
-      return cachedVDeltaRows.getCachedValue(cachedVDeltaSums, cacheCol, cacheRow);
+      return cachedVDeltaRows.getCachedValue(this->cachedVDeltaSums, cacheCol, cacheRow);
     }
   }
 #endif // BOX_DELTA_SUM_WITH_CACHE
 };
 
+template <typename S, int NumComp, int CacheLayout>
+const int CTI_StructT<S, NumComp, CacheLayout>::numComp;
+
+typedef CTI_StructT<uint8_t, 3> CTI_Struct;
+typedef CTI_StructT<uint8_t, 4> CTI_StructRGBA;
+typedef CTI_StructT<uint16_t, 1> CTI_StructGray16;
+typedef CTI_StructT<uint16_t, 3> CTI_Struct16;
+
+typedef CTI_StructT<uint8_t, 3, CTI_CacheLayoutInterleaved> CTI_StructInterleaved;
+
+// A residual sink receives each pixel offset in iteration order along
+// with the prediction residual for the pixel as it is processed. The
+// sink type is a template argument of the iteration logic, so when no
+// residuals are needed (hasResiduals is 0) the prediction step is not
+// compiled into the iteration loop and the residual passed is zero.
+// Consumers read residuals as they are generated, so a full frame
+// buffer of offsets or residuals is only needed when a sink keeps one.
+// The prio argument is the wait list prio of the delta that selected
+// the pixel, a decoder can recompute this value so it can be used as
+// a context. The upper left pixels are emitted as raw pixel values
+// with a prio of CTI_RAW_PIXEL_PRIO.
+
+#define CTI_RAW_PIXEL_PRIO -1
+
+class CTI_NullResidualSink
+{
+public:
+  enum { hasResiduals = 0 };
+  
+  template <typename Word>
+  void emit(int offset, Word residual, int prio) {
+  }
+};
+
+// Write each residual into a deltas buffer at the pixel offset
+
+template <typename Word>
+class CTI_DeltasResidualSink
+{
+public:
+  enum { hasResiduals = 1 };
+  
+  Word * const deltasPtr;
+  
+  CTI_DeltasResidualSink(Word * const inDeltasPtr)
+  : deltasPtr(inDeltasPtr)
+  {
+  }
+  
+  void emit(int offset, Word residual, int prio) {
+    deltasPtr[offset] = residual;
+  }
+};
+
+// Clear an iteration order vector before a region is processed
+
+static inline
+void CTI_ResetIterOrder(vector<uint32_t> & iterOrder, const int numPixels)
+{
+  if (iterOrder.size() != (size_t) numPixels) {
+    iterOrder.reserve(numPixels);
+  }
+  iterOrder.clear();
+}
+
+// Append each offset to an iteration order vector and pass the
+// residual on to an inner sink.
+
+template <typename InnerSink = CTI_NullResidualSink>
+class CTI_IterOrderSink
+{
+public:
+  enum { hasResiduals = InnerSink::hasResiduals };
+  
+  vector<uint32_t> & iterOrder;
+  
+  InnerSink innerSink;
+  
+  CTI_IterOrderSink(vector<uint32_t> & inIterOrder, InnerSink inInnerSink = InnerSink())
+  : iterOrder(inIterOrder), innerSink(inInnerSink)
+  {
+  }
+  
+  template <typename Word>
+  void emit(int offset, Word residual, int prio) {
+    iterOrder.push_back(offset);
+    innerSink.emit(offset, residual, prio);
+  }
+};
+
+// Append each residual to a stream in iteration order, this is the
+// order a decoder reads the residuals in.
+
+class CTI_StreamResidualSink
+{
+public:
+  enum { hasResiduals = 1 };
+  
+  vector<uint32_t> & stream;
+  
+  CTI_StreamResidualSink(vector<uint32_t> & inStream)
+  : stream(inStream)
+  {
+  }
+  
+  void emit(int offset, uint32_t residual, int prio) {
+    stream.push_back(residual);
+  }
+};
+
+// Append each component of a RGB residual to its own residual plane
+// in iteration order, so that each channel can be entropy coded on
+// its own. Raw pixels are split the same way.
+
+class CTI_PlanarResidualSink
+{
+public:
+  enum { hasResiduals = 1 };
+  
+  CTI_PlanarRGB & residualPlanes;
+  int numEmitted;
+  
+  CTI_PlanarResidualSink(CTI_PlanarRGB & inResidualPlanes)
+  : residualPlanes(inResidualPlanes), numEmitted(0)
+  {
+  }
+  
+  void emit(int offset, uint32_t residual, int prio) {
+#if defined(DEBUG)
+    assert(numEmitted < residualPlanes.numPixels);
+#endif // DEBUG
+    
+    residualPlanes.planes[CTI_PLANE_B][numEmitted] = residual & 0xFF;
+    residualPlanes.planes[CTI_PLANE_G][numEmitted] = (residual >> 8) & 0xFF;
+    residualPlanes.planes[CTI_PLANE_R][numEmitted] = (residual >> 16) & 0xFF;
+    numEmitted += 1;
+  }
+};
+
+// Decode RGB pixels as the iteration runs. The iteration reads only
+// processed pixels, except for the pixel being predicted which is
+// still zero in the output buffer, so the residual passed in is the
+// negated prediction. The coded residual is added to the prediction
+// and the pixel is written before the offset is marked as processed.
+// The 4 raw pixels must be written before the iteration starts.
+
+class CTI_DecodeResidualSink
+{
+public:
+  enum { hasResiduals = 1 };
+  
+  const uint32_t * residualsPtr;
+  uint32_t * pixelsPtr;
+  
+  CTI_DecodeResidualSink(const uint32_t * inResidualsPtr, uint32_t * inPixelsPtr)
+  : residualsPtr(inResidualsPtr), pixelsPtr(inPixelsPtr)
+  {
+  }
+  
+  void emit(int offset, uint32_t residual, int prio) {
+    uint32_t coded = *residualsPtr++;
+    
+    if (prio == CTI_RAW_PIXEL_PRIO) {
+      return;
+    }
+    
+    uint32_t predPixel = pixel_component_delta(residual, 0, 3);
+    pixelsPtr[offset] = pixel_component_sum(predPixel, coded, 3);
+  }
+};
+
+// Estimate the compressed size of the residuals as they are emitted.
+// Counts are kept for each component (order 0) and for each component
+// in a context defined by the wait list prio. The prio is bucketed
+// by log2 so that small prio values get their own context while large
+// prio values share a context. Raw pixels are not modeled and cost
+// a full sample for each component. The estimate is the empirical
+// entropy of the counts, so it is a lower bound for a static coder
+// and does not include the cost of transmitting the tables.
+
+#define CTI_ENTROPY_NUM_CONTEXTS 8
+
+template <typename Word, int NumComp, typename InnerSink = CTI_NullResidualSink>
+class CTI_EntropyResidualSink
+{
+public:
+  enum { hasResiduals = 1 };
+  
+  enum { numBits = (sizeof(Word) == 8) ? 16 : 8 };
+  enum { numBins = (1 << numBits) };
+  
+  InnerSink innerSink;
+  
+  int numResiduals;
+  int numRaw;
+  
+  vector<uint32_t> order0Counts;
+  vector<uint32_t> contextCounts;
+  
+  CTI_EntropyResidualSink(InnerSink inInnerSink = InnerSink())
+  : innerSink(inInnerSink), numResiduals(0), numRaw(0)
+  {
+    order0Counts.resize(NumComp * numBins);
+    contextCounts.resize(CTI_ENTROPY_NUM_CONTEXTS * NumComp * numBins);
+  }
+  
+  // Map a wait list prio to a context number, 0 -> 0, 1 -> 1, 2-3 -> 2, 4-7 -> 3, ...
+  
+  static inline
+  int contextForPrio(int prio) {
+    int context = (prio <= 0) ? 0 : (32 - __builtin_clz((unsigned int) prio));
+    if (context >= CTI_ENTROPY_NUM_CONTEXTS) {
+      context = CTI_ENTROPY_NUM_CONTEXTS - 1;
+    }
+    return context;
+  }
+  
+  void emit(int offset, Word residual, int prio) {
+    innerSink.emit(offset, residual, prio);
+    
+    if (prio == CTI_RAW_PIXEL_PRIO) {
+      numRaw += 1;
+      return;
+    }
+    
+    numResiduals += 1;
+    
+    uint32_t * contextPtr = &contextCounts[contextForPrio(prio) * NumComp * numBins];
+    
+    for (int c = 0; c < NumComp; c++) {
+      uint32_t sample = (uint32_t) ((residual >> (c * numBits)) & (numBins - 1));
+      order0Counts[c * numBins + sample] += 1;
+      contextPtr[c * numBins + sample] += 1;
+    }
+  }
+  
+  // Total bits needed to code the symbols in a table of counts
+  
+  static
+  double tableBits(const uint32_t * const countsPtr, const int N) {
+    double total = 0.0;
+    for (int i = 0; i < N; i++) {
+      total += countsPtr[i];
+    }
+    double bits = 0.0;
+    for (int i = 0; i < N; i++) {
+      uint32_t count = countsPtr[i];
+      if (count > 0) {
+        bits -= count * log2(count / total);
+      }
+    }
+    return bits;
+  }
+  
+  // Total bits for component c with an order 0 model
+  
+  double order0ComponentBits(int c) const {
+    return tableBits(&order0Counts[c * numBins], numBins);
+  }
+  
+  // Total bits for all residuals with an order 0 model
+  
+  double order0Bits() const {
+    double bits = 0.0;
+    for (int c = 0; c < NumComp; c++) {
+      bits += order0ComponentBits(c);
+    }
+    return bits;
+  }
+  
+  // Total bits for all residuals with the prio context model
+  
+  double contextBits() const {
+    double bits = 0.0;
+    for (int context = 0; context < CTI_ENTROPY_NUM_CONTEXTS; context++) {
+      for (int c = 0; c < NumComp; c++) {
+        bits += tableBits(&contextCounts[(context * NumComp + c) * numBins], numBins);
+      }
+    }
+    return bits;
+  }
+  
+  int numPixels() const {
+    return numResiduals + numRaw;
+  }
+  
+  double rawBits() const {
+    return (double) numRaw * NumComp * numBits;
+  }
+  
+  // Estimated bits per pixel including raw pixels
+  
+  double order0BitsPerPixel() const {
+    int N = numPixels();
+    return (N == 0) ? 0.0 : ((order0Bits() + rawBits()) / N);
+  }
+  
+  double contextBitsPerPixel() const {
+    int N = numPixels();
+    return (N == 0) ? 0.0 : ((contextBits() + rawBits()) / N);
+  }
+};
+
 // Predict a RGB value by looking only at the direct 4 neighbor pixels (N S E W)
 
 template<typename LookupFunc>
@@ -906,13 +1445,15 @@ uint32_t CTI_NeighborPredict(
 }
 
 // Predict a RGB value by looking at the direct 4 neighbor pixels (N S E W)
-// and the pred errors for these pixels
+// and the pred errors for these pixels. This is the branching version
+// of the logic, CTI_NeighborPredict2() generates the same prediction
+// with a table lookup.
 
-template<typename LookupFunc>
+template<int NumComp, int CacheLayout, typename LookupFunc>
 static inline
 //static __attribute__ ((noinline))
-uint32_t CTI_NeighborPredict2(
-                              CTI_Struct & ctiStruct,
+uint32_t CTI_NeighborPredict2Branches(
+                              CTI_StructT<uint8_t, NumComp, CacheLayout> & ctiStruct,
                               LookupFunc lookupFunc,
                               uint32_t * const predErrPtr,
                               int centerX,
@@ -923,6 +1464,11 @@ uint32_t CTI_NeighborPredict2(
   const int width = ctiStruct.width;
   const int height = ctiStruct.height;
   
+  // When alpha is a predicted channel, each branch below
+  // also predicts the A component in bits (24, 31).
+  
+  const int numComp = NumComp;
+  
   if (debug) {
     printf("CTI_NeighborPredict2(%d,%d)\n", centerX, centerY);
   }
@@ -1225,7 +1771,7 @@ uint32_t CTI_NeighborPredict2(
   
   // Choose component with the smaller delta and return (R G B) that is the min
   
-  auto chooseSmallerComponent = [smallerDeltaComponent](
+  auto chooseSmallerComponent = [smallerDeltaComponent, numComp](
                           unsigned int pU,
                           unsigned int pD,
                           unsigned int pL,
@@ -1269,6 +1815,15 @@ uint32_t CTI_NeighborPredict2(
     
     unsigned int minPixel = (R << 16) | (G << 8) | B;
     
+    if (numComp == 4) {
+      unsigned int dVA = (dV >> 24) & 0xFF;
+      unsigned int dHA = (dH >> 24) & 0xFF;
+      
+      unsigned int A = smallerDeltaComponent(dHA, dVA, pU, pD, pL, pR, 24);
+      
+      minPixel |= (A << 24);
+    }
+    
     if (debug) {
       printf("min (dV -> dH) : 0x%08X\n", minPixel);
     }
@@ -1327,6 +1882,11 @@ uint32_t CTI_NeighborPredict2(
     }
     
     retPixel = combinePixelComponents(R, G, B);
+    
+    if (numComp == 4) {
+      unsigned int A = aveComponent(pL, pR, 24);
+      retPixel |= (A << 24);
+    }
   } else if (hasV) {
     // V
     
@@ -1346,6 +1906,11 @@ uint32_t CTI_NeighborPredict2(
     }
     
     retPixel = combinePixelComponents(R, G, B);
+    
+    if (numComp == 4) {
+      unsigned int A = aveComponent(pU, pD, 24);
+      retPixel |= (A << 24);
+    }
   } else if (nBits.L && nBits.U && nBits.UL) {
     // Trivial gradclamp prediction case like:
     //
@@ -1485,9 +2050,9 @@ uint32_t CTI_NeighborPredict2(
   } else {
     // No H or V primary, calculate ave of H and V
     
-    int sumHR = 0, sumHG = 0, sumHB = 0;
+    int sumHR = 0, sumHG = 0, sumHB = 0, sumHA = 0;
     int numH = 0;
-    int sumVR = 0, sumVG = 0, sumVB = 0;
+    int sumVR = 0, sumVG = 0, sumVB = 0, sumVA = 0;
     int numV = 0;
     
     // U
@@ -1506,6 +2071,10 @@ uint32_t CTI_NeighborPredict2(
       sumVB += B;
       sumVG += G;
       sumVR += R;
+      
+      if (numComp == 4) {
+        sumVA += (pixel >> 24) & 0xFF;
+      }
     }
     
     // L
@@ -1523,6 +2092,10 @@ uint32_t CTI_NeighborPredict2(
       sumHB += B;
       sumHG += G;
       sumHR += R;
+      
+      if (numComp == 4) {
+        sumHA += (pixel >> 24) & 0xFF;
+      }
     }
 
     // R
@@ -1541,6 +2114,10 @@ uint32_t CTI_NeighborPredict2(
       sumHB += B;
       sumHG += G;
       sumHR += R;
+      
+      if (numComp == 4) {
+        sumHA += (pixel >> 24) & 0xFF;
+      }
     }
 
     // D
@@ -1559,6 +2136,10 @@ uint32_t CTI_NeighborPredict2(
       sumVB += B;
       sumVG += G;
       sumVR += R;
+      
+      if (numComp == 4) {
+        sumVA += (pixel >> 24) & 0xFF;
+      }
     }
     
 #if defined(DEBUG)
@@ -1579,6 +2160,7 @@ uint32_t CTI_NeighborPredict2(
       sumHR = fast_div_2(sumHR);
       sumHG = fast_div_2(sumHG);
       sumHB = fast_div_2(sumHB);
+      sumHA = fast_div_2(sumHA);
     }
     
     // V is 0, 1, or 2 values
@@ -1591,20 +2173,23 @@ uint32_t CTI_NeighborPredict2(
       sumVR = fast_div_2(sumVR);
       sumVG = fast_div_2(sumVG);
       sumVB = fast_div_2(sumVB);
+      sumVA = fast_div_2(sumVA);
     }
     
-    uint32_t R, G, B;
+    uint32_t R, G, B, A;
     
     if (numH == 0) {
       // Use just the V pred
       R = sumVR;
       G = sumVG;
       B = sumVB;
+      A = sumVA;
     } else if (numV == 0) {
       // Use just the H pred
       R = sumHR;
       G = sumHG;
       B = sumHB;
+      A = sumHA;
     } else {
       // Combine ave for H and V
 #if defined(DEBUG)
@@ -1619,6 +2204,7 @@ uint32_t CTI_NeighborPredict2(
       R = fast_ave_2(sumHR, sumVR);
       G = fast_ave_2(sumHG, sumVG);
       B = fast_ave_2(sumHB, sumVB);
+      A = fast_ave_2(sumHA, sumVA);
     }
     
 #if defined(DEBUG)
@@ -1628,135 +2214,531 @@ uint32_t CTI_NeighborPredict2(
 #endif // DEBUG
     
     retPixel = (R << 16) | (G << 8) | B;
+    
+    if (numComp == 4) {
+#if defined(DEBUG)
+      assert(A <= 0xFF);
+#endif // DEBUG
+      retPixel |= (A << 24);
+    }
   }
   
   return retPixel;
 }
 
-// Calculate weighted sum of 3 values
+// Neighbor indexes for the 8 bits of a neighbor mask, the center
+// is used as a 9th neighbor that is always in bounds.
 
-static inline
-unsigned int CTI_WeightedSum(int sum0, int sum1, int sum2)
+typedef enum {
+  CTI_NeighborUL = 0,
+  CTI_NeighborU,
+  CTI_NeighborUR,
+  CTI_NeighborL,
+  CTI_NeighborR,
+  CTI_NeighborDL,
+  CTI_NeighborD,
+  CTI_NeighborDR,
+  CTI_NeighborC
+} CTI_Neighbor;
+
+// Each neighbor mask maps to one table entry that selects 4 neighbor
+// pixels (s0 s1 s2 s3). Every entry is evaluated the same way:
+//
+// H/V : each component is the ave of (s0, s1) or the ave of (s2, s3),
+//       whichever pair has the smaller abs() delta. A single ave of 2
+//       neighbors is encoded as (s0, s1, s0, s1) and a single neighbor
+//       as (s0, s0, s0, s0), so the divisor is always 2.
+// gradclamp : each component is gradclamp with s0 as left, s1 as up,
+//       and s2 as upLeft.
+//
+// gradclampMask selects between the two results and keepMask is zero
+// when no N S E W neighbor is processed.
+
+typedef struct {
+  uint8_t n[4];
+  uint32_t gradclampMask;
+  uint32_t keepMask;
+} CTI_NeighborPredictEntry;
+
+class CTI_NeighborPredictTable
 {
-  const bool debug = false;
+public:
+  CTI_NeighborPredictEntry entries[256];
+  
+  CTI_NeighborPredictTable() {
+    for (int mask = 0; mask < 256; mask++) {
+      entries[mask] = entryForMask(mask);
+    }
+  }
   
-  if ((0)) {
-    // ave = sum/3 = ave3(sum0, sum1, sum2)
+  static inline
+  const CTI_NeighborPredictTable & shared() {
+    static const CTI_NeighborPredictTable table;
+    return table;
+  }
+  
+  // Choose the prediction with the same precedence as
+  // CTI_NeighborPredict2Branches()
+  
+  static
+  CTI_NeighborPredictEntry entryForMask(int mask) {
+    auto has = [mask](int n)->bool {
+      return ((mask >> n) & 0x1) != 0;
+    };
     
-    int scaledSum0 = sum0;
-    int scaledSum1 = -1;
-    int scaledSum2 = -1;
+    auto makeEntry = [](int n0, int n1, int n2, int n3, bool isGradclamp)->CTI_NeighborPredictEntry {
+      CTI_NeighborPredictEntry entry;
+      entry.n[0] = n0;
+      entry.n[1] = n1;
+      entry.n[2] = n2;
+      entry.n[3] = n3;
+      entry.gradclampMask = isGradclamp ? 0xFFFFFFFF : 0;
+      entry.keepMask = 0xFFFFFFFF;
+      return entry;
+    };
     
-    if (sum1 != -1) {
-      scaledSum1 = fast_div_2(sum1); // (sum1 * 50%)
-    }
+    const bool hasH = has(CTI_NeighborL) && has(CTI_NeighborR);
+    const bool hasV = has(CTI_NeighborU) && has(CTI_NeighborD);
     
-    if (sum2 != -1) {
-      scaledSum2 = fast_div_4(sum2); // (sum2 * 0.25%)
+    if (hasH && hasV) {
+      return makeEntry(CTI_NeighborL, CTI_NeighborR, CTI_NeighborU, CTI_NeighborD, false);
+    } else if (hasH) {
+      return makeEntry(CTI_NeighborL, CTI_NeighborR, CTI_NeighborL, CTI_NeighborR, false);
+    } else if (hasV) {
+      return makeEntry(CTI_NeighborU, CTI_NeighborD, CTI_NeighborU, CTI_NeighborD, false);
+    } else if (has(CTI_NeighborL) && has(CTI_NeighborU) && has(CTI_NeighborUL)) {
+      return makeEntry(CTI_NeighborL, CTI_NeighborU, CTI_NeighborUL, CTI_NeighborUL, true);
+    } else if (has(CTI_NeighborL) && has(CTI_NeighborD) && has(CTI_NeighborDL)) {
+      return makeEntry(CTI_NeighborL, CTI_NeighborD, CTI_NeighborDL, CTI_NeighborDL, true);
+    } else if (has(CTI_NeighborR) && has(CTI_NeighborU) && has(CTI_NeighborUR)) {
+      return makeEntry(CTI_NeighborR, CTI_NeighborU, CTI_NeighborUR, CTI_NeighborUR, true);
+    } else if (has(CTI_NeighborR) && has(CTI_NeighborD) && has(CTI_NeighborDR)) {
+      return makeEntry(CTI_NeighborR, CTI_NeighborD, CTI_NeighborDR, CTI_NeighborDR, true);
     }
     
-    if (debug) {
-      printf("ave scaled sum (0 1 2) = (%d + %d + %d)\n", scaledSum0, scaledSum1, scaledSum2);
-    }
+    // At most one H neighbor and one V neighbor, ave of the two
     
-    if (debug) {
-      printf("sum %d\n", scaledSum0 + ((scaledSum1 == -1) ? 0 : scaledSum1) + ((scaledSum2 == -1) ? 0 : scaledSum2));
+    int h = has(CTI_NeighborL) ? CTI_NeighborL : (has(CTI_NeighborR) ? CTI_NeighborR : -1);
+    int v = has(CTI_NeighborU) ? CTI_NeighborU : (has(CTI_NeighborD) ? CTI_NeighborD : -1);
+    
+    if (h == -1 && v == -1) {
+      CTI_NeighborPredictEntry entry = makeEntry(CTI_NeighborC, CTI_NeighborC, CTI_NeighborC, CTI_NeighborC, false);
+      entry.keepMask = 0;
+      return entry;
+    } else if (h == -1) {
+      h = v;
+    } else if (v == -1) {
+      v = h;
     }
     
-    // Divide final sum by 3 to get a weighted average of 3 inputs
+    return makeEntry(h, v, h, v, false);
+  }
+};
+
+// Evaluate both the H/V and the gradclamp prediction for the 4 selected
+// neighbor pixels. With SSE2 each component is unpacked into a 16 bit
+// lane so that all the components are computed with one op. The abs()
+// of a delta taken as int8_t is the min of (delta & 0xFF) and
+// (256 - (delta & 0xFF)). Components past NumComp are zero in hvPixel.
+
+#if defined(__SSE2__)
+
+template<int NumComp>
+static inline
+void CTI_NeighborPredictKernel(const uint32_t s0,
+                               const uint32_t s1,
+                               const uint32_t s2,
+                               const uint32_t s3,
+                               uint32_t & hvPixel,
+                               uint32_t & gradclampPixel)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i byteMask = _mm_set1_epi16(0xFF);
+  const __m128i wrap = _mm_set1_epi16(256);
+  
+  const __m128i c0 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) s0), zero);
+  const __m128i c1 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) s1), zero);
+  const __m128i c2 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) s2), zero);
+  const __m128i c3 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) s3), zero);
+  
+  const __m128i dH = _mm_and_si128(_mm_sub_epi16(c1, c0), byteMask);
+  const __m128i dV = _mm_and_si128(_mm_sub_epi16(c3, c2), byteMask);
+  const __m128i absH = _mm_min_epi16(dH, _mm_sub_epi16(wrap, dH));
+  const __m128i absV = _mm_min_epi16(dV, _mm_sub_epi16(wrap, dV));
+  
+  const __m128i aveH = _mm_srli_epi16(_mm_add_epi16(c0, c1), 1);
+  const __m128i aveV = _mm_srli_epi16(_mm_add_epi16(c2, c3), 1);
+  
+  // Lanes where absH > absV use the V ave
+  
+  const __m128i useV = _mm_cmpgt_epi16(absH, absV);
+  const __m128i hv = _mm_or_si128(_mm_andnot_si128(useV, aveH), _mm_and_si128(useV, aveV));
+  
+  const __m128i p = _mm_sub_epi16(_mm_add_epi16(c0, c1), c2);
+  const __m128i minC = _mm_min_epi16(_mm_min_epi16(c0, c1), c2);
+  const __m128i maxC = _mm_max_epi16(_mm_max_epi16(c0, c1), c2);
+  const __m128i gc = _mm_min_epi16(_mm_max_epi16(p, minC), maxC);
+  
+  const uint32_t compMask = (NumComp == 4) ? 0xFFFFFFFF : 0x00FFFFFF;
+  
+  hvPixel = ((uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(hv, zero))) & compMask;
+  gradclampPixel = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(gc, zero));
+}
+
+#else
+
+template<int NumComp>
+static inline
+void CTI_NeighborPredictKernel(const uint32_t s0,
+                               const uint32_t s1,
+                               const uint32_t s2,
+                               const uint32_t s3,
+                               uint32_t & hvPixel,
+                               uint32_t & gradclampPixel)
+{
+  hvPixel = 0;
+  gradclampPixel = 0;
+  
+  for (int comp = 0; comp < 4; comp++) {
+    const int shift = comp * 8;
     
-    unsigned int ave3 = average_123(scaledSum0, scaledSum1, scaledSum2);
+    const int c0 = (s0 >> shift) & 0xFF;
+    const int c1 = (s1 >> shift) & 0xFF;
+    const int c2 = (s2 >> shift) & 0xFF;
+    const int c3 = (s3 >> shift) & 0xFF;
     
-    if (debug) {
-      printf("ave3 -> %d\n", ave3);
+    if (comp < NumComp) {
+      const int absH = abs((int8_t) (c1 - c0));
+      const int absV = abs((int8_t) (c3 - c2));
+      const int aveH = (c0 + c1) >> 1;
+      const int aveV = (c2 + c3) >> 1;
+      const int hv = (absH <= absV) ? aveH : aveV;
+      hvPixel |= ((uint32_t) hv) << shift;
     }
     
+    const int p = c0 + c1 - c2;
+    const int minC = min(min(c0, c1), c2);
+    const int maxC = max(max(c0, c1), c2);
+    const int gradclamp = min(max(p, minC), maxC);
+    gradclampPixel |= ((uint32_t) gradclamp) << shift;
+  }
+}
+
+#endif // __SSE2__
+
+// Predict a RGB value from the processed neighbors in the 3x3 box around
+// the center. The processed state of the 8 neighbors is gathered into
+// a mask without a branch for each bounds check and the mask selects a
+// table entry. Each component of both the H/V and the gradclamp result
+// is computed with a fixed sequence of add, shift, and min/max ops and
+// the entry masks select the result, so the prediction has no branch
+// that depends on the neighbors. The result is identical to
+// CTI_NeighborPredict2Branches().
+
+template<int NumComp, int CacheLayout, typename LookupFunc>
+static inline
+uint32_t CTI_NeighborPredict2(
+                              CTI_StructT<uint8_t, NumComp, CacheLayout> & ctiStruct,
+                              LookupFunc lookupFunc,
+                              uint32_t * const predErrPtr,
+                              int centerX,
+                              int centerY)
+{
+  const int width = ctiStruct.width;
+  const int height = ctiStruct.height;
+  
+#if defined(DEBUG)
+  assert(centerX >= 0);
+  assert(centerX < width);
+  
+  assert(centerY >= 0);
+  assert(centerY < height);
+#endif // DEBUG
+  
+  const int centerOffset = CTIOffset2d(centerX, centerY, width);
+  
+  const uint32_t inL = (centerX > 0);
+  const uint32_t inR = ((centerX + 1) < width);
+  const uint32_t inU = (centerY > 0);
+  const uint32_t inD = ((centerY + 1) < height);
+  
+  const int neighborOffsets[9] = {
+    -width - 1, -width, -width + 1,
+    -1, 1,
+    width - 1, width, width + 1,
+    0
+  };
+  
+  const uint32_t inBounds[8] = {
+    inU & inL, inU, inU & inR,
+    inL, inR,
+    inD & inL, inD, inD & inR
+  };
+  
+  // An out of bounds neighbor reads the flag at the center, the
+  // result is then cleared by the bounds bit.
+  
+  unsigned int mask = 0;
+  
+  for (int i = 0; i < 8; i++) {
+    const int offset = centerOffset + (neighborOffsets[i] & -((int) inBounds[i]));
+    const uint32_t bit = ((uint32_t) ctiStruct.processedAt(offset)) & inBounds[i];
+    mask |= (bit << i);
+  }
+  
+  const CTI_NeighborPredictEntry & entry = CTI_NeighborPredictTable::shared().entries[mask];
+  
+  const uint32_t s0 = lookupFunc(centerOffset + neighborOffsets[entry.n[0]]);
+  const uint32_t s1 = lookupFunc(centerOffset + neighborOffsets[entry.n[1]]);
+  const uint32_t s2 = lookupFunc(centerOffset + neighborOffsets[entry.n[2]]);
+  const uint32_t s3 = lookupFunc(centerOffset + neighborOffsets[entry.n[3]]);
+  
+  uint32_t hvPixel;
+  uint32_t gradclampPixel;
+  
+  CTI_NeighborPredictKernel<NumComp>(s0, s1, s2, s3, hvPixel, gradclampPixel);
+  
+  uint32_t retPixel = (hvPixel & ~entry.gradclampMask) | (gradclampPixel & entry.gradclampMask);
+  
+  return retPixel & entry.keepMask;
+}
+
+// Predict a 16 bit pixel by looking at the direct 4 neighbor pixels (N S E W)
+// and the 4 corner pixels. This predictor makes the same choices as the
+// 8 bit version of CTI_NeighborPredict2 except that each component
+// is 16 bits and the H vs V choice is based on the actual abs() delta.
+
+template<int NumComp, int CacheLayout, typename LookupFunc>
+static inline
+uint64_t CTI_NeighborPredict2(
+                              CTI_StructT<uint16_t, NumComp, CacheLayout> & ctiStruct,
+                              LookupFunc lookupFunc,
+                              uint64_t * const predErrPtr,
+                              int centerX,
+                              int centerY)
+{
+  const bool debug = false;
+  
+  const int width = ctiStruct.width;
+  const int height = ctiStruct.height;
+  const int numComp = NumComp;
+  
+  if (debug) {
+    printf("CTI_NeighborPredict2 16 (%d,%d)\n", centerX, centerY);
+  }
+  
 #if defined(DEBUG)
-    assert(ave3 != -1);
+  assert(centerX >= 0);
+  assert(centerX < width);
+  
+  assert(centerY >= 0);
+  assert(centerY < height);
 #endif // DEBUG
+  
+  const int centerOffset = CTIOffset2d(centerX, centerY, width);
+  
+  const bool hasLeftCol = (centerX > 0);
+  const bool hasRightCol = (centerX < (width - 1));
+  const bool hasUpRow = (centerY > 0);
+  const bool hasDownRow = (centerY < (height - 1));
+  
+  const bool hasUL = hasUpRow && hasLeftCol && ctiStruct.wasProcessed(centerOffset - width - 1);
+  const bool hasU = hasUpRow && ctiStruct.wasProcessed(centerOffset - width);
+  const bool hasUR = hasUpRow && hasRightCol && ctiStruct.wasProcessed(centerOffset - width + 1);
+  const bool hasL = hasLeftCol && ctiStruct.wasProcessed(centerOffset - 1);
+  const bool hasR = hasRightCol && ctiStruct.wasProcessed(centerOffset + 1);
+  const bool hasDL = hasDownRow && hasLeftCol && ctiStruct.wasProcessed(centerOffset + width - 1);
+  const bool hasD = hasDownRow && ctiStruct.wasProcessed(centerOffset + width);
+  const bool hasDR = hasDownRow && hasRightCol && ctiStruct.wasProcessed(centerOffset + width + 1);
+  
+  // Average each component of 2 pixels
+  
+  auto aveComponents = [numComp](uint64_t p1, uint64_t p2)->uint64_t {
+    uint64_t outPixel = 0;
+    for ( int comp = 0; comp < numComp; comp++ ) {
+      uint64_t c = fast_ave_2(pixel16_component(p1, comp), pixel16_component(p2, comp));
+      outPixel |= (c << (comp * 16));
+    }
+    return outPixel;
+  };
+  
+  uint64_t retPixel = 0;
+  
+  const bool hasH = (hasL && hasR);
+  const bool hasV = (hasU && hasD);
+  
+  if (hasH && hasV) {
+    // Choose the H or V average for each component based on
+    // which axis has the smaller delta.
+    
+    uint64_t pU = lookupFunc(centerOffset - width);
+    uint64_t pL = lookupFunc(centerOffset - 1);
+    uint64_t pR = lookupFunc(centerOffset + 1);
+    uint64_t pD = lookupFunc(centerOffset + width);
     
-    return ave3;
+    for ( int comp = 0; comp < numComp; comp++ ) {
+      int cU = pixel16_component(pU, comp);
+      int cL = pixel16_component(pL, comp);
+      int cR = pixel16_component(pR, comp);
+      int cD = pixel16_component(pD, comp);
+      
+      uint64_t c;
+      
+      if (abs(cR - cL) <= abs(cD - cU)) {
+        c = fast_ave_2(cL, cR);
+      } else {
+        c = fast_ave_2(cU, cD);
+      }
+      
+      retPixel |= (c << (comp * 16));
+    }
+  } else if (hasH) {
+    retPixel = aveComponents(lookupFunc(centerOffset - 1), lookupFunc(centerOffset + 1));
+  } else if (hasV) {
+    retPixel = aveComponents(lookupFunc(centerOffset - width), lookupFunc(centerOffset + width));
+  } else if (hasL && hasU && hasUL) {
+    retPixel = gradclamp16(lookupFunc(centerOffset - 1),
+                           lookupFunc(centerOffset - width),
+                           lookupFunc(centerOffset - width - 1),
+                           numComp);
+  } else if (hasL && hasD && hasDL) {
+    retPixel = gradclamp16(lookupFunc(centerOffset - 1),
+                           lookupFunc(centerOffset + width),
+                           lookupFunc(centerOffset + width - 1),
+                           numComp);
+  } else if (hasR && hasU && hasUR) {
+    retPixel = gradclamp16(lookupFunc(centerOffset + 1),
+                           lookupFunc(centerOffset - width),
+                           lookupFunc(centerOffset - width + 1),
+                           numComp);
+  } else if (hasR && hasD && hasDR) {
+    retPixel = gradclamp16(lookupFunc(centerOffset + 1),
+                           lookupFunc(centerOffset + width),
+                           lookupFunc(centerOffset + width + 1),
+                           numComp);
   } else {
-    // Weighted sum
+    // No H or V primary, at most 1 H and 1 V neighbor is processed
     
-    // The final average is a weighted sum of the 3 row sums.
-    // Approx: sum(100% + 50% + 25%)
+#if defined(DEBUG)
+    assert((hasL || hasR) || (hasU || hasD));
+#endif // DEBUG
     
-    int ave1 = sum1;
-    int ave2 = sum2;
+    uint64_t pH = 0, pV = 0;
     
-    unsigned int wSum;
+    if (hasL) {
+      pH = lookupFunc(centerOffset - 1);
+    } else if (hasR) {
+      pH = lookupFunc(centerOffset + 1);
+    }
     
-    if (debug) {
-      printf("ave scaled sum (0 1 2) = (%d + %d + %d)\n", sum0, ave1, ave2);
+    if (hasU) {
+      pV = lookupFunc(centerOffset - width);
+    } else if (hasD) {
+      pV = lookupFunc(centerOffset + width);
     }
     
-    if (ave1 == -1 && ave2 == -1) {
-      // no average needed
-      
-      if (debug) {
-        printf("no weighted calc\n");
-      }
-      
-      wSum = sum0;
-    } else if (ave1 != -1 && ave2 != -1) {
-      // Weighted Ave (0,1,2) = 16/32 (50%) + 10/32 (31%) + 6/32 (19%)
-      
-      wSum = (sum0 * 16) + (ave1 * 10) + (ave2 * 6);
-      
-      if (debug) {
-        printf("weighted (0,1,2) calc\n");
-      }
-      
-      // FIXME: translate to shifts
-      
-      wSum /= 32;
-    } else if (ave1 == -1) {
-      // Weighted Ave (0,X,2) = 24/32 (75%) + 8/32 (25%)
-      
-      wSum = (sum0 * 24) + (ave2 * 8);
-      
-      if (debug) {
-        printf("weighted (0,X,2) calc\n");
-      }
-      
-      wSum /= 32;
-    } else if (ave2 == -1) {
-      // Weighted Ave (0,1,X) = 21/32 (65%) + 11/32 (35%)
-      
-      if (debug) {
-        printf("weighted (0,1,X) calc\n");
-      }
-      
-      wSum = (sum0 * 21) + (ave1 * 11);
-      
-      // FIXME: translate to shifts
-      
-      wSum /= 32;
+    if (!hasL && !hasR) {
+      retPixel = pV;
+    } else if (!hasU && !hasD) {
+      retPixel = pH;
     } else {
-      assert(0);
+      retPixel = aveComponents(pH, pV);
+    }
+  }
+  
+  if (debug) {
+    printf("predPixel 0x%016llX\n", (unsigned long long) retPixel);
+  }
+  
+  return retPixel;
+}
+
+// Calculate weighted sum of 3 values. The final average is a weighted
+// sum of the 3 row sums where a row sum of -1 indicates no values.
+// Approx: sum(100% + 50% + 25%)
+
+static inline
+unsigned int CTI_WeightedSum(int sum0, int sum1, int sum2)
+{
+  const bool debug = false;
+  
+  int ave1 = sum1;
+  int ave2 = sum2;
+  
+  unsigned int wSum;
+  
+  if (debug) {
+    printf("ave scaled sum (0 1 2) = (%d + %d + %d)\n", sum0, ave1, ave2);
+  }
+  
+  if (ave1 == -1 && ave2 == -1) {
+    // no average needed
+    
+    if (debug) {
+      printf("no weighted calc\n");
     }
     
+    wSum = sum0;
+  } else if (ave1 != -1 && ave2 != -1) {
+    // Weighted Ave (0,1,2) = 16/32 (50%) + 10/32 (31%) + 6/32 (19%)
+    
+    wSum = (sum0 * 16) + (ave1 * 10) + (ave2 * 6);
+    
     if (debug) {
-      printf("weighted sum %d\n", wSum);
+      printf("weighted (0,1,2) calc\n");
     }
     
-    return wSum;
+    wSum >>= 5;
+  } else if (ave1 == -1) {
+    // Weighted Ave (0,X,2) = 24/32 (75%) + 8/32 (25%)
+    
+    wSum = (sum0 * 24) + (ave2 * 8);
+    
+    if (debug) {
+      printf("weighted (0,X,2) calc\n");
+    }
+    
+    wSum >>= 5;
+  } else {
+    // Weighted Ave (0,1,X) = 21/32 (65%) + 11/32 (35%)
+    
+#if defined(DEBUG)
+    assert(ave2 == -1);
+#endif // DEBUG
+    
+    if (debug) {
+      printf("weighted (0,1,X) calc\n");
+    }
+    
+    wSum = (sum0 * 21) + (ave1 * 11);
+    
+    wSum >>= 5;
+  }
+  
+  if (debug) {
+    printf("weighted sum %d\n", wSum);
   }
+  
+  return wSum;
 }
 
 // Given the (X1,Y1) and (X2,Y2) coordinates of a rectangular region,
-// sum the values in each row and return a weighted sum.
+// sum the values in each row and return a weighted sum. Values in
+// a row are colStep elements apart and widthMinusX is added to
+// the offset at the end of a row, so the same logic can read
+// a box from a cache where each pixel stores more than one value.
 
+template<typename T>
 static inline
 //static __attribute__ ((noinline))
-unsigned int CTI_BoxDeltaSum(
-                             const vector<int16_t> & deltaVec,
+unsigned int CTI_BoxDeltaSumScalar(
+                             const T * const deltaVec,
                              int numCols,
                              int numRows,
                              int originOffset,
                              int widthMinusX,
-                             int rowOff
+                             int rowOff,
+                             const int colStep = 1
 )
 {
   const bool debug = false;
@@ -1789,11 +2771,11 @@ unsigned int CTI_BoxDeltaSum(
   
   // Gather 1 -> 15 cached values and count number of pixels that are cached
   
-  unsigned int offset = originOffset;
+  int offset = originOffset;
   
   // Read 1,2,3 values from a non-center row
   
-  auto ncRead = [&offset, widthMinusX](const vector<int16_t> & deltaVec, const int numCols)->int {
+  auto ncRead = [&offset, widthMinusX, colStep](const T * const deltaVec, const int numCols)->int {
     int sumForRow = 0;
     int N = 0;
     
@@ -1811,7 +2793,7 @@ unsigned int CTI_BoxDeltaSum(
         N += 1;
       }
       
-      offset += 1;
+      offset += colStep;
     } // end foreach col in row
     
     // end of row
@@ -1851,7 +2833,7 @@ unsigned int CTI_BoxDeltaSum(
   // it is known to always be invalid. Note that numCols could be 1,2,3 but there will only
   // ever be 1 or 2 valid cached values.
   
-  auto cRead = [&offset, widthMinusX](const vector<int16_t> & deltaVec, const int numCols)->int {
+  auto cRead = [&offset, widthMinusX, colStep](const T * const deltaVec, const int numCols)->int {
     int sumForRow = 0;
     int N = 0;
     
@@ -1880,7 +2862,7 @@ unsigned int CTI_BoxDeltaSum(
         N += 1;
       }
       
-      offset += 1;
+      offset += colStep;
     } // end foreach col in row
     
     // Skip column 1 which is always invalid center pixel
@@ -1890,7 +2872,7 @@ unsigned int CTI_BoxDeltaSum(
       assert(deltaVec[offset] == -1);
 #endif // DEBUG
       
-      offset += 1;
+      offset += colStep;
     }
     
     // Read column 2 which may or may not contain a valid value
@@ -1910,7 +2892,7 @@ unsigned int CTI_BoxDeltaSum(
         N += 1;
       }
       
-      offset += 1;
+      offset += colStep;
     }
     
     // end of row
@@ -1985,55 +2967,244 @@ unsigned int CTI_BoxDeltaSum(
   return CTI_WeightedSum(sum0, sum1, sum2);
 }
 
-// Predict in a horizontal 3x5 box around the unknown pixel
-// by reading from neighbors and generating a weighted average.
+// Box delta sum for a cache type, the generic version invokes
+// the scalar logic.
 
-template<typename DeltaFunc>
-static inline
-//static __attribute__ ((noinline))
-unsigned int CTI_BoxDeltaPredictH(
-                                  CTI_Struct & ctiStruct,
-                                  DeltaFunc deltaFunc,
-                                  int centerX,
-                                  int centerY)
+template<typename T>
+class CTI_BoxDeltaSumKernel
 {
-  const bool debug = false;
+public:
+  static inline
+  unsigned int sum(const T * const deltaVec,
+                   int numCols,
+                   int numRows,
+                   int originOffset,
+                   int widthMinusX,
+                   int rowOff,
+                   const int colStep)
+  {
+    return CTI_BoxDeltaSumScalar(deltaVec, numCols, numRows, originOffset, widthMinusX, rowOff, colStep);
+  }
+};
+
+#if defined(__SSE2__)
+
+// SSE2 box delta sum for int16_t cached deltas. The box is gathered
+// into 5 rows of 4 int16_t lanes where a lane that is not read holds
+// the -1 sentinel, so a box clipped at an edge is evaluated with the
+// same ops as a full 3x5 box. Sentinel lanes get a zero weight and
+// each row sum is divided by the row count with a multiply and shift:
+//
+// N = 1 : (sum * 1024) >> 10
+// N = 2 : (sum * 512) >> 10
+// N = 3 : ((sum + 1) * 341) >> 10
+//
+// This matches fast_div_2() and fast_div_3() exactly, so the result
+// is identical to CTI_BoxDeltaSumScalar(). A row with no values is -1.
+
+template<>
+class CTI_BoxDeltaSumKernel<int16_t>
+{
+public:
+  // Weights for the (0,1,2) row averages indexed by which of the
+  // 1 and 2 averages are defined, see CTI_WeightedSum().
   
-  const auto & cachedHDeltaSums = ctiStruct.cachedHDeltaSums;
+  static inline
+  const uint8_t * weightsTable() {
+    static const uint8_t weights[4 * 3] = {
+      32, 0, 0,  // (0,X,X)
+      21, 11, 0, // (0,1,X)
+      24, 0, 8,  // (0,X,2)
+      16, 10, 6  // (0,1,2)
+    };
+    return weights;
+  }
   
-  // FIXME: rename later
-  const int regionWidth = ctiStruct.width;
-  const int regionHeight = ctiStruct.height;
+  // Divide the row sums in 32 bit lanes 0 and 2 by the row counts
   
-  if (debug) {
-    printf("CTI_BoxPredictH(%d,%d)\n", centerX, centerY);
+  static inline
+  __m128i divideRows(__m128i sums, __m128i counts) {
+    const __m128i one = _mm_set1_epi32(1);
+    
+    const __m128i is1 = _mm_cmpeq_epi32(counts, one);
+    const __m128i is2 = _mm_cmpeq_epi32(counts, _mm_set1_epi32(2));
+    const __m128i is3 = _mm_cmpeq_epi32(counts, _mm_set1_epi32(3));
+    const __m128i is0 = _mm_cmpeq_epi32(counts, _mm_setzero_si128());
+    
+    __m128i mul = _mm_and_si128(is1, _mm_set1_epi32(1024));
+    mul = _mm_or_si128(mul, _mm_and_si128(is2, _mm_set1_epi32(512)));
+    mul = _mm_or_si128(mul, _mm_and_si128(is3, _mm_set1_epi32(341)));
+    
+    const __m128i biased = _mm_add_epi32(sums, _mm_and_si128(is3, one));
+    
+    __m128i quot = _mm_srli_epi64(_mm_mul_epu32(biased, mul), 10);
+    
+    return _mm_or_si128(quot, is0);
   }
   
-  if (debug) {
-    printf("Cached H\n");
+  // Sum each row of 4 lanes, 2 rows per vector
+  
+  static inline
+  __m128i sumRows(const int16_t * const rowsPtr, __m128i & counts) {
+    const __m128i sentinel = _mm_set1_epi16(-1);
+    const __m128i ones = _mm_set1_epi16(1);
     
-    for ( int row = 0; row < regionHeight; row++ ) {
-      for ( int col = 0; col < regionWidth; col++ ) {
-        int cacheOffset = CTIOffset2d(col, row, regionWidth);
-        const int16_t cachedHDeltaSums = ctiStruct.cachedHDeltaSums.values[cacheOffset];
-        
-        printf("%4d ", cachedHDeltaSums);
-      }
-      
-      printf("\n");
-    }
+    const __m128i vals = _mm_loadu_si128((const __m128i *) rowsPtr);
+    const __m128i weights = _mm_andnot_si128(_mm_cmpeq_epi16(vals, sentinel), ones);
+    
+    __m128i sums = _mm_madd_epi16(vals, weights);
+    counts = _mm_madd_epi16(weights, weights);
+    
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(2, 3, 0, 1)));
+    
+    return sums;
   }
-
-  // Print the L2 cache values
   
-#if defined(BOX_DELTA_SUM_WITH_CACHE)
-  if (debug) {
-    printf("Cached H sum3\n");
-    
-    for ( int row = 0; row < regionHeight; row++ ) {
+  static inline
+  unsigned int sum(const int16_t * const deltaVec,
+                   int numCols,
+                   int numRows,
+                   int originOffset,
+                   int widthMinusX,
+                   int rowOff,
+                   const int colStep)
+  {
+#if defined(DEBUG)
+    assert(numCols >= 1 && numCols <= 3);
+    assert(rowOff >= -2 && rowOff <= 0);
+    assert((rowOff + 2 + numRows) <= 5);
+#endif // DEBUG
+    
+    // 5 rows of 4 lanes plus padding for the last vector
+    
+    int16_t rows[3 * 8];
+    
+    const __m128i sentinel = _mm_set1_epi16(-1);
+    _mm_storeu_si128((__m128i *) &rows[0], sentinel);
+    _mm_storeu_si128((__m128i *) &rows[8], sentinel);
+    _mm_storeu_si128((__m128i *) &rows[16], sentinel);
+    
+    int offset = originOffset;
+    int16_t * rowPtr = &rows[(rowOff + 2) * 4];
+    
+    for ( int row = 0; row < numRows; row++ ) {
+      for ( int col = 0; col < numCols; col++ ) {
+        rowPtr[col] = deltaVec[offset];
+        offset += colStep;
+      }
+      offset += widthMinusX;
+      rowPtr += 4;
+    }
+    
+    __m128i counts01, counts23, counts4;
+    
+    __m128i rows01 = sumRows(&rows[0], counts01);
+    __m128i rows23 = sumRows(&rows[8], counts23);
+    __m128i rows4 = sumRows(&rows[16], counts4);
+    
+    rows01 = divideRows(rows01, counts01);
+    rows23 = divideRows(rows23, counts23);
+    rows4 = divideRows(rows4, counts4);
+    
+    const int sumU2 = _mm_cvtsi128_si32(rows01);
+    const int sumU1 = _mm_cvtsi128_si32(_mm_srli_si128(rows01, 8));
+    const int sum0 = _mm_cvtsi128_si32(rows23);
+    const int sumD1 = _mm_cvtsi128_si32(_mm_srli_si128(rows23, 8));
+    const int sumD2 = _mm_cvtsi128_si32(rows4);
+    
+#if defined(DEBUG)
+    assert(sum0 != -1);
+#endif // DEBUG
+    
+    // average_012() where -1 is less than any row ave
+    
+    const bool has1 = (sumD1 != -1) && (sumU1 != -1);
+    const bool has2 = (sumD2 != -1) && (sumU2 != -1);
+    
+    const int sum1 = has1 ? ((sumD1 + sumU1) >> 1) : max(sumD1, sumU1);
+    const int sum2 = has2 ? ((sumD2 + sumU2) >> 1) : max(sumD2, sumU2);
+    
+    const int weightsIndex = (sum1 != -1) | ((sum2 != -1) << 1);
+    const uint8_t * const weights = &weightsTable()[weightsIndex * 3];
+    
+    unsigned int wSum = (sum0 * weights[0]) + (sum1 * weights[1]) + (sum2 * weights[2]);
+    wSum >>= 5;
+    
+#if defined(DEBUG)
+    assert(wSum == CTI_BoxDeltaSumScalar(deltaVec, numCols, numRows, originOffset, widthMinusX, rowOff, colStep));
+#endif // DEBUG
+    
+    return wSum;
+  }
+};
+
+#endif // __SSE2__
+
+// Weighted box delta sum with the kernel for the cache type
+
+template<typename T>
+static inline
+unsigned int CTI_BoxDeltaSum(
+                             const T * const deltaVec,
+                             int numCols,
+                             int numRows,
+                             int originOffset,
+                             int widthMinusX,
+                             int rowOff,
+                             const int colStep
+)
+{
+  return CTI_BoxDeltaSumKernel<T>::sum(deltaVec, numCols, numRows, originOffset, widthMinusX, rowOff, colStep);
+}
+
+// Predict in a horizontal 3x5 box around the unknown pixel
+// by reading from neighbors and generating a weighted average.
+
+template<typename CTIStruct, typename DeltaFunc>
+static inline
+//static __attribute__ ((noinline))
+unsigned int CTI_BoxDeltaPredictH(
+                                  CTIStruct & ctiStruct,
+                                  DeltaFunc deltaFunc,
+                                  int centerX,
+                                  int centerY)
+{
+  const bool debug = false;
+  
+  // FIXME: rename later
+  const int regionWidth = ctiStruct.width;
+  const int regionHeight = ctiStruct.height;
+  
+  if (debug) {
+    printf("CTI_BoxPredictH(%d,%d)\n", centerX, centerY);
+  }
+  
+  if (debug) {
+    printf("Cached H\n");
+    
+    for ( int row = 0; row < regionHeight; row++ ) {
+      for ( int col = 0; col < regionWidth; col++ ) {
+        int cacheOffset = CTIOffset2d(col, row, regionWidth);
+        const int cachedHDeltaSum = ctiStruct.hDeltaAt(cacheOffset);
+        
+        printf("%4d ", cachedHDeltaSum);
+      }
+      
+      printf("\n");
+    }
+  }
+
+  // Print the L2 cache values
+  
+#if defined(BOX_DELTA_SUM_WITH_CACHE)
+  if (debug) {
+    printf("Cached H sum3\n");
+    
+    for ( int row = 0; row < regionHeight; row++ ) {
       for ( int col = 0; col < regionWidth; col++ ) {
         int cacheOffset = CTIOffset2d(col, row, regionWidth);
-        const int16_t val = ctiStruct.cachedHDeltaRows.values[cacheOffset];
+        const int val = ctiStruct.cachedHDeltaRows.values[cacheOffset];
         
         printf("%4d ", val);
       }
@@ -2172,7 +3343,7 @@ unsigned int CTI_BoxDeltaPredictH(
   const int col = maxX;
 
   auto & cachedHDeltaRows = ctiStruct.cachedHDeltaRows;
-  //auto & cachedHDeltaSums = ctiStruct.cachedHDeltaSums;
+  auto & cachedHDeltaSums = ctiStruct.cachedHDeltaSums;
   
   for ( int row = originY; row <= maxY; row++ ) {
     
@@ -2245,12 +3416,13 @@ unsigned int CTI_BoxDeltaPredictH(
   
   unsigned int result = CTI_WeightedSum(sum0, sum1, sum2);
 #else
-  unsigned int result = CTI_BoxDeltaSum(cachedHDeltaSums.values,
-                                        numCols,
-                                        numRows,
-                                        originOffset,
-                                        widthMinusX,
-                                        rowOffInit);
+  unsigned int result = ctiStruct.boxDeltaSumH(originX,
+                                               originY,
+                                               numCols,
+                                               numRows,
+                                               rowOffInit,
+                                               regionWidth,
+                                               regionHeight);
 #endif // BOX_DELTA_SUM_WITH_CACHE
   
 #if defined(DEBUG)
@@ -2286,11 +3458,11 @@ unsigned int CTI_BoxDeltaPredictH(
           assert(offset == cacheOffset);
         }
         
-        cachedHDeltaSums.assertIfInvalidOffset(cacheOffset);
+        assert(cacheOffset < (regionWidth * regionHeight));
       }
 #endif // DEBUG
       
-      const int16_t cachedHDeltaSum = cachedHDeltaSums.values[offset];
+      const int cachedHDeltaSum = ctiStruct.hDeltaAt(offset);
       
       int cachedVal = cachedHDeltaSum;
       
@@ -2400,7 +3572,7 @@ unsigned int CTI_BoxDeltaPredictH(
 //        printf("target\n");
 //      }
       
-      int16_t val = ctiStruct.getRow3CacheValue(true, col, row);
+      int val = ctiStruct.getRow3CacheValue(true, col, row);
       
       if (debug) {
         printf("cached (%d,%d) = %d : sumForRow %d\n", col, row, val, sumForRow);
@@ -2488,19 +3660,17 @@ unsigned int CTI_BoxDeltaPredictH(
 // Predict in a horizontal 5x3 box around the unknown pixel
 // by reading from neighbors and generating a weighted average.
 
-template<typename DeltaFunc>
+template<typename CTIStruct, typename DeltaFunc>
 static inline
 //static __attribute__ ((noinline))
 unsigned int CTI_BoxDeltaPredictV(
-                                  CTI_Struct & ctiStruct,
+                                  CTIStruct & ctiStruct,
                                   DeltaFunc deltaFunc,
                                   int centerX,
                                   int centerY)
 {
   const bool debug = false;
   
-  const auto & cachedVDeltaSums = ctiStruct.cachedVDeltaSums;
-  
   const int regionWidth = ctiStruct.width;
   const int regionHeight = ctiStruct.height;
   
@@ -2516,8 +3686,9 @@ unsigned int CTI_BoxDeltaPredictV(
     
     for ( int row = 0; row < height; row++ ) {
       for ( int col = 0; col < width; col++ ) {
-        int cacheOffset = CTIOffset2d(row, col, regionHeight);
-        const int16_t cachedVDeltaSum = ctiStruct.cachedVDeltaSums.values[cacheOffset];
+        int cacheOffset = CTIOffset2d(col, row, regionWidth);
+        int cacheOffsetT = CTIOffset2d(row, col, regionHeight);
+        const int cachedVDeltaSum = ctiStruct.vDeltaAt(cacheOffset, cacheOffsetT);
         printf("%4d ", cachedVDeltaSum);
       }
       
@@ -2535,7 +3706,7 @@ unsigned int CTI_BoxDeltaPredictV(
     
     for ( int row = 0; row < heightT; row++ ) {
       for ( int col = 0; col < widthT; col++ ) {
-        const int16_t cachedVDeltaSum = ctiStruct.cachedVDeltaSums.values[cacheOffset];
+        const int cachedVDeltaSum = ctiStruct.vDeltaAt(CTIOffset2d(row, col, regionWidth), cacheOffset);
         printf("%4d ", cachedVDeltaSum);
         cacheOffset += 1;
       }
@@ -2675,6 +3846,7 @@ unsigned int CTI_BoxDeltaPredictV(
 #if defined(BOX_DELTA_SUM_WITH_CACHE)
   
   auto & cachedVDeltaRows = ctiStruct.cachedVDeltaRows;
+  auto & cachedVDeltaSums = ctiStruct.cachedVDeltaSums;
   
   for ( int col = originX; col <= maxX; col++ ) {
     //int N = 0; // reset num elements counter for each row
@@ -2755,12 +3927,13 @@ unsigned int CTI_BoxDeltaPredictV(
   
   unsigned int result = CTI_WeightedSum(sum0, sum1, sum2);
 #else // BOX_DELTA_SUM_WITH_CACHE
-  unsigned int result = CTI_BoxDeltaSum(cachedVDeltaSums.values,
-                                        numRows,
-                                        numCols,
-                                        originOffset,
-                                        widthMinusX,
-                                        colOffInit);
+  unsigned int result = ctiStruct.boxDeltaSumV(originX,
+                                               originY,
+                                               numCols,
+                                               numRows,
+                                               colOffInit,
+                                               regionWidth,
+                                               regionHeight);
 #endif // BOX_DELTA_SUM_WITH_CACHE
   
 #if defined(DEBUG)
@@ -2797,11 +3970,11 @@ unsigned int CTI_BoxDeltaPredictV(
           assert(offsetT == cacheOffset);
         }
         
-        cachedVDeltaSums.assertIfInvalidOffset(offsetT);
+        assert(cacheOffset < (regionWidth * regionHeight));
       }
 #endif // DEBUG
       
-      const int16_t cachedDeltaSum = cachedVDeltaSums.values[offsetT];
+      const int cachedDeltaSum = ctiStruct.vDeltaAt(CTIOffset2d(col, row, regionWidth), offsetT);
       
       int cachedVal = cachedDeltaSum;
       
@@ -2897,7 +4070,7 @@ unsigned int CTI_BoxDeltaPredictV(
     if ((1)) {
       int row = maxY;
       
-      int16_t val = ctiStruct.getRow3CacheValue(false, col, row);
+      int val = ctiStruct.getRow3CacheValue(false, col, row);
       
       if (debug) {
       printf("cached (%d,%d) = %d : sumForCol %d\n", col, row, val, sumForCol);
@@ -2984,12 +4157,13 @@ unsigned int CTI_BoxDeltaPredictV(
 
 // Find the minimum delta in the horizontal or vertical trees
 
-template<typename DeltaFunc>
+template<typename CTIStruct, typename DeltaFunc>
 static inline
 void CTI_MinimumSearch(
-                       CTI_Struct & ctiStruct,
+                       CTIStruct & ctiStruct,
                        DeltaFunc deltaFunc,
-                       CoordDelta *smallestPtr)
+                       CoordDelta *smallestPtr,
+                       int *minPrioPtr = nullptr)
 {
   const bool debug = false;
   
@@ -3012,13 +4186,12 @@ void CTI_MinimumSearch(
       int err = ctiStruct.waitListHead();
       
       for (int i = 0; err != -1 && i < 5; i++ ) {
-        auto & node = ctiStruct.waitList.nodeTable[err];
-        vector<CoordDelta> & errTable = ctiStruct.waitList.elemTable[err];
+        vector<CoordDelta> & errTable = ctiStruct.waitList.elemsAt(err);
         
         CoordDelta cd = errTable.back();
         printf("min[%d] (%d) %s\n", i, err, cd.toString().c_str());
         
-        err = node.next;
+        err = ctiStruct.waitList.nextPrio(err);
       }
     }
     
@@ -3180,6 +4353,9 @@ void CTI_MinimumSearch(
     }
     
     *smallestPtr = minCD;
+    if (minPrioPtr != nullptr) {
+      *minPrioPtr = minErr;
+    }
     break;
   }
   } // while find min loop
@@ -3191,20 +4367,60 @@ void CTI_MinimumSearch(
   return;
 }
 
+// A predictor policy defines how a pixel is predicted from the neighbors
+// that have already been processed. The policy is a template argument
+// of the iteration logic so that the predict call is inlined.
+
+// Default predictor, adaptive selection between H, V, and gradclamp
+// predictions based on which neighbors have been processed.
+
+class CTI_AdaptivePredictor
+{
+public:
+  template <typename CTIStruct, typename LookupFunc>
+  static inline
+  typename CTIStruct::Word predict(CTIStruct & ctiStruct,
+                                   LookupFunc lookupFunc,
+                                   int centerX,
+                                   int centerY)
+  {
+    return CTI_NeighborPredict2(ctiStruct, lookupFunc, nullptr, centerX, centerY);
+  }
+};
+
+// Average of the processed (N S E W) neighbors, cheaper than the
+// adaptive predictor but only defined for 8 bit RGB.
+
+class CTI_NeighborAvePredictor
+{
+public:
+  template <typename LookupFunc>
+  static inline
+  uint32_t predict(CTI_Struct & ctiStruct,
+                   LookupFunc lookupFunc,
+                   int centerX,
+                   int centerY)
+  {
+    return CTI_NeighborPredict(ctiStruct, lookupFunc, centerX, centerY);
+  }
+};
+
 // One step of the iteration logic, each step will lookup
-// the min delta and then process that min delta.
+// the min delta and then process that min delta. The prediction
+// residual for the processed pixel is passed to the sink.
 
-template<typename LookupFunc, typename DeltaFunc>
-bool CTI_IterateStep(CTI_Struct & ctiStruct,
-                     LookupFunc lookupFunc,
-                     DeltaFunc deltaFunc,
-                     vector<uint32_t> & iterOrder,
-                     uint32_t * const deltasPtr)
+template<typename Predictor = CTI_AdaptivePredictor, typename CTIStruct, typename LookupFunc, typename DeltaFunc, typename ResidualSink>
+bool CTI_IterateStepWithSink(CTIStruct & ctiStruct,
+                             LookupFunc lookupFunc,
+                             DeltaFunc deltaFunc,
+                             ResidualSink & sink)
 {
+  typedef typename CTIStruct::Word Word;
+  
   const bool debug = false;
   
   if (debug) {
-    printf("CTI_IterateStep %d\n", (int)iterOrder.size());
+    printf("CTI_IterateStep\n");
   }
   
   int regionWidth = ctiStruct.width;
@@ -3226,10 +4442,12 @@ bool CTI_IterateStep(CTI_Struct & ctiStruct,
   // Grab smallest delta
   
   CoordDelta minDelta;
+  int minPrio = 0;
   
   CTI_MinimumSearch(ctiStruct,
                     deltaFunc,
-                    &minDelta);
+                    &minDelta,
+                    &minPrio);
   
   if (minDelta.isEmpty()) {
     return false;
@@ -3294,38 +4512,38 @@ bool CTI_IterateStep(CTI_Struct & ctiStruct,
       printf("iter append %d\n", nextIterOffset);
     }
     
-    iterOrder.push_back(nextIterOffset);
-    
-    // In the case that an output deltas pointer is defined, generate a prediction
-    // pixel and then generate a simple component delta
+    // In the case that the sink accepts residuals, generate a prediction
+    // pixel and then generate a simple component delta. Otherwise only
+    // the offset is passed to the sink.
     
-    if (deltasPtr != nullptr) {
+    if (ResidualSink::hasResiduals) {
       // Predict (R, G, B) using box read logic and generate ave pixel value
       // based on the neighbors.
       
       {
-        uint32_t predPixel = CTI_NeighborPredict2(ctiStruct,
-                                                 lookupFunc,
-                                                  deltasPtr,
-                                                 col, row);
+        Word predPixel = Predictor::predict(ctiStruct,
+                                            lookupFunc,
+                                            col, row);
         
-        uint32_t actualPixel = lookupFunc(nextIterOffset);
+        Word actualPixel = lookupFunc(nextIterOffset);
         
         // Generate actual prediction delta by reading the actual pixel value
         // at the offset being predicted and then generating a delta between the
         // predicted value and the actual value.
         
-        uint32_t deltaPixel = pixel_component_delta(predPixel, actualPixel, 3);
+        Word deltaPixel = ctiStruct.componentDelta(predPixel, actualPixel);
         
         if (debug && deltaPixel != 0) {
-          printf("pred   0x%08X\n", predPixel);
-          printf("actual 0x%08X\n", (actualPixel & 0x00FFFFFF));
-          printf("delta  0x%08X\n", deltaPixel);
+          printf("pred   0x%016llX\n", (unsigned long long) predPixel);
+          printf("actual 0x%016llX\n", (unsigned long long) actualPixel);
+          printf("delta  0x%016llX\n", (unsigned long long) deltaPixel);
           printf("done\n");
         }
         
-        deltasPtr[nextIterOffset] = deltaPixel;
+        sink.emit(nextIterOffset, deltaPixel, minPrio);
       }
+    } else {
+      sink.emit(nextIterOffset, (Word) 0, minPrio);
     }
     
     // Mark this offset as processed, update row and col counters
@@ -3588,21 +4806,40 @@ bool CTI_IterateStep(CTI_Struct & ctiStruct,
   return true;
 }
 
+// One step of the iteration logic where the offset is appended to
+// iterOrder and each residual is written to deltasPtr, pass nullptr
+// when only the iteration order is needed.
+
+template<typename CTIStruct, typename LookupFunc, typename DeltaFunc>
+bool CTI_IterateStep(CTIStruct & ctiStruct,
+                     LookupFunc lookupFunc,
+                     DeltaFunc deltaFunc,
+                     vector<uint32_t> & iterOrder,
+                     typename CTIStruct::Word * const deltasPtr)
+{
+  if (deltasPtr == nullptr) {
+    CTI_IterOrderSink<> sink(iterOrder);
+    return CTI_IterateStepWithSink(ctiStruct, lookupFunc, deltaFunc, sink);
+  } else {
+    CTI_IterOrderSink<CTI_DeltasResidualSink<typename CTIStruct::Word> > sink(iterOrder, deltasPtr);
+    return CTI_IterateStepWithSink(ctiStruct, lookupFunc, deltaFunc, sink);
+  }
+}
+
 // Initialize the first 4 pixel values in the upper left corner of the region.
 // These blocks are explicitly marked as processed and the only step that
 // is needed is to create cached delta values for the 4 pixels. Note that these
 // cached values will not be invalidated since they only reference each other.
 
-template<typename LookupFunc, typename DeltaFunc>
+template<typename CTIStruct, typename LookupFunc, typename DeltaFunc, typename ResidualSink>
 static inline
 void CTI_InitBlock(
                    LookupFunc lookupFunc,
                    DeltaFunc deltaFunc,
                    const int regionWidth,
                    const int regionHeight,
-                   CTI_Struct & ctiStruct,
-                   vector<uint32_t> & iterOrder,
-                   uint32_t * const deltasPtr)
+                   CTIStruct & ctiStruct,
+                   ResidualSink & sink)
 {
   const bool debug = false;
   
@@ -3798,13 +5035,17 @@ void CTI_InitBlock(
     ctiStruct.updateCache(deltaFunc, x, y);
     
     int fromOffset = CTIOffset2d(x, y, ctiStruct.width);
-    iterOrder.push_back(fromOffset);
     ctiStruct.setProcessed(x, y);
     
-    if (deltasPtr) {
-      // Emit upper 4 corner pixels directly without a delta
-      deltasPtr[fromOffset] = lookupFunc(fromOffset);
+    // Emit upper 4 corner pixels directly without a delta
+    
+    typename CTIStruct::Word pixel = 0;
+    
+    if (ResidualSink::hasResiduals) {
+      pixel = lookupFunc(fromOffset);
     }
+    
+    sink.emit(fromOffset, pixel, CTI_RAW_PIXEL_PRIO);
   }
   
   if (debug) {
@@ -3817,16 +5058,15 @@ void CTI_InitBlock(
 // Fill in memory associated with a CTI_Struct for
 // a given width and height.
 
-template<typename LookupFunc, typename DeltaFunc>
+template<typename CTIStruct, typename LookupFunc, typename DeltaFunc, typename ResidualSink>
 static inline
-void CTI_Setup(CTI_Struct & ctiStruct,
-               LookupFunc lookupFunc,
-               DeltaFunc deltaFunc,
-               int waitListN,
-               const int width,
-               const int height,
-               vector<uint32_t> & iterOrder,
-               uint32_t * const deltasPtr)
+void CTI_SetupWithSink(CTIStruct & ctiStruct,
+                       LookupFunc lookupFunc,
+                       DeltaFunc deltaFunc,
+                       int waitListN,
+                       const int width,
+                       const int height,
+                       ResidualSink & sink)
 {
   const bool debug = false;
   //const bool debugDumpCopiedOffsets = false;
@@ -3841,22 +5081,17 @@ void CTI_Setup(CTI_Struct & ctiStruct,
   ctiStruct.width = width;
   ctiStruct.height = height;
   
-  // Iter order
+  // Each prio list reserves memory up front, a small region such as
+  // a tile could never fill the default reserve for every prio.
   
-  if (iterOrder.size() != regionNumPixels) {
-    iterOrder.reserve(regionNumPixels);
-  }
-  iterOrder.clear();
-  
-  
-  ctiStruct.initWaitList(waitListN);
+  ctiStruct.initWaitList(waitListN, min(ElemInitSize, max(16, regionNumPixels / 16)));
   
   // Init deltas so that for a width of N there are (N-1)
   // deltas. The delta at offset 0 corresponds to the
-  // delta between 0 and 1.
+  // delta between 0 and 1. Processed flags are cleared
+  // along with the deltas.
   
-  ctiStruct.cachedHDeltaSums.allocValues(width, height, -1);
-  ctiStruct.cachedVDeltaSums.allocValues(width, height, -1);
+  ctiStruct.allocCache(width, height);
 
 # if defined(BOX_DELTA_SUM_WITH_CACHE)
   ctiStruct.cachedHDeltaRows.allocValues(width, height, -1);
@@ -3870,31 +5105,122 @@ void CTI_Setup(CTI_Struct & ctiStruct,
   assert(height >= 2);
 #endif // DEBUG
   
-  vector<uint8_t> & processedFlags = ctiStruct.processedFlags;
-  
-  if (processedFlags.size() != regionNumPixels) {
-    processedFlags = vector<uint8_t>(regionNumPixels);
-    
-    for ( int i = 0; i < regionNumPixels; i++ ) {
-      processedFlags[i] = 0;
-    }
-  }
   
   CTI_InitBlock(
                 lookupFunc,
                 deltaFunc,
                 width, height,
                 ctiStruct,
-                iterOrder,
-                deltasPtr);
+                sink);
   
   return;
 }
 
+// Setup where the upper left offsets are written to iterOrder and
+// the pixels are written to deltasPtr, pass nullptr when only the
+// iteration order is needed.
+
+template<typename CTIStruct, typename LookupFunc, typename DeltaFunc>
+static inline
+void CTI_Setup(CTIStruct & ctiStruct,
+               LookupFunc lookupFunc,
+               DeltaFunc deltaFunc,
+               int waitListN,
+               const int width,
+               const int height,
+               vector<uint32_t> & iterOrder,
+               typename CTIStruct::Word * const deltasPtr)
+{
+  CTI_ResetIterOrder(iterOrder, width * height);
+  
+  if (deltasPtr == nullptr) {
+    CTI_IterOrderSink<> sink(iterOrder);
+    CTI_SetupWithSink(ctiStruct, lookupFunc, deltaFunc, waitListN, width, height, sink);
+  } else {
+    CTI_IterOrderSink<CTI_DeltasResidualSink<typename CTIStruct::Word> > sink(iterOrder, deltasPtr);
+    CTI_SetupWithSink(ctiStruct, lookupFunc, deltaFunc, waitListN, width, height, sink);
+  }
+}
+
+// Iterate over every pixel in a region, this logic is shared by each
+// entry point. The struct type defines the sample size and number
+// of components while the lambda functions define the pixel lookup
+// and the delta calculation. When the sink does not accept residuals,
+// the prediction logic is not compiled into the loop.
+
+template<typename Predictor = CTI_AdaptivePredictor, typename CTIStruct, typename LookupFunc, typename DeltaFunc, typename ResidualSink>
+static inline
+void CTI_IterateWithSink(CTIStruct & ctiStruct,
+                         LookupFunc lookupFunc,
+                         DeltaFunc deltaFunc,
+                         int waitListN,
+                         const int width,
+                         const int height,
+                         ResidualSink & sink)
+{
+  // The core data structure is a prio stack with statically defined linked list nodes
+  // so that O(1) access to the element with the smallest prio value is
+  // always available.
+  
+  CTI_SetupWithSink(ctiStruct,
+                    lookupFunc,
+                    deltaFunc,
+                    waitListN,
+                    width,
+                    height,
+                    sink);
+  
+  // Iterate over all remaining pixels based on min cost huristic
+  
+  while (CTI_IterateStepWithSink<Predictor>(ctiStruct,
+                                            lookupFunc,
+                                            deltaFunc,
+                                            sink))
+  {
+  }
+  
+#if defined(DEBUG)
+  ctiStruct.printResults();
+#endif // DEBUG
+  
+#if defined(DEBUG)
+  assert(ctiStruct.allPixelsProcessed() == true);
+#endif // DEBUG
+}
+
+// Iterate over every pixel in a region, write the iteration order
+// to iterOrder and write each residual to deltasPtr. The check for
+// nullptr is done once per region.
+
+template<typename Predictor = CTI_AdaptivePredictor, typename CTIStruct, typename LookupFunc, typename DeltaFunc>
+static inline
+void CTI_Iterate(CTIStruct & ctiStruct,
+                 LookupFunc lookupFunc,
+                 DeltaFunc deltaFunc,
+                 int waitListN,
+                 const int width,
+                 const int height,
+                 vector<uint32_t> & iterOrder,
+                 typename CTIStruct::Word * const deltasPtr)
+{
+  CTI_ResetIterOrder(iterOrder, width * height);
+  
+  if (deltasPtr == nullptr) {
+    CTI_IterOrderSink<> sink(iterOrder);
+    CTI_IterateWithSink<Predictor>(ctiStruct, lookupFunc, deltaFunc, waitListN, width, height, sink);
+  } else {
+    CTI_IterOrderSink<CTI_DeltasResidualSink<typename CTIStruct::Word> > sink(iterOrder, deltasPtr);
+    CTI_IterateWithSink<Predictor>(ctiStruct, lookupFunc, deltaFunc, waitListN, width, height, sink);
+  }
+}
+
 // Entry point for iteration over colortable based pixel differences.
 // Instead of a 3D delta this method makes use of a delta value that
 // is based on the difference between 2D table offsets as an unsigned
 // value. This method supports returning only the iteration order.
+// The cost of every pair of table offsets is computed up front, pass
+// CTI_TableCostPaletteDistance to use the distance between the table
+// pixels as the cost instead.
 
 static inline
 void CTI_IterateTable256(
@@ -3903,7 +5229,8 @@ void CTI_IterateTable256(
                  const uint8_t * const tableOffsetsPtr,
                  const int width,
                  const int height,
-                 vector<uint32_t> & iterOrder)
+                 vector<uint32_t> & iterOrder,
+                 const CTI_TableCost costMode = CTI_TableCostWrappedOffset)
 {
   const bool debug = false;
   
@@ -3918,79 +5245,51 @@ void CTI_IterateTable256(
     return pixel;
   };
   
-  auto simpleDetlaTableL = [colortablePixelsPtr, colortableNumPixels, tableOffsetsPtr] (int fromOffset, int toOffset)->int {
-    int delta = CTITablePredict2(tableOffsetsPtr, colortablePixelsPtr, fromOffset, toOffset, colortableNumPixels);
+  CTI_TableCostTable costTable;
+  costTable.init(colortablePixelsPtr, colortableNumPixels, costMode);
+  
+  const uint16_t * const costsPtr = costTable.data();
+  
+  auto simpleDetlaTableL = [costsPtr, tableOffsetsPtr] (int fromOffset, int toOffset)->int {
+    int delta = CTITablePredict2WithCosts(tableOffsetsPtr, costsPtr, fromOffset, toOffset);
     return delta;
   };
   
   CTI_Struct ctiStruct;
   
-  // The core data structure is a prio stack with statically defined linked list nodes
-  // so that O(1) access to the element with the smallest prio value is
-  // always available.
-
-  int waitListN;
-  
-  // Max table size is one byte
-  waitListN = (255+1);
+  CTI_ResetIterOrder(iterOrder, width * height);
+  CTI_IterOrderSink<> sink(iterOrder);
   
-  CTI_Setup(ctiStruct,
-            simpleLookupTableL,
-            simpleDetlaTableL,
-            waitListN,
-            width,
-            height,
-            iterOrder,
-            nullptr);
+  // Max table size is one byte, a palette distance can be as large
+  // as 4 * 255
+  const int waitListN = max((255+1), costTable.maxCost + 1);
   
-  // Iterate over all remaining pixels based on min cost huristic
-  
-  bool hasMoreDeltas;
-  
-  while (1) {
-    hasMoreDeltas = CTI_IterateStep(ctiStruct,
-                                    simpleLookupTableL,
-                                    simpleDetlaTableL,
-                                    iterOrder,
-                                    nullptr);
-    
-    if (!hasMoreDeltas) {
-      break;
-    }
-  }
-
-#if defined(DEBUG)
-  ctiStruct.printResults();
-#endif // DEBUG
-  
-  if (debug) {
-    int N = (int) iterOrder.size();
-    
-    printf("N = %d\n", N);
-    
-    for ( int i = 0; i < N; i++ ) {
-      printf("iter %d\n", iterOrder[i]);
-    }
-  }
-  
-#if defined(DEBUG)
-  assert(ctiStruct.allPixelsProcessed() == true);
-#endif // DEBUG
+  CTI_IterateWithSink(ctiStruct,
+                      simpleLookupTableL,
+                      simpleDetlaTableL,
+                      waitListN,
+                      width,
+                      height,
+                      sink);
   
   return;
 }
 
 // Entry point for iteration by RGB pixels and the
 // min distance is calculated in terms of a sum
-// of the abs() of 3 components (dR + dG + dB)
+// of the abs() of 3 components (dR + dG + dB).
+// The Predictor policy defines how residuals are
+// predicted from processed neighbors and each
+// residual is passed to the sink. The CTIStruct
+// defines the layout of the delta cache.
 
+template<typename Predictor, typename CTIStruct = CTI_Struct, typename ResidualSink>
 static inline
-void CTI_IterateRGB(
+void CTI_IterateRGBWithSink(
                  const uint32_t * const pixelsPtr,
                  const int width,
                  const int height,
-                 vector<uint32_t> & iterOrder,
-                 uint32_t * const deltasPtr)
+                 ResidualSink & sink)
 {
   const bool debug = false;
   
@@ -4012,75 +5311,1217 @@ void CTI_IterateRGB(
     return delta;
   };
   
-  CTI_Struct ctiStruct;
-  
-  // The core data structure is a prio stack with statically defined linked list nodes
-  // so that O(1) access to the element with the smallest prio value is
-  // always available.
-  
-  int waitListN;
+  CTIStruct ctiStruct;
   
   // 3 * byte deltas
-  waitListN = (255+255+255+1);
-  
-  CTI_Setup(ctiStruct,
-            simpleLookupPixelsL,
-            simpleDetlaPixelsL,
-            waitListN,
-            width,
-            height,
-            iterOrder,
-            deltasPtr);
+  const int waitListN = (255+255+255+1);
   
-  // Iterate over all remaining pixels based on min cost huristic
-  
-  bool hasMoreDeltas;
-  
-  while (1) {
-    hasMoreDeltas = CTI_IterateStep(ctiStruct,
-                                    simpleLookupPixelsL,
-                                    simpleDetlaPixelsL,
-                                    iterOrder,
-                                    deltasPtr);
-    
-    if (!hasMoreDeltas) {
-      break;
-    }
-  }
-  
-#if defined(DEBUG)
-  ctiStruct.printResults();
-#endif // DEBUG
-  
-  if (debug) {
-    int N = (int) iterOrder.size();
-    
-    printf("N = %d\n", N);
-    
-    for ( int i = 0; i < N; i++ ) {
-      printf("iter %d\n", iterOrder[i]);
-    }
-  }
-  
-#if defined(DEBUG)
-  assert(ctiStruct.allPixelsProcessed() == true);
-#endif // DEBUG
+  CTI_IterateWithSink<Predictor>(ctiStruct,
+                                 simpleLookupPixelsL,
+                                 simpleDetlaPixelsL,
+                                 waitListN,
+                                 width,
+                                 height,
+                                 sink);
   
   return;
 }
 
-// Entry point for iteration over grayscale values
-// where the gradient is estimated by a simple
-// delta calculation.
+// Write RGB residuals to deltasPtr, or nullptr to
+// generate only the iteration order.
 
+template<typename Predictor>
 static inline
-void CTI_IterateGray(
-                    const uint8_t * const bytesPtr,
-                    const int width,
-                    const int height,
-                    vector<uint32_t> & iterOrder,
-                    uint32_t * const deltasPtr)
-{
+void CTI_IterateRGBWithPredictor(
+                 const uint32_t * const pixelsPtr,
+                 const int width,
+                 const int height,
+                 vector<uint32_t> & iterOrder,
+                 uint32_t * const deltasPtr)
+{
+  CTI_ResetIterOrder(iterOrder, width * height);
+  
+  if (deltasPtr == nullptr) {
+    CTI_IterOrderSink<> sink(iterOrder);
+    CTI_IterateRGBWithSink<Predictor>(pixelsPtr, width, height, sink);
+  } else {
+    CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink(iterOrder, deltasPtr);
+    CTI_IterateRGBWithSink<Predictor>(pixelsPtr, width, height, sink);
+  }
+}
+
+static inline
+void CTI_IterateRGB(
+                 const uint32_t * const pixelsPtr,
+                 const int width,
+                 const int height,
+                 vector<uint32_t> & iterOrder,
+                 uint32_t * const deltasPtr)
+{
+  CTI_IterateRGBWithPredictor<CTI_AdaptivePredictor>(pixelsPtr, width, height, iterOrder, deltasPtr);
+}
+
+// Entry point for iteration by packed 24 bit RGB pixels, see
+// rgb24_load(). Each pixel read loads 3 bytes instead of 4, so
+// a walk that is limited by memory bandwidth moves 25% less data.
+// The iteration order and residuals are the same as CTI_IterateRGB().
+
+template<typename Predictor, typename CTIStruct = CTI_Struct, typename ResidualSink>
+static inline
+void CTI_IterateRGB24WithSink(
+                 const uint8_t * const rgbPtr,
+                 const int width,
+                 const int height,
+                 ResidualSink & sink)
+{
+  auto packedLookupPixelsL = [rgbPtr] (int offset)->uint32_t {
+    return rgb24_load(rgbPtr, offset);
+  };
+  
+  auto packedDeltaPixelsL = [rgbPtr] (int fromOffset, int toOffset)->int {
+    return CTIPredict2_24(rgbPtr, fromOffset, toOffset);
+  };
+  
+  CTIStruct ctiStruct;
+  
+  // 3 * byte deltas
+  const int waitListN = (255+255+255+1);
+  
+  CTI_IterateWithSink<Predictor>(ctiStruct,
+                                 packedLookupPixelsL,
+                                 packedDeltaPixelsL,
+                                 waitListN,
+                                 width,
+                                 height,
+                                 sink);
+  
+  return;
+}
+
+static inline
+void CTI_IterateRGB24(
+                 const uint8_t * const rgbPtr,
+                 const int width,
+                 const int height,
+                 vector<uint32_t> & iterOrder,
+                 uint32_t * const deltasPtr)
+{
+  CTI_ResetIterOrder(iterOrder, width * height);
+  
+  if (deltasPtr == nullptr) {
+    CTI_IterOrderSink<> sink(iterOrder);
+    CTI_IterateRGB24WithSink<CTI_AdaptivePredictor>(rgbPtr, width, height, sink);
+  } else {
+    CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink(iterOrder, deltasPtr);
+    CTI_IterateRGB24WithSink<CTI_AdaptivePredictor>(rgbPtr, width, height, sink);
+  }
+}
+
+// Entry point for iteration by planar RGB pixels, see CTI_PlanarRGB.
+// Each delta reads the components from the 3 planes. The predictor
+// still works on a BGRA word joined from the planes since the
+// prediction kernel already evaluates the components in SIMD lanes.
+// The iteration order and residuals are the same as CTI_IterateRGB().
+
+template<typename Predictor, typename CTIStruct = CTI_Struct, typename ResidualSink>
+static inline
+void CTI_IterateRGBPlanarWithSink(
+                 const CTI_PlanarRGB & planes,
+                 const int width,
+                 const int height,
+                 ResidualSink & sink)
+{
+#if defined(DEBUG)
+  assert(planes.numPixels == (width * height));
+#endif // DEBUG
+  
+  const uint8_t * const bPtr = planes.plane(CTI_PLANE_B);
+  const uint8_t * const gPtr = planes.plane(CTI_PLANE_G);
+  const uint8_t * const rPtr = planes.plane(CTI_PLANE_R);
+  
+  auto planarLookupPixelsL = [bPtr, gPtr, rPtr] (int offset)->uint32_t {
+    return ((uint32_t) bPtr[offset]) | (((uint32_t) gPtr[offset]) << 8) | (((uint32_t) rPtr[offset]) << 16);
+  };
+  
+  auto planarDeltaPixelsL = [bPtr, gPtr, rPtr] (int fromOffset, int toOffset)->int {
+    return CTIPredict2_Planar(bPtr, gPtr, rPtr, fromOffset, toOffset);
+  };
+  
+  CTIStruct ctiStruct;
+  
+  // 3 * byte deltas
+  const int waitListN = (255+255+255+1);
+  
+  CTI_IterateWithSink<Predictor>(ctiStruct,
+                                 planarLookupPixelsL,
+                                 planarDeltaPixelsL,
+                                 waitListN,
+                                 width,
+                                 height,
+                                 sink);
+  
+  return;
+}
+
+// Iterate over planar RGB pixels and write the residuals to 3 residual
+// planes in iteration order, pass nullptr when only the iteration
+// order is needed.
+
+static inline
+void CTI_IterateRGBPlanar(
+                 const CTI_PlanarRGB & planes,
+                 const int width,
+                 const int height,
+                 vector<uint32_t> & iterOrder,
+                 CTI_PlanarRGB * const residualPlanesPtr)
+{
+  CTI_ResetIterOrder(iterOrder, width * height);
+  
+  if (residualPlanesPtr == nullptr) {
+    CTI_IterOrderSink<> sink(iterOrder);
+    CTI_IterateRGBPlanarWithSink<CTI_AdaptivePredictor>(planes, width, height, sink);
+  } else {
+    residualPlanesPtr->alloc(width * height);
+    CTI_IterOrderSink<CTI_PlanarResidualSink> sink(iterOrder, CTI_PlanarResidualSink(*residualPlanesPtr));
+    CTI_IterateRGBPlanarWithSink<CTI_AdaptivePredictor>(planes, width, height, sink);
+  }
+}
+
+// Decode RGB pixels from residuals stored in iteration order, as
+// generated by CTI_StreamResidualSink. The decoder runs the same
+// iteration as the encoder over the pixels decoded so far.
+
+static inline
+void CTI_DecodeRGB(
+                 const uint32_t * const residualsPtr,
+                 const int width,
+                 const int height,
+                 uint32_t * const pixelsPtr)
+{
+  memset(pixelsPtr, 0, width * height * sizeof(uint32_t));
+  
+  // Raw upper left pixels in (0,0) (1,0) (0,1) (1,1) order
+  
+  pixelsPtr[CTIOffset2d(0, 0, width)] = residualsPtr[0] & 0x00FFFFFF;
+  pixelsPtr[CTIOffset2d(1, 0, width)] = residualsPtr[1] & 0x00FFFFFF;
+  pixelsPtr[CTIOffset2d(0, 1, width)] = residualsPtr[2] & 0x00FFFFFF;
+  pixelsPtr[CTIOffset2d(1, 1, width)] = residualsPtr[3] & 0x00FFFFFF;
+  
+  CTI_DecodeResidualSink sink(residualsPtr, pixelsPtr);
+  
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(pixelsPtr, width, height, sink);
+  
+  return;
+}
+
+// Entry point for iteration by RGB pixels after a reversible color
+// transform has been applied. The wait list cost and the prediction
+// both operate on the transformed pixels, so the residuals written
+// to deltasPtr are in the transformed space. A decoder reconstructs
+// the transformed pixels and then applies color_transform_decode().
+
+static inline
+void CTI_IterateRGBTransform(
+                 const uint32_t * const pixelsPtr,
+                 const int width,
+                 const int height,
+                 const CTI_ColorTransform transform,
+                 vector<uint32_t> & iterOrder,
+                 uint32_t * const deltasPtr)
+{
+  const int numPixels = width * height;
+  
+  vector<uint32_t> transformedPixels(numPixels);
+  
+  color_transform_encode(transform, pixelsPtr, transformedPixels.data(), numPixels);
+  
+  CTI_IterateRGB(transformedPixels.data(),
+                 width,
+                 height,
+                 iterOrder,
+                 deltasPtr);
+  
+  return;
+}
+
+// Limits on the adaptive iteration, a zero value disables a limit.
+// The elapsed time is only sampled every CTI_BUDGET_CLOCK_STEPS steps
+// so that reading the clock does not slow down the iteration.
+
+#define CTI_BUDGET_CLOCK_STEPS 1024
+
+class CTI_IterBudget
+{
+public:
+  int maxSteps;
+  double maxSeconds;
+  
+  CTI_IterBudget(int inMaxSteps = 0, double inMaxSeconds = 0.0)
+  : maxSteps(inMaxSteps), maxSeconds(inMaxSeconds)
+  {
+  }
+};
+
+// Entry point for iteration by RGB pixels with a bounded cost. The
+// cost of the adaptive iteration depends on the image content, so the
+// steps and the elapsed time are checked as the iteration runs. Once
+// the budget is exceeded, each pixel that has not been processed is
+// predicted in raster order with gradclamp and passed to the sink with
+// a prio of 0. The left, up, and upLeft neighbors of such a pixel were
+// either processed by the adaptive iteration or come earlier in raster
+// order, so a decoder that replays the adaptive iteration up to the
+// switch point can then decode the rest in raster order. The switch
+// point is the number of pixels emitted by the adaptive iteration and
+// is returned, it is equal to (width * height) when the budget was not
+// exceeded.
+
+template<typename Predictor, typename CTIStruct = CTI_Struct, typename ResidualSink>
+static inline
+int CTI_IterateRGBWithBudget(
+                 const uint32_t * const pixelsPtr,
+                 const int width,
+                 const int height,
+                 const CTI_IterBudget & budget,
+                 ResidualSink & sink)
+{
+  const bool debug = false;
+  
+  auto simpleLookupPixelsL = [pixelsPtr] (int offset)->uint32_t {
+    uint32_t pixel;
+    pixel = pixelsPtr[offset];
+#if defined(DEBUG)
+    pixel = pixel & 0x00FFFFFF;
+#endif // DEBUG
+    return pixel;
+  };
+  
+  auto simpleDetlaPixelsL = [pixelsPtr] (int fromOffset, int toOffset)->int {
+    int delta = CTIPredict2(pixelsPtr, fromOffset, toOffset);
+    return delta;
+  };
+  
+  CTIStruct ctiStruct;
+  
+  // 3 * byte deltas
+  const int waitListN = (255+255+255+1);
+  
+  chrono::steady_clock::time_point startT = chrono::steady_clock::now();
+  
+  CTI_SetupWithSink(ctiStruct,
+                    simpleLookupPixelsL,
+                    simpleDetlaPixelsL,
+                    waitListN,
+                    width,
+                    height,
+                    sink);
+  
+  bool finished = false;
+  int step = 0;
+  
+  while (1) {
+    if (CTI_IterateStepWithSink<Predictor>(ctiStruct,
+                                           simpleLookupPixelsL,
+                                           simpleDetlaPixelsL,
+                                           sink) == false) {
+      finished = true;
+      break;
+    }
+    
+    step += 1;
+    
+    if (budget.maxSteps > 0 && step >= budget.maxSteps) {
+      break;
+    }
+    
+    if (budget.maxSeconds > 0.0 && (step % CTI_BUDGET_CLOCK_STEPS) == 0) {
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - startT;
+      
+      if (elapsed.count() >= budget.maxSeconds) {
+        break;
+      }
+    }
+  }
+  
+  const int numPixels = width * height;
+  
+  if (finished) {
+    return numPixels;
+  }
+  
+  // Raster order gradclamp for the pixels that were not processed
+  
+  int numFallback = 0;
+  
+  for (int y = 0; y < height; y++) {
+    const uint32_t * const rowPtr = &pixelsPtr[CTIOffset2d(0, y, width)];
+    const uint32_t * const upRowPtr = (y == 0) ? nullptr : (rowPtr - width);
+    
+    for (int x = 0; x < width; x++) {
+      const int offset = CTIOffset2d(x, y, width);
+      
+      if (ctiStruct.wasProcessed(offset)) {
+        continue;
+      }
+      
+      numFallback += 1;
+      
+      if (ResidualSink::hasResiduals) {
+        uint32_t predPixel = gradclamp8by4_row_predict(rowPtr, upRowPtr, x);
+        uint32_t deltaPixel = pixel_component_delta(predPixel, rowPtr[x], 3);
+        sink.emit(offset, deltaPixel, 0);
+      } else {
+        sink.emit(offset, (uint32_t) 0, 0);
+      }
+    }
+  }
+  
+  if (debug) {
+    printf("CTI_IterateRGBWithBudget : switch after %d steps : %d of %d pixels in raster order\n", step, numFallback, numPixels);
+  }
+  
+  return numPixels - numFallback;
+}
+
+// A progressive pyramid stores a decimated copy of the image at each
+// level, level k holds the pixels at multiples of (1 << k) in X and Y.
+// The coarsest level is coded first with the adaptive iteration, then
+// each finer level is coded with the adaptive iteration over the level
+// image where the pixels at even (X,Y) are already known from the
+// coarser level. Only the pixels that are new at a level are coded,
+// so a thumbnail can be decoded from a prefix of the levels.
+
+class CTI_PyramidLevel
+{
+public:
+  // Level number, the level image is decimated by (1 << level)
+  int level;
+  
+  int width;
+  int height;
+  
+  // Offsets in the level image of the pixels coded at this level
+  vector<uint32_t> iterOrder;
+  
+  // Residual for each pixel in the level image
+  vector<uint32_t> deltas;
+};
+
+// Predictor for a pyramid level where the pixels at even (X,Y) are known
+// before the level is coded. The prediction is the average of the 8
+// neighbors that are either known or processed, so that a pixel between
+// known pixels is interpolated even before the iteration reaches it.
+
+class CTI_PyramidPredictor
+{
+public:
+  static inline
+  bool isKnown(int x, int y) {
+    return ((x | y) & 0x1) == 0;
+  }
+  
+  template <typename CTIStruct, typename LookupFunc>
+  static inline
+  uint32_t predict(CTIStruct & ctiStruct,
+                   LookupFunc lookupFunc,
+                   int centerX,
+                   int centerY)
+  {
+    static const int dx[] = { 0, -1, 1, 0, -1, 1, -1, 1 };
+    static const int dy[] = { -1, 0, 0, 1, -1, -1, 1, 1 };
+    
+    const int width = ctiStruct.width;
+    const int height = ctiStruct.height;
+    
+    int sumR = 0, sumG = 0, sumB = 0;
+    int num = 0;
+    
+    for (int i = 0; i < 8; i++) {
+      const int col = centerX + dx[i];
+      const int row = centerY + dy[i];
+      
+      if (col < 0 || col >= width || row < 0 || row >= height) {
+        continue;
+      }
+      
+      if (!isKnown(col, row) && !ctiStruct.wasProcessed(col, row)) {
+        continue;
+      }
+      
+      uint32_t pixel = lookupFunc(CTIOffset2d(col, row, width));
+      
+      sumB += pixel & 0xFF;
+      sumG += (pixel >> 8) & 0xFF;
+      sumR += (pixel >> 16) & 0xFF;
+      num += 1;
+    }
+    
+    if (num == 0) {
+      return 0;
+    }
+    
+    const int half = num / 2;
+    
+    uint32_t B = (sumB + half) / num;
+    uint32_t G = (sumG + half) / num;
+    uint32_t R = (sumR + half) / num;
+    
+    return (R << 16) | (G << 8) | B;
+  }
+};
+
+// Sink for a pyramid level, the residuals for pixels known from the
+// coarser level are dropped.
+
+class CTI_PyramidLevelSink
+{
+public:
+  enum { hasResiduals = 1 };
+  
+  CTI_PyramidLevel & level;
+  
+  CTI_PyramidLevelSink(CTI_PyramidLevel & inLevel)
+  : level(inLevel)
+  {
+  }
+  
+  void emit(int offset, uint32_t residual, int prio) {
+    const int y = offset / level.width;
+    const int x = offset - (y * level.width);
+    
+    if (CTI_PyramidPredictor::isKnown(x, y)) {
+      return;
+    }
+    
+    level.iterOrder.push_back(offset);
+    level.deltas[offset] = residual;
+  }
+};
+
+// Entry point for progressive iteration by RGB pixels. At most numLevels
+// levels are generated, fewer when a level would be smaller than the 2x2
+// upper left block. The levels are returned coarsest first, this is the
+// order a decoder reads them in.
+
+static inline
+void CTI_IterateRGBPyramid(
+                 const uint32_t * const pixelsPtr,
+                 const int width,
+                 const int height,
+                 int numLevels,
+                 vector<CTI_PyramidLevel> & levels)
+{
+  const bool debug = false;
+  
+  while (numLevels > 1) {
+    const int shift = numLevels - 1;
+    const int levelWidth = (width + (1 << shift) - 1) >> shift;
+    const int levelHeight = (height + (1 << shift) - 1) >> shift;
+    
+    if (levelWidth >= 2 && levelHeight >= 2) {
+      break;
+    }
+    
+    numLevels -= 1;
+  }
+  
+  levels.clear();
+  levels.resize(numLevels);
+  
+  vector<uint32_t> levelPixels;
+  
+  for (int i = 0; i < numLevels; i++) {
+    const int shift = numLevels - 1 - i;
+    
+    CTI_PyramidLevel & level = levels[i];
+    
+    level.level = shift;
+    level.width = (width + (1 << shift) - 1) >> shift;
+    level.height = (height + (1 << shift) - 1) >> shift;
+    
+    const int levelNumPixels = level.width * level.height;
+    
+    levelPixels.resize(levelNumPixels);
+    
+    for (int y = 0; y < level.height; y++) {
+      for (int x = 0; x < level.width; x++) {
+        levelPixels[CTIOffset2d(x, y, level.width)] = pixelsPtr[CTIOffset2d(x << shift, y << shift, width)];
+      }
+    }
+    
+    level.deltas.resize(levelNumPixels);
+    CTI_ResetIterOrder(level.iterOrder, levelNumPixels);
+    
+    if (i == 0) {
+      CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink(level.iterOrder, level.deltas.data());
+      CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(levelPixels.data(), level.width, level.height, sink);
+    } else {
+      CTI_PyramidLevelSink sink(level);
+      CTI_IterateRGBWithSink<CTI_PyramidPredictor>(levelPixels.data(), level.width, level.height, sink);
+    }
+    
+    if (debug) {
+      printf("pyramid level %d : %d x %d : %d coded pixels\n", level.level, level.width, level.height, (int) level.iterOrder.size());
+    }
+  }
+  
+  return;
+}
+
+// Each tile of a tiled iteration is either processed with the adaptive
+// min cost iteration or with a raster order MED (gradclamp) prediction.
+
+typedef enum {
+  CTI_TileModeAdaptive = 0,
+  CTI_TileModeRasterMED
+} CTI_TileMode;
+
+// A tile where at least this fraction (out of 4) of the MED residuals
+// are exactly zero is treated as synthetic content.
+
+#define CTI_TILE_SYNTHETIC_ZERO_QUARTERS 3
+
+// A tile where the mean abs MED residual per component is at or
+// below this value is treated as flat.
+
+#define CTI_TILE_FLAT_MEAN_ABS_RESIDUAL 1
+
+// Raster order MED prediction over one tile, only pixels inside the
+// tile are used as neighbors so that each tile can be decoded on its
+// own. The residuals are written to tileDeltasPtr in tile order and
+// the sum of the abs() of each component residual is returned. Since
+// this is a single raster pass it also serves as the cost estimate
+// that decides if the tile should use the adaptive path.
+
+static inline
+int CTI_TileRasterMED(
+                      const uint32_t * const pixelsPtr,
+                      const int width,
+                      const int tileX,
+                      const int tileY,
+                      const int tileWidth,
+                      const int tileHeight,
+                      uint32_t * const tileDeltasPtr,
+                      int * numZeroPtr)
+{
+  int sumAbs = 0;
+  int numZero = 0;
+  
+  for (int y = 0; y < tileHeight; y++) {
+    const uint32_t * const rowPtr = &pixelsPtr[CTIOffset2d(tileX, tileY + y, width)];
+    const uint32_t * const upRowPtr = rowPtr - width;
+    
+    for (int x = 0; x < tileWidth; x++) {
+      uint32_t pixel = rowPtr[x];
+      uint32_t predPixel;
+      
+      if (x == 0 && y == 0) {
+        predPixel = 0;
+      } else if (y == 0) {
+        predPixel = rowPtr[x-1];
+      } else if (x == 0) {
+        predPixel = upRowPtr[x];
+      } else {
+        uint32_t L = rowPtr[x-1];
+        uint32_t U = upRowPtr[x];
+        uint32_t UL = upRowPtr[x-1];
+        
+        predPixel = 0;
+        
+        for (int comp = 0; comp < 3; comp++) {
+          const int shift = comp * 8;
+          uint32_t c = gradclamp_predict((L >> shift) & 0xFF, (U >> shift) & 0xFF, (UL >> shift) & 0xFF);
+          predPixel |= (c << shift);
+        }
+      }
+      
+      uint32_t deltaPixel = pixel_component_delta(predPixel, pixel, 3);
+      
+      tileDeltasPtr[(y * tileWidth) + x] = deltaPixel;
+      
+      if (deltaPixel == 0) {
+        numZero += 1;
+      } else {
+        sumAbs += abs((int8_t) (deltaPixel & 0xFF));
+        sumAbs += abs((int8_t) ((deltaPixel >> 8) & 0xFF));
+        sumAbs += abs((int8_t) ((deltaPixel >> 16) & 0xFF));
+      }
+    }
+  }
+  
+  *numZeroPtr = numZero;
+  return sumAbs;
+}
+
+// Choose the tile mode based on the MED cost estimate. Flat or synthetic
+// tiles gain little from the adaptive iteration, so those are left as
+// raster MED which runs many times faster.
+
+static inline
+CTI_TileMode CTI_ChooseTileMode(
+                                const int tileWidth,
+                                const int tileHeight,
+                                const int sumAbs,
+                                const int numZero)
+{
+  const int numPixels = tileWidth * tileHeight;
+  
+  if (tileWidth < 2 || tileHeight < 2) {
+    // Adaptive iteration needs the 2x2 upper left block
+    return CTI_TileModeRasterMED;
+  }
+  
+  if ((numZero * 4) >= (numPixels * CTI_TILE_SYNTHETIC_ZERO_QUARTERS)) {
+    return CTI_TileModeRasterMED;
+  }
+  
+  if (sumAbs <= (numPixels * 3 * CTI_TILE_FLAT_MEAN_ABS_RESIDUAL)) {
+    return CTI_TileModeRasterMED;
+  }
+  
+  return CTI_TileModeAdaptive;
+}
+
+// Entry point for tiled iteration by RGB pixels. Each tile of
+// (tileSize x tileSize) pixels is predicted on its own and a cheap
+// cost estimate chooses the tile mode. The tile mode for each tile
+// is written to tileModes in raster order of tiles and the offsets
+// in iterOrder are image offsets ordered tile by tile.
+
+static inline
+void CTI_IterateRGBTiles(
+                         const uint32_t * const pixelsPtr,
+                         const int width,
+                         const int height,
+                         const int tileSize,
+                         vector<uint32_t> & iterOrder,
+                         uint32_t * const deltasPtr,
+                         vector<uint8_t> & tileModes)
+{
+  const bool debug = false;
+  
+  const int numTilesX = (width + tileSize - 1) / tileSize;
+  const int numTilesY = (height + tileSize - 1) / tileSize;
+  
+  iterOrder.clear();
+  iterOrder.reserve(width * height);
+  
+  tileModes.resize(numTilesX * numTilesY);
+  
+  vector<uint32_t> tilePixels;
+  vector<uint32_t> tileDeltas;
+  vector<uint32_t> tileIterOrder;
+  
+  for (int tileRow = 0; tileRow < numTilesY; tileRow++) {
+    for (int tileCol = 0; tileCol < numTilesX; tileCol++) {
+      const int tileX = tileCol * tileSize;
+      const int tileY = tileRow * tileSize;
+      const int tileWidth = min(tileSize, width - tileX);
+      const int tileHeight = min(tileSize, height - tileY);
+      
+      tileDeltas.resize(tileWidth * tileHeight);
+      
+      int numZero;
+      int sumAbs = CTI_TileRasterMED(pixelsPtr, width, tileX, tileY, tileWidth, tileHeight, tileDeltas.data(), &numZero);
+      
+      CTI_TileMode mode = CTI_ChooseTileMode(tileWidth, tileHeight, sumAbs, numZero);
+      
+      tileModes[(tileRow * numTilesX) + tileCol] = (uint8_t) mode;
+      
+      if (debug) {
+        printf("tile (%d,%d) : sumAbs %d : numZero %d : mode %d\n", tileCol, tileRow, sumAbs, numZero, (int)mode);
+      }
+      
+      if (mode == CTI_TileModeRasterMED) {
+        for (int y = 0; y < tileHeight; y++) {
+          for (int x = 0; x < tileWidth; x++) {
+            int offset = CTIOffset2d(tileX + x, tileY + y, width);
+            iterOrder.push_back(offset);
+            
+            if (deltasPtr) {
+              deltasPtr[offset] = tileDeltas[(y * tileWidth) + x];
+            }
+          }
+        }
+      } else {
+        tilePixels.resize(tileWidth * tileHeight);
+        
+        for (int y = 0; y < tileHeight; y++) {
+          memcpy(&tilePixels[y * tileWidth], &pixelsPtr[CTIOffset2d(tileX, tileY + y, width)], tileWidth * sizeof(uint32_t));
+        }
+        
+        CTI_IterateRGB(tilePixels.data(),
+                       tileWidth,
+                       tileHeight,
+                       tileIterOrder,
+                       (deltasPtr ? tileDeltas.data() : nullptr));
+        
+        for ( uint32_t tileOffset : tileIterOrder ) {
+          int x = tileOffset % tileWidth;
+          int y = tileOffset / tileWidth;
+          int offset = CTIOffset2d(tileX + x, tileY + y, width);
+          iterOrder.push_back(offset);
+          
+          if (deltasPtr) {
+            deltasPtr[offset] = tileDeltas[tileOffset];
+          }
+        }
+      }
+    }
+  }
+  
+  return;
+}
+
+// Inverse of CTI_TileRasterMED() for a tile decoded on its own, the
+// residuals and the pixels are stored with a stride of tileWidth.
+
+static inline
+void CTI_TileRasterMEDDecode(
+                             const uint32_t * const tileDeltasPtr,
+                             const int tileWidth,
+                             const int tileHeight,
+                             uint32_t * const tilePixelsPtr)
+{
+  for (int y = 0; y < tileHeight; y++) {
+    uint32_t * const rowPtr = &tilePixelsPtr[y * tileWidth];
+    const uint32_t * const upRowPtr = rowPtr - tileWidth;
+    
+    for (int x = 0; x < tileWidth; x++) {
+      uint32_t predPixel;
+      
+      if (x == 0 && y == 0) {
+        predPixel = 0;
+      } else if (y == 0) {
+        predPixel = rowPtr[x-1];
+      } else if (x == 0) {
+        predPixel = upRowPtr[x];
+      } else {
+        uint32_t L = rowPtr[x-1];
+        uint32_t U = upRowPtr[x];
+        uint32_t UL = upRowPtr[x-1];
+        
+        predPixel = 0;
+        
+        for (int comp = 0; comp < 3; comp++) {
+          const int shift = comp * 8;
+          uint32_t c = gradclamp_predict((L >> shift) & 0xFF, (U >> shift) & 0xFF, (UL >> shift) & 0xFF);
+          predPixel |= (c << shift);
+        }
+      }
+      
+      rowPtr[x] = pixel_component_sum(predPixel, tileDeltasPtr[(y * tileWidth) + x], 3);
+    }
+  }
+  
+  return;
+}
+
+// Index of the independently decodable tiles in a tiled stream. The
+// residuals of each tile are stored one tile after another in raster
+// order of tiles, so the index records where the residuals of each
+// tile start and the tile mode needed to decode the tile.
+
+class CTI_TileIndex
+{
+public:
+  int width;
+  int height;
+  int tileSize;
+  int numTilesX;
+  int numTilesY;
+  
+  // Tile mode for each tile
+  vector<uint8_t> tileModes;
+  
+  // Stream offset of the first residual for each tile, the extra
+  // last entry is the length of the stream. A gigapixel stream can
+  // hold more than 32 bits of residuals.
+  vector<uint64_t> tileStarts;
+  
+  CTI_TileIndex()
+  : width(0), height(0), tileSize(0), numTilesX(0), numTilesY(0)
+  {
+  }
+  
+  // Append the number of each tile that intersects the rectangle
+  
+  void tilesInRect(int rectX, int rectY, int rectWidth, int rectHeight, vector<int> & tileNums) const
+  {
+    tileNums.clear();
+    
+    int endX = min(rectX + rectWidth, width);
+    int endY = min(rectY + rectHeight, height);
+    rectX = max(rectX, 0);
+    rectY = max(rectY, 0);
+    
+    if (rectX >= endX || rectY >= endY) {
+      return;
+    }
+    
+    for (int tileRow = rectY / tileSize; tileRow <= ((endY - 1) / tileSize); tileRow++) {
+      for (int tileCol = rectX / tileSize; tileCol <= ((endX - 1) / tileSize); tileCol++) {
+        tileNums.push_back((tileRow * numTilesX) + tileCol);
+      }
+    }
+  }
+};
+
+// Encode RGB pixels as a stream of independently decodable tiles. Each
+// tile is coded with CTI_IterateRGBTiles() and the residuals of a tile
+// are appended to the stream in the order the tile is decoded.
+
+static inline
+void CTI_EncodeRGBTileStream(
+                             const uint32_t * const pixelsPtr,
+                             const int width,
+                             const int height,
+                             const int tileSize,
+                             vector<uint32_t> & stream,
+                             CTI_TileIndex & index)
+{
+  const int numPixels = width * height;
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  
+  index.width = width;
+  index.height = height;
+  index.tileSize = tileSize;
+  index.numTilesX = (width + tileSize - 1) / tileSize;
+  index.numTilesY = (height + tileSize - 1) / tileSize;
+  
+  CTI_IterateRGBTiles(pixelsPtr, width, height, tileSize, iterOrder, deltas.data(), index.tileModes);
+  
+  stream.clear();
+  stream.reserve(numPixels);
+  
+  for ( uint32_t offset : iterOrder ) {
+    stream.push_back(deltas[offset]);
+  }
+  
+  // Tiles are emitted in raster order of tiles, so each start is the
+  // sum of the sizes of the tiles before it.
+  
+  index.tileStarts.resize((index.numTilesX * index.numTilesY) + 1);
+  
+  uint64_t start = 0;
+  
+  for (int tileRow = 0; tileRow < index.numTilesY; tileRow++) {
+    for (int tileCol = 0; tileCol < index.numTilesX; tileCol++) {
+      const int tileWidth = min(tileSize, width - (tileCol * tileSize));
+      const int tileHeight = min(tileSize, height - (tileRow * tileSize));
+      index.tileStarts[(tileRow * index.numTilesX) + tileCol] = start;
+      start += tileWidth * tileHeight;
+    }
+  }
+  
+  index.tileStarts[index.numTilesX * index.numTilesY] = start;
+  
+  return;
+}
+
+// Decode only the tiles of a tiled stream that intersect a rectangle
+// and write the pixels inside the rectangle to rectPixelsPtr, which
+// has a width of rectWidth. The rectangle must be inside the image.
+// The number of decoded tiles is returned, the cost is proportional
+// to the area of these tiles and not the whole image.
+
+static inline
+int CTI_DecodeRGBTileRect(
+                          const uint32_t * const streamPtr,
+                          const CTI_TileIndex & index,
+                          const int rectX,
+                          const int rectY,
+                          const int rectWidth,
+                          const int rectHeight,
+                          uint32_t * const rectPixelsPtr)
+{
+  const int tileSize = index.tileSize;
+  
+#if defined(DEBUG)
+  assert(rectX >= 0 && (rectX + rectWidth) <= index.width);
+  assert(rectY >= 0 && (rectY + rectHeight) <= index.height);
+#endif // DEBUG
+  
+  vector<int> tileNums;
+  index.tilesInRect(rectX, rectY, rectWidth, rectHeight, tileNums);
+  
+  vector<uint32_t> tilePixels;
+  vector<uint32_t> tileIterOrder;
+  vector<uint32_t> tileDeltas;
+  
+  for ( int tileNum : tileNums ) {
+    const int tileX = (tileNum % index.numTilesX) * tileSize;
+    const int tileY = (tileNum / index.numTilesX) * tileSize;
+    const int tileWidth = min(tileSize, index.width - tileX);
+    const int tileHeight = min(tileSize, index.height - tileY);
+    
+    const uint32_t * const tileStreamPtr = streamPtr + index.tileStarts[tileNum];
+    
+    tilePixels.resize(tileWidth * tileHeight);
+    
+    if (index.tileModes[tileNum] == CTI_TileModeRasterMED) {
+      CTI_TileRasterMEDDecode(tileStreamPtr, tileWidth, tileHeight, tilePixels.data());
+    } else {
+      CTI_DecodeRGB(tileStreamPtr, tileWidth, tileHeight, tilePixels.data());
+    }
+    
+    // Copy the part of the tile inside the rectangle
+    
+    const int startX = max(tileX, rectX);
+    const int startY = max(tileY, rectY);
+    const int endX = min(tileX + tileWidth, rectX + rectWidth);
+    const int endY = min(tileY + tileHeight, rectY + rectHeight);
+    
+    for (int y = startY; y < endY; y++) {
+      const uint32_t * const tileRowPtr = &tilePixels[CTIOffset2d(startX - tileX, y - tileY, tileWidth)];
+      uint32_t * const rectRowPtr = &rectPixelsPtr[CTIOffset2d(startX - rectX, y - rectY, rectWidth)];
+      memcpy(rectRowPtr, tileRowPtr, (endX - startX) * sizeof(uint32_t));
+    }
+  }
+  
+  return (int) tileNums.size();
+}
+
+// Encode one tile of the RGB pixels in pixelsPtr, which has a width of
+// width, and append the residuals to stream in the order the tile is
+// decoded. The tile is coded on its own, so the result depends only on
+// the pixels in the tile. tilePixels and tileDeltas are scratch buffers
+// that can be reused from one tile to the next.
+
+static inline
+CTI_TileMode CTI_EncodeRGBTile(
+                               const uint32_t * const pixelsPtr,
+                               const int width,
+                               const int tileX,
+                               const int tileY,
+                               const int tileWidth,
+                               const int tileHeight,
+                               vector<uint32_t> & tilePixels,
+                               vector<uint32_t> & tileDeltas,
+                               vector<uint32_t> & stream)
+{
+  tileDeltas.resize(tileWidth * tileHeight);
+  
+  int numZero;
+  int sumAbs = CTI_TileRasterMED(pixelsPtr, width, tileX, tileY, tileWidth, tileHeight, tileDeltas.data(), &numZero);
+  
+  CTI_TileMode mode = CTI_ChooseTileMode(tileWidth, tileHeight, sumAbs, numZero);
+  
+  if (mode == CTI_TileModeRasterMED) {
+    stream.insert(stream.end(), tileDeltas.begin(), tileDeltas.end());
+  } else {
+    tilePixels.resize(tileWidth * tileHeight);
+    
+    for (int y = 0; y < tileHeight; y++) {
+      memcpy(&tilePixels[y * tileWidth], &pixelsPtr[CTIOffset2d(tileX, tileY + y, width)], tileWidth * sizeof(uint32_t));
+    }
+    
+    CTI_StreamResidualSink sink(stream);
+    CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(tilePixels.data(), tileWidth, tileHeight, sink);
+  }
+  
+  return mode;
+}
+
+// Banded encoding keeps only one row of tiles in memory. The pixels
+// for a band are read with a callback, each tile in the band is coded
+// on its own, and the residuals for the band are written to a file
+// before the next band is read. Since each tile is iterated on its own
+// the CoordDelta coordinates are tile relative, so an image can be
+// wider or taller than the 15 bit coordinate limit of a single region.
+
+// Smallest tile size that banded encoding will reduce to in order
+// to fit the memory budget.
+
+#define CTI_BANDED_MIN_TILE_SIZE 16
+
+// Estimate of the peak number of bytes held while a band is encoded.
+// The band holds pixels and residuals for each pixel in the band while
+// a tile holds its pixels, residuals, and the iteration state. The wait
+// list reserves memory for every prio before the tile is iterated, and
+// the tile index holds a mode and a stream offset for each tile in the
+// whole image.
+
+static inline
+size_t CTI_BandedPeakBytes(const int width, const int height, const int tileSize)
+{
+  const size_t bandPixels = (size_t) width * tileSize;
+  const size_t tilePixels = (size_t) tileSize * tileSize;
+  
+  // H and V delta caches and the processed flag
+  const size_t stateBytesPerPixel = (2 * sizeof(CTI_Struct::CacheT)) + 1;
+  
+  // Wait list nodes, a pixel can be on the wait list as both H and V
+  const size_t waitListBytesPerPixel = 2 * (sizeof(CoordDelta) + sizeof(int32_t));
+  
+  // Reserve for each prio, see CTI_SetupWithSink()
+  const size_t waitListN = (255+255+255+1);
+  const size_t elemInitSize = min((size_t) ElemInitSize, max((size_t) 16, tilePixels / 16));
+  const size_t waitListReserveBytes = waitListN * (sizeof(vector<CoordDelta>) + sizeof(StaticPrioStackStdNode) + (elemInitSize * sizeof(CoordDelta)));
+  
+  const size_t numTiles = (size_t) ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+  const size_t indexBytes = (numTiles * sizeof(uint8_t)) + ((numTiles + 1) * sizeof(uint64_t));
+  
+  size_t bandBytes = bandPixels * (sizeof(uint32_t) + sizeof(uint32_t));
+  size_t tileBytes = tilePixels * ((3 * sizeof(uint32_t)) + stateBytesPerPixel + waitListBytesPerPixel);
+  
+  return bandBytes + tileBytes + waitListReserveBytes + indexBytes;
+}
+
+// Encode RGB pixels in bands of (width x tileSize) pixels. readRows(y,
+// numRows, rowsPtr) must write numRows rows starting at row y to rowsPtr.
+// The tile size is reduced until the peak memory estimate fits in
+// memoryBudget, zero means no budget. The residuals are appended to
+// outFile as 32 bit values in the same order as CTI_EncodeRGBTileStream()
+// and the index records where each tile starts. Returns false when
+// the budget is too small or a write fails.
+
+template <typename ReadRowsFunc>
+static inline
+bool CTI_EncodeRGBBandedTileStream(
+                                   ReadRowsFunc readRows,
+                                   const int width,
+                                   const int height,
+                                   int tileSize,
+                                   const size_t memoryBudget,
+                                   FILE *outFile,
+                                   CTI_TileIndex & index,
+                                   size_t *peakBytesPtr = nullptr)
+{
+  const bool debug = false;
+  
+  if (memoryBudget > 0) {
+    while (tileSize > CTI_BANDED_MIN_TILE_SIZE && CTI_BandedPeakBytes(width, height, tileSize) > memoryBudget) {
+      tileSize /= 2;
+    }
+    
+    if (CTI_BandedPeakBytes(width, height, tileSize) > memoryBudget) {
+      return false;
+    }
+  }
+  
+  if (peakBytesPtr) {
+    *peakBytesPtr = CTI_BandedPeakBytes(width, height, tileSize);
+  }
+  
+  index.width = width;
+  index.height = height;
+  index.tileSize = tileSize;
+  index.numTilesX = (width + tileSize - 1) / tileSize;
+  index.numTilesY = (height + tileSize - 1) / tileSize;
+  
+  const int numTiles = index.numTilesX * index.numTilesY;
+  
+  index.tileModes.resize(numTiles);
+  index.tileStarts.resize(numTiles + 1);
+  
+  vector<uint32_t> bandPixels((size_t) width * tileSize);
+  vector<uint32_t> bandStream;
+  bandStream.reserve((size_t) width * tileSize);
+  
+  vector<uint32_t> tilePixels;
+  vector<uint32_t> tileDeltas;
+  
+  uint64_t start = 0;
+  
+  for (int tileRow = 0; tileRow < index.numTilesY; tileRow++) {
+    const int bandY = tileRow * tileSize;
+    const int bandHeight = min(tileSize, height - bandY);
+    
+    readRows(bandY, bandHeight, bandPixels.data());
+    
+    bandStream.clear();
+    
+    for (int tileCol = 0; tileCol < index.numTilesX; tileCol++) {
+      const int tileNum = (tileRow * index.numTilesX) + tileCol;
+      const int tileX = tileCol * tileSize;
+      const int tileWidth = min(tileSize, width - tileX);
+      const int tileHeight = bandHeight;
+      
+      index.tileStarts[tileNum] = start + bandStream.size();
+      
+      CTI_TileMode mode = CTI_EncodeRGBTile(bandPixels.data(), width, tileX, 0, tileWidth, tileHeight, tilePixels, tileDeltas, bandStream);
+      
+      index.tileModes[tileNum] = (uint8_t) mode;
+    }
+    
+    // Spill the finished band
+    
+    if (fwrite(bandStream.data(), sizeof(uint32_t), bandStream.size(), outFile) != bandStream.size()) {
+      return false;
+    }
+    
+    start += bandStream.size();
+    
+    if (debug) {
+      printf("band %d : rows %d to %d : %d residuals\n", tileRow, bandY, bandY + bandHeight, (int) bandStream.size());
+    }
+  }
+  
+  index.tileStarts[numTiles] = start;
+  
+  return true;
+}
+
+// Entry point for iteration by RGBA pixels where alpha is
+// predicted as a 4th channel. The min distance is calculated
+// in terms of a sum of the abs() of 4 components
+// (dR + dG + dB + dA) so that an alpha edge is treated
+// the same as a color edge.
+
+static inline
+void CTI_IterateRGBA(
+                 const uint32_t * const pixelsPtr,
+                 const int width,
+                 const int height,
+                 vector<uint32_t> & iterOrder,
+                 uint32_t * const deltasPtr)
+{
+  const bool debug = false;
+  
+  if (debug) {
+    printf("CTI_IterateRGBA\n");
+  }
+  
+  auto simpleLookupPixelsL = [pixelsPtr] (int offset)->uint32_t {
+    return pixelsPtr[offset];
+  };
+  
+  auto simpleDetlaPixelsL = [pixelsPtr] (int fromOffset, int toOffset)->int {
+    int delta = CTIPredict2(pixelsPtr, fromOffset, toOffset, 4);
+    return delta;
+  };
+  
+  CTI_StructRGBA ctiStruct;
+  
+  // 4 * byte deltas
+  const int waitListN = (255+255+255+255+1);
+  
+  CTI_Iterate(ctiStruct,
+              simpleLookupPixelsL,
+              simpleDetlaPixelsL,
+              waitListN,
+              width,
+              height,
+              iterOrder,
+              deltasPtr);
+  
+  return;
+}
+
+// Entry point for iteration over grayscale values
+// where the gradient is estimated by a simple
+// delta calculation.
+
+static inline
+void CTI_IterateGray(
+                    const uint8_t * const bytesPtr,
+                    const int width,
+                    const int height,
+                    vector<uint32_t> & iterOrder,
+                    uint32_t * const deltasPtr)
+{
   const bool debug = false;
   
   if (debug) {
@@ -4098,56 +6539,104 @@ void CTI_IterateGray(
   
   CTI_Struct ctiStruct;
   
-  // The core data structure is a prio stack with statically defined linked list nodes
-  // so that O(1) access to the element with the smallest prio value is
-  // always available.
+  const int waitListN = (512+1);
   
-  int waitListN;
+  CTI_Iterate(ctiStruct,
+              simpleLookupPixelsL,
+              simpleDetlaPixelsL,
+              waitListN,
+              width,
+              height,
+              iterOrder,
+              deltasPtr);
+  
+  return;
+}
+
+// Entry point for iteration over 16 bit grayscale values where
+// the gradient is estimated by a simple delta calculation. The
+// prediction residual for each pixel is written as a 16 bit value.
+
+static inline
+void CTI_IterateGray16(
+                       const uint16_t * const samplesPtr,
+                       const int width,
+                       const int height,
+                       vector<uint32_t> & iterOrder,
+                       uint64_t * const deltasPtr)
+{
+  const bool debug = false;
   
-  waitListN = (512+1);
+  if (debug) {
+    printf("CTI_IterateGray16\n");
+  }
   
-  CTI_Setup(ctiStruct,
-            simpleLookupPixelsL,
-            simpleDetlaPixelsL,
-            waitListN,
-            width,
-            height,
-            iterOrder,
-            deltasPtr);
+  auto simpleLookupPixelsL = [samplesPtr] (int offset)->uint64_t {
+    return samplesPtr[offset];
+  };
   
-  // Iterate over all remaining pixels based on min cost huristic
+  auto simpleDetlaPixelsL = [samplesPtr] (int fromOffset, int toOffset)->int {
+    int delta = CTIGrayDelta16(samplesPtr, fromOffset, toOffset);
+    return delta;
+  };
   
-  bool hasMoreDeltas;
+  CTI_StructGray16 ctiStruct;
   
-  while (1) {
-    hasMoreDeltas = CTI_IterateStep(ctiStruct,
-                                    simpleLookupPixelsL,
-                                    simpleDetlaPixelsL,
-                                    iterOrder,
-                                    deltasPtr);
-    
-    if (!hasMoreDeltas) {
-      break;
-    }
-  }
+  // Signed 16 bit delta mapped to unsigned
+  const int waitListN = (131070+1);
   
-#if defined(DEBUG)
-  ctiStruct.printResults();
-#endif // DEBUG
+  CTI_Iterate(ctiStruct,
+              simpleLookupPixelsL,
+              simpleDetlaPixelsL,
+              waitListN,
+              width,
+              height,
+              iterOrder,
+              deltasPtr);
+  
+  return;
+}
+
+// Entry point for iteration by RGB pixels with 16 bits per component.
+// Each pixel is packed into a uint64_t as (B G R) 16 bit components
+// and the min distance is the sum of the abs() of the 3 components.
+
+static inline
+void CTI_IterateRGB48(
+                      const uint64_t * const pixelsPtr,
+                      const int width,
+                      const int height,
+                      vector<uint32_t> & iterOrder,
+                      uint64_t * const deltasPtr)
+{
+  const bool debug = false;
   
   if (debug) {
-    int N = (int) iterOrder.size();
-    
-    printf("N = %d\n", N);
-    
-    for ( int i = 0; i < N; i++ ) {
-      printf("iter %d\n", iterOrder[i]);
-    }
+    printf("CTI_IterateRGB48\n");
   }
   
-#if defined(DEBUG)
-  assert(ctiStruct.allPixelsProcessed() == true);
-#endif // DEBUG
+  auto simpleLookupPixelsL = [pixelsPtr] (int offset)->uint64_t {
+    return pixelsPtr[offset];
+  };
+  
+  auto simpleDetlaPixelsL = [pixelsPtr] (int fromOffset, int toOffset)->int {
+    int delta = CTIPredict2_16(pixelsPtr, fromOffset, toOffset, 3);
+    return delta;
+  };
+  
+  CTI_Struct16 ctiStruct;
+  
+  // 3 * 16 bit deltas
+  const int waitListN = (65535+65535+65535+1);
+  
+  CTI_Iterate(ctiStruct,
+              simpleLookupPixelsL,
+              simpleDetlaPixelsL,
+              waitListN,
+              width,
+              height,
+              iterOrder,
+              deltasPtr);
   
   return;
 }
@@ -4157,9 +6646,9 @@ void CTI_IterateGray(
 // of the original 4 pixels in the upper left corner will be touched
 // and that the normal init logic has been executed.
 
-template<typename DeltaFunc>
+template<typename CTIStruct, typename DeltaFunc>
 static inline
-void CTI_ProcessFlags(CTI_Struct & ctiStruct,
+void CTI_ProcessFlags(CTIStruct & ctiStruct,
                       uint8_t *flagsPtr,
                       DeltaFunc deltaFunc)
 {
@@ -4171,17 +6660,17 @@ void CTI_ProcessFlags(CTI_Struct & ctiStruct,
       int offset = CTIOffset2d(x, y, width);
       
       if ((x < 2) && (y < 2)) {
-        assert(ctiStruct.processedFlags[offset] == 1);
+        assert(ctiStruct.wasProcessed(offset) == true);
         // Skip topleft coords which must be set to 1
         continue;
       }
       
       if (flagsPtr[offset]) {
-        assert(ctiStruct.processedFlags[offset] == 0);
-        ctiStruct.processedFlags[offset] = 1;
+        assert(ctiStruct.wasProcessed(offset) == false);
+        ctiStruct.setProcessed(offset);
         ctiStruct.updateCache(deltaFunc, x, y);
       } else {
-        assert(ctiStruct.processedFlags[offset] == 0);
+        assert(ctiStruct.wasProcessed(offset) == false);
       }
     }
   }
@@ -0,0 +1,148 @@
+//
+//  FrameAlloc.h
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Allocation of frame sized buffers that are read in a random order,
+//  like the pixels and the iteration state. With 4K pages a large image
+//  spans many more pages than the TLB can map, so each buffer is marked
+//  for transparent huge pages before it is first written. When built
+//  with FRAME_ALLOC_NUMA defined the pages are also bound to the NUMA
+//  node of the calling thread. Both are hints, when the system does
+//  not support them the buffer is used with normal pages.
+
+#ifndef FRAME_ALLOC_H
+#define FRAME_ALLOC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif // __linux__
+
+// Buffers smaller than one huge page are allocated with malloc()
+
+#define FRAME_ALLOC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// MPOL_PREFERRED from the kernel headers, numaif.h is not required
+
+#define FRAME_ALLOC_MPOL_PREFERRED 1
+
+#if defined(__linux__) && defined(FRAME_ALLOC_NUMA) && defined(SYS_mbind) && defined(SYS_getcpu)
+
+// Bind the pages in a range to the node of the CPU the calling
+// thread is running on. The binding is preferred so that the
+// allocation falls back to another node when the node is full.
+
+static inline
+void frame_buffer_bind_local_node(void *ptr, size_t numBytes)
+{
+  unsigned int cpu = 0;
+  unsigned int node = 0;
+
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+    return;
+  }
+
+  unsigned long nodeMask = 0;
+
+  if (node >= (sizeof(nodeMask) * 8)) {
+    return;
+  }
+
+  nodeMask = 1UL << node;
+
+  // The kernel ignores the last bit of maxnode, so pass one extra bit
+
+  syscall(SYS_mbind, ptr, numBytes, FRAME_ALLOC_MPOL_PREFERRED, &nodeMask, (sizeof(nodeMask) * 8) + 1, 0);
+}
+
+#endif // FRAME_ALLOC_NUMA
+
+// Mark the pages inside a buffer for huge page mapping. This must be
+// invoked before the buffer is written, pages that have already been
+// faulted in are mapped with normal pages.
+
+static inline
+void frame_buffer_advise(void *ptr, size_t numBytes)
+{
+  const int debug = 0;
+
+  if (ptr == NULL || numBytes < FRAME_ALLOC_HUGE_PAGE_SIZE) {
+    return;
+  }
+
+#if defined(__linux__)
+  const uintptr_t pageSize = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+  // Only whole pages inside the buffer can be advised
+
+  uintptr_t start = ((uintptr_t) ptr + pageSize - 1) & ~(pageSize - 1);
+  uintptr_t end = ((uintptr_t) ptr + numBytes) & ~(pageSize - 1);
+
+  if (end <= start) {
+    return;
+  }
+
+#if defined(MADV_HUGEPAGE)
+  int result = madvise((void *) start, end - start, MADV_HUGEPAGE);
+
+  if (debug) {
+    printf("frame_buffer_advise %d bytes : madvise result %d\n", (int) (end - start), result);
+  }
+#endif // MADV_HUGEPAGE
+
+#if defined(FRAME_ALLOC_NUMA) && defined(SYS_mbind) && defined(SYS_getcpu)
+  frame_buffer_bind_local_node((void *) start, end - start);
+#endif // FRAME_ALLOC_NUMA
+#endif // __linux__
+
+  (void) debug;
+}
+
+// Allocate a frame sized buffer, a large buffer is aligned to a huge
+// page boundary so that every page in the buffer can be a huge page.
+// The buffer must be released with free().
+
+static inline
+void * frame_alloc(size_t numBytes)
+{
+  void *ptr = NULL;
+
+  if (numBytes < FRAME_ALLOC_HUGE_PAGE_SIZE) {
+    return malloc(numBytes);
+  }
+
+  if (posix_memalign(&ptr, FRAME_ALLOC_HUGE_PAGE_SIZE, numBytes) != 0) {
+    return NULL;
+  }
+
+  frame_buffer_advise(ptr, numBytes);
+
+  return ptr;
+}
+
+// Allocate a frame sized buffer where every byte is set to zero
+
+static inline
+void * frame_calloc(size_t numElems, size_t elemSize)
+{
+  size_t numBytes = numElems * elemSize;
+
+  void *ptr = frame_alloc(numBytes);
+
+  if (ptr != NULL) {
+    memset(ptr, 0, numBytes);
+  }
+
+  return ptr;
+}
+
+#endif // FRAME_ALLOC_H
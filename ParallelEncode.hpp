@@ -0,0 +1,311 @@
+//
+//  ParallelEncode.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Multi-threaded encoding of a tiled stream. The tile grid depends
+//  only on the image dimensions and the tile size, each tile is coded
+//  on its own into a buffer for that tile, and the buffers are joined
+//  in tile order. The output is then the same for any number of
+//  threads and the same as CTI_EncodeRGBTileStream().
+//
+//  A batch of images of very different sizes is encoded with the same
+//  scheduler. A large RGB image is split into tile jobs and small
+//  images are grouped into one job, so that the jobs are of a similar
+//  size and no worker is left with one giant image at the end.
+
+#ifndef PARALLEL_ENCODE_H
+#define PARALLEL_ENCODE_H
+
+#include "assert.h"
+
+#include <vector>
+
+#import "ColortableIter.hpp"
+#import "WorkStealing.hpp"
+
+using namespace std;
+
+// Encode RGB pixels as a stream of independently decodable tiles with
+// numThreads threads. Idle threads steal tiles from busy threads, since
+// an adaptive tile can take much longer to code than a raster tile.
+
+static inline
+void CTI_EncodeRGBTileStreamParallel(
+                                     const uint32_t * const pixelsPtr,
+                                     const int width,
+                                     const int height,
+                                     const int tileSize,
+                                     const int numThreads,
+                                     vector<uint32_t> & stream,
+                                     CTI_TileIndex & index)
+{
+  const bool debug = false;
+
+  index.width = width;
+  index.height = height;
+  index.tileSize = tileSize;
+  index.numTilesX = (width + tileSize - 1) / tileSize;
+  index.numTilesY = (height + tileSize - 1) / tileSize;
+
+  const int numTiles = index.numTilesX * index.numTilesY;
+
+  index.tileModes.resize(numTiles);
+  index.tileStarts.resize(numTiles + 1);
+
+  vector<vector<uint32_t> > tileStreams(numTiles);
+
+  WorkStealingScheduler scheduler(numThreads);
+
+  // Scratch buffers for each worker
+
+  vector<vector<uint32_t> > workerPixels(scheduler.numWorkers);
+  vector<vector<uint32_t> > workerDeltas(scheduler.numWorkers);
+
+  scheduler.run(numTiles, [&](int tileNum, int worker) {
+    const int tileX = (tileNum % index.numTilesX) * tileSize;
+    const int tileY = (tileNum / index.numTilesX) * tileSize;
+    const int tileWidth = min(tileSize, width - tileX);
+    const int tileHeight = min(tileSize, height - tileY);
+
+    vector<uint32_t> & tileStream = tileStreams[tileNum];
+    tileStream.reserve(tileWidth * tileHeight);
+
+    CTI_TileMode mode = CTI_EncodeRGBTile(pixelsPtr, width, tileX, tileY, tileWidth, tileHeight, workerPixels[worker], workerDeltas[worker], tileStream);
+
+    index.tileModes[tileNum] = (uint8_t) mode;
+  });
+
+  stream.clear();
+  stream.reserve(width * height);
+
+  for (int tileNum = 0; tileNum < numTiles; tileNum++) {
+    index.tileStarts[tileNum] = stream.size();
+    stream.insert(stream.end(), tileStreams[tileNum].begin(), tileStreams[tileNum].end());
+  }
+
+  index.tileStarts[numTiles] = stream.size();
+
+  if (debug) {
+    printf("CTI_EncodeRGBTileStreamParallel %d x %d : %d tiles : %d threads\n", width, height, numTiles, numThreads);
+  }
+
+  return;
+}
+
+// Tile size used when a large batch image is split into tile jobs, an
+// RGB image larger than one tile is split.
+
+#define CTI_BATCH_TILE_SIZE 256
+
+// Small images are added to a group job until the group holds at least
+// this many pixels.
+
+#define CTI_BATCH_GROUP_PIXELS (128 * 128)
+
+// An image in a batch. Either rgbPixels or grayPixels is set, when
+// hasAlpha is true the rgbPixels are BGRA. After encoding, stream holds
+// the residuals. An image coded whole holds the residuals from
+// CTI_IterateRGB(), CTI_IterateRGBA(), or CTI_IterateGray() in
+// iteration order, while a tiled image holds a tiled stream described
+// by index.
+
+class CTI_BatchImage
+{
+public:
+  const uint32_t * rgbPixels;
+  const uint8_t * grayPixels;
+  int width;
+  int height;
+  bool hasAlpha;
+
+  bool isTiled;
+  vector<uint32_t> stream;
+  CTI_TileIndex index;
+
+  // Residuals for each tile before the tiles are joined
+  vector<vector<uint32_t> > tileStreams;
+
+  CTI_BatchImage()
+  : rgbPixels(nullptr), grayPixels(nullptr), width(0), height(0), hasAlpha(false), isTiled(false)
+  {
+  }
+
+  int numPixels() const {
+    return width * height;
+  }
+};
+
+// A job is either one tile of a tiled image or a group of consecutive
+// images that are each coded whole.
+
+class CTI_BatchJob
+{
+public:
+  int firstImage;
+  int numImages;
+  int tileNum;
+
+  CTI_BatchJob(int inFirstImage, int inNumImages, int inTileNum)
+  : firstImage(inFirstImage), numImages(inNumImages), tileNum(inTileNum)
+  {
+  }
+};
+
+// Split the batch into jobs. A gray or BGRA image is always coded whole
+// since only RGB has a tiled encoding.
+
+static inline
+void CTI_BatchMakeJobs(vector<CTI_BatchImage> & images,
+                       const int tileSize,
+                       const int groupPixels,
+                       vector<CTI_BatchJob> & jobs)
+{
+  jobs.clear();
+
+  int groupNumPixels = 0;
+
+  for (int i = 0; i < (int) images.size(); i++) {
+    CTI_BatchImage & image = images[i];
+
+    image.isTiled = (image.rgbPixels != nullptr) && !image.hasAlpha && (image.numPixels() > (tileSize * tileSize));
+
+    if (image.isTiled) {
+      CTI_TileIndex & index = image.index;
+      index.width = image.width;
+      index.height = image.height;
+      index.tileSize = tileSize;
+      index.numTilesX = (image.width + tileSize - 1) / tileSize;
+      index.numTilesY = (image.height + tileSize - 1) / tileSize;
+
+      const int numTiles = index.numTilesX * index.numTilesY;
+
+      index.tileModes.resize(numTiles);
+      index.tileStarts.resize(numTiles + 1);
+      image.tileStreams.resize(numTiles);
+
+      for (int tileNum = 0; tileNum < numTiles; tileNum++) {
+        jobs.push_back(CTI_BatchJob(i, 1, tileNum));
+      }
+
+      groupNumPixels = 0;
+      continue;
+    }
+
+    // Extend the open group when it comes right before this image
+
+    const bool extendGroup = !jobs.empty() &&
+      (jobs.back().tileNum == -1) &&
+      ((jobs.back().firstImage + jobs.back().numImages) == i) &&
+      (groupNumPixels < groupPixels);
+
+    if (extendGroup) {
+      jobs.back().numImages += 1;
+      groupNumPixels += image.numPixels();
+    } else {
+      jobs.push_back(CTI_BatchJob(i, 1, -1));
+      groupNumPixels = image.numPixels();
+    }
+  }
+}
+
+// Encode one image whole with the existing entry points
+
+static inline
+void CTI_BatchEncodeWhole(CTI_BatchImage & image)
+{
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(image.numPixels());
+
+  if (image.rgbPixels && image.hasAlpha) {
+    CTI_IterateRGBA(image.rgbPixels, image.width, image.height, iterOrder, deltas.data());
+  } else if (image.rgbPixels) {
+    CTI_IterateRGB(image.rgbPixels, image.width, image.height, iterOrder, deltas.data());
+  } else {
+    CTI_IterateGray(image.grayPixels, image.width, image.height, iterOrder, deltas.data());
+  }
+
+  image.stream.clear();
+  image.stream.reserve(iterOrder.size());
+
+  for ( uint32_t offset : iterOrder ) {
+    image.stream.push_back(deltas[offset]);
+  }
+}
+
+// Encode a batch of images with numThreads threads, the stats for each
+// worker are written to stats. The output for each image does not
+// depend on the number of threads.
+
+static inline
+void CTI_EncodeBatch(vector<CTI_BatchImage> & images,
+                     const int numThreads,
+                     WorkStealingStats & stats,
+                     const int tileSize = CTI_BATCH_TILE_SIZE,
+                     const int groupPixels = CTI_BATCH_GROUP_PIXELS)
+{
+  const bool debug = false;
+
+  vector<CTI_BatchJob> jobs;
+  CTI_BatchMakeJobs(images, tileSize, groupPixels, jobs);
+
+  WorkStealingScheduler scheduler(numThreads);
+
+  vector<vector<uint32_t> > workerPixels(scheduler.numWorkers);
+  vector<vector<uint32_t> > workerDeltas(scheduler.numWorkers);
+
+  scheduler.run((int) jobs.size(), [&](int jobIndex, int worker) {
+    const CTI_BatchJob & job = jobs[jobIndex];
+
+    if (job.tileNum == -1) {
+      for (int i = job.firstImage; i < (job.firstImage + job.numImages); i++) {
+        CTI_BatchEncodeWhole(images[i]);
+      }
+      return;
+    }
+
+    CTI_BatchImage & image = images[job.firstImage];
+    CTI_TileIndex & index = image.index;
+
+    const int tileX = (job.tileNum % index.numTilesX) * tileSize;
+    const int tileY = (job.tileNum / index.numTilesX) * tileSize;
+    const int tileWidth = min(tileSize, image.width - tileX);
+    const int tileHeight = min(tileSize, image.height - tileY);
+
+    vector<uint32_t> & tileStream = image.tileStreams[job.tileNum];
+    tileStream.reserve(tileWidth * tileHeight);
+
+    CTI_TileMode mode = CTI_EncodeRGBTile(image.rgbPixels, image.width, tileX, tileY, tileWidth, tileHeight, workerPixels[worker], workerDeltas[worker], tileStream);
+
+    index.tileModes[job.tileNum] = (uint8_t) mode;
+  }, &stats);
+
+  // Join the tiles of each tiled image in tile order
+
+  for ( CTI_BatchImage & image : images ) {
+    if (!image.isTiled) {
+      continue;
+    }
+
+    const int numTiles = (int) image.tileStreams.size();
+
+    image.stream.clear();
+    image.stream.reserve(image.numPixels());
+
+    for (int tileNum = 0; tileNum < numTiles; tileNum++) {
+      image.index.tileStarts[tileNum] = image.stream.size();
+      image.stream.insert(image.stream.end(), image.tileStreams[tileNum].begin(), image.tileStreams[tileNum].end());
+    }
+
+    image.index.tileStarts[numTiles] = image.stream.size();
+    image.tileStreams.clear();
+  }
+
+  if (debug) {
+    printf("CTI_EncodeBatch %d images : %d jobs : %d steals\n", (int) images.size(), (int) jobs.size(), stats.totalSteals());
+  }
+}
+
+#endif // PARALLEL_ENCODE_H
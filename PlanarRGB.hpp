@@ -0,0 +1,184 @@
+//
+//  PlanarRGB.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Planar storage of RGB pixels where the B, G, and R components are
+//  stored in three separate byte planes. A delta between two pixels
+//  reads one byte from each plane instead of unpacking the components
+//  of a BGRA word with shifts and masks, and 16 pixels of one channel
+//  fill a SSE2 register. Pixels are converted between the packed BGRA
+//  layout and the planes only when an image is loaded or written.
+
+#ifndef PLANAR_RGB_H
+#define PLANAR_RGB_H
+
+#include "assert.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif // __SSE2__
+
+using namespace std;
+
+// Plane index for each component, this is the byte order of a BGRA word
+
+#define CTI_PLANE_B 0
+#define CTI_PLANE_G 1
+#define CTI_PLANE_R 2
+
+class CTI_PlanarRGB
+{
+public:
+  int numPixels;
+
+  vector<uint8_t> planes[3];
+
+  CTI_PlanarRGB()
+  : numPixels(0)
+  {
+  }
+
+  void alloc(const int inNumPixels) {
+    numPixels = inNumPixels;
+    for (int i = 0; i < 3; i++) {
+      planes[i].resize(numPixels);
+    }
+  }
+
+  const uint8_t * plane(const int i) const {
+    return planes[i].data();
+  }
+
+  uint8_t * plane(const int i) {
+    return planes[i].data();
+  }
+
+  // Join the 3 components at offset into a BGRA word with a zero alpha
+
+  uint32_t pixelAt(const int offset) const {
+    return ((uint32_t) planes[CTI_PLANE_B][offset]) |
+           (((uint32_t) planes[CTI_PLANE_G][offset]) << 8) |
+           (((uint32_t) planes[CTI_PLANE_R][offset]) << 16);
+  }
+
+  // Split BGRA pixels into the 3 planes, alpha is dropped
+
+  void fromPixels(const uint32_t * const pixelsPtr, const int inNumPixels) {
+    alloc(inNumPixels);
+
+    uint8_t * const bPtr = plane(CTI_PLANE_B);
+    uint8_t * const gPtr = plane(CTI_PLANE_G);
+    uint8_t * const rPtr = plane(CTI_PLANE_R);
+
+    int i = 0;
+
+#if defined(__SSE2__)
+    // Each component of 16 pixels is moved into a 32 bit lane and
+    // then narrowed to bytes, the values are at most 255 so the
+    // saturating packs do not change them.
+
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+
+    for ( ; (i + 16) <= numPixels; i += 16) {
+      __m128i p0 = _mm_loadu_si128((const __m128i *) (pixelsPtr + i));
+      __m128i p1 = _mm_loadu_si128((const __m128i *) (pixelsPtr + i + 4));
+      __m128i p2 = _mm_loadu_si128((const __m128i *) (pixelsPtr + i + 8));
+      __m128i p3 = _mm_loadu_si128((const __m128i *) (pixelsPtr + i + 12));
+
+      for (int comp = 0; comp < 3; comp++) {
+        const __m128i shift = _mm_cvtsi32_si128(comp * 8);
+
+        __m128i c0 = _mm_and_si128(_mm_srl_epi32(p0, shift), byteMask);
+        __m128i c1 = _mm_and_si128(_mm_srl_epi32(p1, shift), byteMask);
+        __m128i c2 = _mm_and_si128(_mm_srl_epi32(p2, shift), byteMask);
+        __m128i c3 = _mm_and_si128(_mm_srl_epi32(p3, shift), byteMask);
+
+        __m128i c01 = _mm_packs_epi32(c0, c1);
+        __m128i c23 = _mm_packs_epi32(c2, c3);
+
+        _mm_storeu_si128((__m128i *) (plane(comp) + i), _mm_packus_epi16(c01, c23));
+      }
+    }
+#endif // __SSE2__
+
+    for ( ; i < numPixels; i++) {
+      const uint32_t pixel = pixelsPtr[i];
+      bPtr[i] = pixel & 0xFF;
+      gPtr[i] = (pixel >> 8) & 0xFF;
+      rPtr[i] = (pixel >> 16) & 0xFF;
+    }
+  }
+
+  // Join the 3 planes into BGRA pixels with a zero alpha
+
+  void toPixels(uint32_t * const pixelsPtr) const {
+    const uint8_t * const bPtr = plane(CTI_PLANE_B);
+    const uint8_t * const gPtr = plane(CTI_PLANE_G);
+    const uint8_t * const rPtr = plane(CTI_PLANE_R);
+
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for ( ; (i + 16) <= numPixels; i += 16) {
+      __m128i b = _mm_loadu_si128((const __m128i *) (bPtr + i));
+      __m128i g = _mm_loadu_si128((const __m128i *) (gPtr + i));
+      __m128i r = _mm_loadu_si128((const __m128i *) (rPtr + i));
+
+      __m128i bgLo = _mm_unpacklo_epi8(b, g);
+      __m128i bgHi = _mm_unpackhi_epi8(b, g);
+      __m128i r0Lo = _mm_unpacklo_epi8(r, zero);
+      __m128i r0Hi = _mm_unpackhi_epi8(r, zero);
+
+      _mm_storeu_si128((__m128i *) (pixelsPtr + i), _mm_unpacklo_epi16(bgLo, r0Lo));
+      _mm_storeu_si128((__m128i *) (pixelsPtr + i + 4), _mm_unpackhi_epi16(bgLo, r0Lo));
+      _mm_storeu_si128((__m128i *) (pixelsPtr + i + 8), _mm_unpacklo_epi16(bgHi, r0Hi));
+      _mm_storeu_si128((__m128i *) (pixelsPtr + i + 12), _mm_unpackhi_epi16(bgHi, r0Hi));
+    }
+#endif // __SSE2__
+
+    for ( ; i < numPixels; i++) {
+      pixelsPtr[i] = pixelAt(i);
+    }
+  }
+};
+
+// abs() of the wrapped delta between two components, this is the
+// same value sum_of_abs_components() computes for one component
+
+static inline
+unsigned int planar_abs_delta(const uint8_t c1, const uint8_t c2) {
+  const int8_t delta = (int8_t) (uint8_t) (c2 - c1);
+  return (unsigned int) abs((int) delta);
+}
+
+// CTIPredict2() for planar pixels, each component is read from its
+// own plane so no component is unpacked from a pixel word
+
+static inline
+int CTIPredict2_Planar(const uint8_t * const bPtr,
+                       const uint8_t * const gPtr,
+                       const uint8_t * const rPtr,
+                       int o1,
+                       int o2) {
+#if defined(DEBUG)
+  assert(o1 != o2);
+#endif // DEBUG
+
+  unsigned int sum = planar_abs_delta(bPtr[o1], bPtr[o2]);
+  sum += planar_abs_delta(gPtr[o1], gPtr[o2]);
+  sum += planar_abs_delta(rPtr[o1], rPtr[o2]);
+
+  return (int) sum;
+}
+
+#endif // PLANAR_RGB_H
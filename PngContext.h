@@ -12,6 +12,8 @@
 #define PNG_DEBUG 3
 #include "png.h"
 
+#include "FrameAlloc.h"
+
 void abort_(const char * s, ...)
 {
   va_list args;
@@ -34,11 +36,20 @@ typedef struct {
   png_bytep * row_pointers;
   
   uint32_t *pixels;
+  
+  // Palette image read with read_png_file_indexed(), indexes holds one
+  // palette index for each pixel and pixels is NULL until expanded.
+  
+  uint8_t *indexes;
+  int numPaletteColors;
+  uint32_t palette[256];
 } PngContext;
 
 void PngContext_init(PngContext *cxt) {
   cxt->pixels = NULL;
   cxt->row_pointers = NULL;
+  cxt->indexes = NULL;
+  cxt->numPaletteColors = 0;
 }
 
 // Init settings on context, if the isAlpha flag is true then
@@ -67,9 +78,9 @@ void PngContext_alloc_pixels(PngContext *cxt, int width, int height) {
   cxt->width = width;
   cxt->height = height;
   
-  /* allocate pixels data and read into array of pixels */
+  /* allocate pixels data and read into array of pixels, a large image is mapped with huge pages */
   
-  cxt->pixels = (uint32_t*) malloc(cxt->width * cxt->height * sizeof(uint32_t));
+  cxt->pixels = (uint32_t*) frame_alloc(cxt->width * cxt->height * sizeof(uint32_t));
   
   if (cxt->pixels == NULL) {
     abort_("[PngContext_alloc_pixels] could not allocate %d bytes to store pixel data", (cxt->width * cxt->height * sizeof(uint32_t)));
@@ -118,7 +129,12 @@ void free_row_pointers(PngContext *cxt)
   cxt->row_pointers = NULL;
 }
 
-void read_png_file(char* file_name, PngContext *cxt)
+// Read a PNG into BGRA pixels. When keepIndexes is true and the PNG
+// is a palette image, the palette is read into cxt->palette as BGRA
+// pixels and the index of each pixel is read into cxt->indexes without
+// expanding the pixels. Any other kind of PNG is read into pixels.
+
+void read_png_file_with_mode(char* file_name, PngContext *cxt, int keepIndexes)
 {
   char header[8];    // 8 is the maximum size that can be checked
   
@@ -153,7 +169,22 @@ void read_png_file(char* file_name, PngContext *cxt)
   int width = png_get_image_width(cxt->png_ptr, cxt->info_ptr);
   int height = png_get_image_height(cxt->png_ptr, cxt->info_ptr);
   
-  PngContext_alloc_pixels(cxt, width, height);
+  // volatile since it is set between two setjmp() calls and read after
+  // the second, a longjmp() from libpng must not leave it undefined
+  
+  volatile int isIndexed = keepIndexes && (png_get_color_type(cxt->png_ptr, cxt->info_ptr) == PNG_COLOR_TYPE_PALETTE);
+  
+  if (isIndexed) {
+    cxt->width = width;
+    cxt->height = height;
+    cxt->indexes = (uint8_t*) frame_alloc(width * height);
+    
+    if (cxt->indexes == NULL) {
+      abort_("[read_png_file] could not allocate %d bytes to store index data", (width * height));
+    }
+  } else {
+    PngContext_alloc_pixels(cxt, width, height);
+  }
   
   cxt->color_type = png_get_color_type(cxt->png_ptr, cxt->info_ptr);
   cxt->bit_depth = png_get_bit_depth(cxt->png_ptr, cxt->info_ptr);
@@ -171,7 +202,72 @@ void read_png_file(char* file_name, PngContext *cxt)
   int isBGRA = 0;
   
   png_byte ctByte = png_get_color_type(cxt->png_ptr, cxt->info_ptr);
+  
+  if (isIndexed) {
+    png_colorp pngPalette = NULL;
+    int numPalette = 0;
+    png_bytep transAlpha = NULL;
+    int numTrans = 0;
+    
+    png_get_PLTE(cxt->png_ptr, cxt->info_ptr, &pngPalette, &numPalette);
+    
+    if (png_get_valid(cxt->png_ptr, cxt->info_ptr, PNG_INFO_tRNS)) {
+      png_get_tRNS(cxt->png_ptr, cxt->info_ptr, &transAlpha, &numTrans, NULL);
+    }
+    
+    memset(cxt->palette, 0, sizeof(cxt->palette));
+    
+    for (int i = 0; i < numPalette && i < 256; i++) {
+      uint32_t B = pngPalette[i].blue;
+      uint32_t G = pngPalette[i].green;
+      uint32_t R = pngPalette[i].red;
+      uint32_t A = (i < numTrans) ? transAlpha[i] : 0xFF;
+      
+      cxt->palette[i] = (A << 24) | (R << 16) | (G << 8) | B;
+    }
+    
+    cxt->numPaletteColors = numPalette;
+    cxt->hasAlpha = (numTrans > 0);
+    
+    // Each index is unpacked into its own byte
+    
+    if (cxt->bit_depth < 8) {
+      png_set_packing(cxt->png_ptr);
+    }
+    
+    png_read_update_info(cxt->png_ptr, cxt->info_ptr);
+    allocate_row_pointers(cxt);
+    png_read_image(cxt->png_ptr, cxt->row_pointers);
+    
+    // An index past the end of the palette is an invalid pixel, the
+    // palette is extended with zero entries so that every index can
+    // be looked up.
+    
+    int maxIndex = 0;
+    
+    for (int y=0; y < cxt->height; y++) {
+      png_byte* row = cxt->row_pointers[y];
+      uint8_t* outRow = cxt->indexes + (y * cxt->width);
+      
+      memcpy(outRow, row, cxt->width);
+      
+      for (int x=0; x < cxt->width; x++) {
+        if (row[x] > maxIndex) {
+          maxIndex = row[x];
+        }
+      }
+    }
+    
+    if (maxIndex >= cxt->numPaletteColors) {
+      cxt->numPaletteColors = maxIndex + 1;
+    }
+    
+    fclose(fp);
     
+    free_row_pointers(cxt);
+    return;
+  }
+  
   if (ctByte == PNG_COLOR_TYPE_PALETTE) {
     png_set_palette_to_rgb(cxt->png_ptr);
     
@@ -199,8 +295,8 @@ void read_png_file(char* file_name, PngContext *cxt)
   
   int pixeli = 0;
 
-  allocate_row_pointers(cxt);
   png_read_update_info(cxt->png_ptr, cxt->info_ptr);
+  allocate_row_pointers(cxt);
   png_read_image(cxt->png_ptr, cxt->row_pointers);
   
   for (int y=0; y < cxt->height; y++) {
@@ -258,6 +354,38 @@ void read_png_file(char* file_name, PngContext *cxt)
   free_row_pointers(cxt);
 }
 
+void read_png_file(char* file_name, PngContext *cxt)
+{
+  read_png_file_with_mode(file_name, cxt, 0);
+}
+
+// Read a palette PNG as a palette and an index for each pixel, any
+// other kind of PNG is read into BGRA pixels. Check cxt->indexes to
+// see which one was read.
+
+void read_png_file_indexed(char* file_name, PngContext *cxt)
+{
+  read_png_file_with_mode(file_name, cxt, 1);
+}
+
+// Expand the palette indexes read by read_png_file_indexed() into
+// BGRA pixels, the indexes are kept.
+
+void PngContext_expand_indexes(PngContext *cxt)
+{
+  if (cxt->indexes == NULL || cxt->pixels != NULL) {
+    return;
+  }
+  
+  PngContext_alloc_pixels(cxt, cxt->width, cxt->height);
+  
+  int numPixels = cxt->width * cxt->height;
+  
+  for (int i = 0; i < numPixels; i++) {
+    cxt->pixels[i] = cxt->palette[cxt->indexes[i]];
+  }
+}
+
 
 void write_png_file(char* file_name, PngContext *cxt)
 {
@@ -397,4 +525,5 @@ void PngContext_dealloc(PngContext *cxt)
 {
   free_row_pointers(cxt);
   free(cxt->pixels);
+  free(cxt->indexes);
 }
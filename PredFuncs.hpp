@@ -439,10 +439,11 @@ int ComponentAverage(const uint32_t * const pixelsPtr, int o1, int o2) {
   return predPixel;
 }
 
-// Predict pixels with 2 neighbors
+// Predict pixels with 2 neighbors. The numComp argument is 3 for
+// RGB pixels or 4 when the alpha channel is included in the delta.
 
 static inline
-int CTIPredict2(const uint32_t * const pixelsPtr, int o1, int o2) {
+int CTIPredict2(const uint32_t * const pixelsPtr, int o1, int o2, const int numComp = 3) {
   const bool debug = false;
   
   if (debug) {
@@ -482,7 +483,7 @@ int CTIPredict2(const uint32_t * const pixelsPtr, int o1, int o2) {
     printf("predict(%2d,%2d) : 0x%08X -> 0x%08X\n", o1, o2, p1, p2);
   }
   
-  uint32_t deltaPixel = pixel_component_delta(p1, p2, 3);
+  uint32_t deltaPixel = pixel_component_delta(p1, p2, numComp);
   
   if (debug) {
     printf("comp delta     : 0x%08X\n", deltaPixel);
@@ -490,13 +491,65 @@ int CTIPredict2(const uint32_t * const pixelsPtr, int o1, int o2) {
   
 //  const unsigned int weight = 8;
   
-  unsigned int sum = sum_of_abs_components(deltaPixel, 3);
+  unsigned int sum = sum_of_abs_components(deltaPixel, numComp);
   
 //  return sum * weight;
   
   return sum;
 }
 
+// Packed 24 bit pixels store the B G R bytes of each pixel with no
+// padding byte, so a row is 3/4 the size of a row of BGRA pixels.
+// A packed pixel is loaded as a BGRA pixel with a zero alpha.
+
+static inline
+uint32_t rgb24_load(const uint8_t * const rgbPtr, const int offset) {
+  const uint8_t * const ptr = rgbPtr + (offset * 3);
+  return ((uint32_t) ptr[0]) | (((uint32_t) ptr[1]) << 8) | (((uint32_t) ptr[2]) << 16);
+}
+
+// Pack the B G R components of BGRA pixels, alpha is dropped
+
+static inline
+void rgb24_pack(const uint32_t * const pixelsPtr, const int numPixels, uint8_t * const rgbPtr) {
+  for (int i = 0; i < numPixels; i++) {
+    const uint32_t pixel = pixelsPtr[i];
+    uint8_t * const ptr = rgbPtr + (i * 3);
+    ptr[0] = pixel & 0xFF;
+    ptr[1] = (pixel >> 8) & 0xFF;
+    ptr[2] = (pixel >> 16) & 0xFF;
+  }
+}
+
+// Unpack 24 bit pixels into BGRA pixels with a zero alpha
+
+static inline
+void rgb24_unpack(const uint8_t * const rgbPtr, const int numPixels, uint32_t * const pixelsPtr) {
+  for (int i = 0; i < numPixels; i++) {
+    pixelsPtr[i] = rgb24_load(rgbPtr, i);
+  }
+}
+
+// CTIPredict2() for packed 24 bit pixels
+
+static inline
+int CTIPredict2_24(const uint8_t * const rgbPtr, int o1, int o2) {
+#if defined(DEBUG)
+  assert(o1 != o2);
+#endif // DEBUG
+  
+  uint32_t p1 = rgb24_load(rgbPtr, o1);
+  uint32_t p2 = rgb24_load(rgbPtr, o2);
+  
+  if (p1 == p2) {
+    return 0;
+  }
+  
+  uint32_t deltaPixel = pixel_component_delta(p1, p2, 3);
+  
+  return sum_of_abs_components(deltaPixel, 3);
+}
+
 // Predict with 3 neighbors
 
 static inline
@@ -661,6 +714,110 @@ int CTIGrayDelta(const uint8_t * const grayPtr, int o1, int o2) {
   return unDelta;
 }
 
+// 16 bit sample helpers. Up to 4 components of 16 bits each
+// are packed into a uint64_t word in the same (B G R A) order
+// as the components of an 8 bit pixel.
+
+static inline
+uint32_t pixel16_component(uint64_t pixel, const int comp) {
+  return (uint32_t) ((pixel >> (comp * 16)) & 0xFFFF);
+}
+
+// Component delta from one 16 bit pixel to another, each
+// component is stored as the unsigned value (c2 - c1) & 0xFFFF.
+
+static inline
+uint64_t pixel16_component_delta(uint64_t p1, uint64_t p2, const int numComp) {
+#if defined(DEBUG)
+  assert(numComp >= 1 && numComp <= 4);
+#endif // DEBUG
+  
+  uint64_t outPixel = 0;
+  
+  for ( int comp = 0; comp < numComp; comp++ ) {
+    uint32_t cp1 = pixel16_component(p1, comp);
+    uint32_t cp2 = pixel16_component(p2, comp);
+    
+    uint64_t cVal = (cp2 - cp1) & 0xFFFF;
+    outPixel |= (cVal << (comp * 16));
+  }
+  
+  return outPixel;
+}
+
+// Component sum from one 16 bit pixel to another.
+
+static inline
+uint64_t pixel16_component_sum(uint64_t p1, uint64_t p2, const int numComp) {
+#if defined(DEBUG)
+  assert(numComp >= 1 && numComp <= 4);
+#endif // DEBUG
+  
+  uint64_t outPixel = 0;
+  
+  for ( int comp = 0; comp < numComp; comp++ ) {
+    uint32_t cp1 = pixel16_component(p1, comp);
+    uint32_t cp2 = pixel16_component(p2, comp);
+    
+    uint64_t cVal = (cp2 + cp1) & 0xFFFF;
+    outPixel |= (cVal << (comp * 16));
+  }
+  
+  return outPixel;
+}
+
+// Predict 16 bit pixels with 2 neighbors. The delta is the sum
+// of the abs() of each component delta, so the result is in the
+// range (0, numComp * 65535).
+
+static inline
+int CTIPredict2_16(const uint64_t * const pixelsPtr, int o1, int o2, const int numComp) {
+#if defined(DEBUG)
+  assert(o1 != o2);
+#endif // DEBUG
+  
+  uint64_t p1 = pixelsPtr[o1];
+  uint64_t p2 = pixelsPtr[o2];
+  
+  if (p1 == p2) {
+    return 0;
+  }
+  
+  int sum = 0;
+  
+  for ( int comp = 0; comp < numComp; comp++ ) {
+    int cp1 = pixel16_component(p1, comp);
+    int cp2 = pixel16_component(p2, comp);
+    sum += abs(cp2 - cp1);
+  }
+  
+  return sum;
+}
+
+// Simple 16 bit grayscale delta of 2 values. The signed delta in
+// the range (-65535, 65535) is converted to the unsigned range
+// (0, 131070) in the same way as CTIGrayDelta.
+
+static inline
+int CTIGrayDelta16(const uint16_t * const grayPtr, int o1, int o2) {
+#if defined(DEBUG)
+  assert(o1 != o2);
+#endif // DEBUG
+  
+  int p1 = grayPtr[o1];
+  int p2 = grayPtr[o2];
+  
+  if (p1 == p2) {
+    return 0;
+  }
+  
+  int delta = (p2 - p1);
+  
+  uint32_t unDelta = convertSignedZeroDeltaToUnsigned(delta);
+  
+  return unDelta;
+}
+
 // Table prediciton with 2 values along same axis
 
 static inline
@@ -857,6 +1014,91 @@ int CTITablePredict(const uint8_t * const tableOffsetsPtr, const uint32_t * cons
   }
 }
 
+// Cost of a delta between two table offsets, the wrapped offset cost
+// is the cost CTITablePredict2() returns. The palette distance cost
+// is the sum of the abs() component deltas between the two colortable
+// pixels, alpha is included when any pixel in the table is not opaque.
+
+typedef enum {
+  CTI_TableCostWrappedOffset = 0,
+  CTI_TableCostPaletteDistance
+} CTI_TableCost;
+
+// Cost of every pair of table offsets for a table of at most 256
+// entries, built once per image so that the cost of a delta is a
+// single load. The cost from o1 to o2 is at (o1 << 8) | o2 and a
+// pair with an offset past the end of the table has a zero cost.
+
+class CTI_TableCostTable
+{
+public:
+  vector<uint16_t> costs;
+  int maxCost;
+  
+  CTI_TableCostTable()
+  : maxCost(0)
+  {
+  }
+  
+  void init(const uint32_t * const colortablePixelsPtr, const int N, const CTI_TableCost costMode) {
+#if defined(DEBUG)
+    assert(N > 0 && N <= 256);
+#endif // DEBUG
+    
+    costs.assign(256 * 256, 0);
+    maxCost = 0;
+    
+    int numComp = 3;
+    
+    if (costMode == CTI_TableCostPaletteDistance) {
+      for (int i = 0; i < N; i++) {
+        if ((colortablePixelsPtr[i] >> 24) != 0xFF) {
+          numComp = 4;
+          break;
+        }
+      }
+    }
+    
+    for (int o1 = 0; o1 < N; o1++) {
+      for (int o2 = 0; o2 < N; o2++) {
+        if (o1 == o2) {
+          continue;
+        }
+        
+        unsigned int cost;
+        
+        if (costMode == CTI_TableCostPaletteDistance) {
+          uint32_t deltaPixel = pixel_component_delta(colortablePixelsPtr[o1], colortablePixelsPtr[o2], numComp);
+          cost = sum_of_abs_components(deltaPixel, numComp);
+        } else {
+          cost = convertSignedZeroDeltaToUnsigned(convertToWrappedTableDelta(o1, o2, N));
+        }
+        
+        costs[(o1 << 8) | o2] = (uint16_t) cost;
+        
+        if ((int) cost > maxCost) {
+          maxCost = (int) cost;
+        }
+      }
+    }
+  }
+  
+  const uint16_t * data() const {
+    return costs.data();
+  }
+};
+
+// CTITablePredict2() with the cost read from a CTI_TableCostTable
+
+static inline
+int CTITablePredict2WithCosts(const uint8_t * const tableOffsetsPtr, const uint16_t * const costsPtr, int o1, int o2) {
+#if defined(DEBUG)
+  assert(o1 != o2);
+#endif // DEBUG
+  
+  return costsPtr[(((unsigned int) tableOffsetsPtr[o1]) << 8) | tableOffsetsPtr[o2]];
+}
+
 // Multiply by 341 using only addition
 
 static inline
@@ -1209,6 +1451,64 @@ uint32_t gradclamp_predict(uint32_t a, uint32_t b, uint32_t c) {
   return (uint32_t) clamped;
 }
 
+// gradclamp prediction for each of the 4 byte components of a pixel
+// given the left (a), up (b), and upLeft (c) neighbors.
+
+static inline
+uint32_t gradclamp8by4_predict(uint32_t leftSamples, uint32_t upSamples, uint32_t upLeftSamples) {
+  const bool debug = false;
+  
+  // Execute predictor for each of the 4 components
+  
+  uint32_t c3 = gradclamp_predict(
+                                  RSHIFT_MASK(leftSamples, 24, 0xFF),
+                                  RSHIFT_MASK(upSamples, 24, 0xFF),
+                                  RSHIFT_MASK(upLeftSamples, 24, 0xFF)
+                                  );
+  
+  uint32_t c2 = gradclamp_predict(
+                                  RSHIFT_MASK(leftSamples, 16, 0xFF),
+                                  RSHIFT_MASK(upSamples, 16, 0xFF),
+                                  RSHIFT_MASK(upLeftSamples, 16, 0xFF)
+                                  );
+  
+  uint32_t c1 = gradclamp_predict(
+                                  RSHIFT_MASK(leftSamples, 8, 0xFF),
+                                  RSHIFT_MASK(upSamples, 8, 0xFF),
+                                  RSHIFT_MASK(upLeftSamples, 8, 0xFF)
+                                  );
+  uint32_t c0 = gradclamp_predict(
+                                  RSHIFT_MASK(leftSamples, 0, 0xFF),
+                                  RSHIFT_MASK(upSamples, 0, 0xFF),
+                                  RSHIFT_MASK(upLeftSamples, 0, 0xFF)
+                                  );
+  
+  if (debug) {
+    printf("c3=%d, c2=%d, c1=%d, c0=%d\n", c3, c2, c1, c0);
+  }
+  
+  // It should not be possible for values larger than a byte range
+  // to be returned, since gradclamp_predict() returns one of the 3 passed
+  // in values and they are all masked to 0xFF.
+  
+#if defined(DEBUG)
+  assert(c3 <= 0xFF);
+  assert(c2 <= 0xFF);
+  assert(c1 <= 0xFF);
+  assert(c0 <= 0xFF);
+#endif // DEBUG
+  
+  // Mask to 8bit value and shift into component position
+  
+  uint32_t components =
+  MASK_LSHIFT(c3, 0xFF, 24) |
+  MASK_LSHIFT(c2, 0xFF, 16) |
+  MASK_LSHIFT(c1, 0xFF, 8) |
+  MASK_LSHIFT(c0, 0xFF, 0);
+  
+  return components;
+}
+
 // This gradclamp predictor logic operates in terms of bytes
 // and not whole pixels. But for the sake of efficient code,
 // the logic executes in terms of blocks of 4 byte elements at
@@ -1264,53 +1564,29 @@ uint32_t gradclamp8by4(uint32_t *samplesPtr, uint32_t width, uint32_t offset) {
     upLeftSamples = samplesPtr[upLeftOffset];
   }
   
-  // Execute predictor for each of the 4 components
-  
-  uint32_t c3 = gradclamp_predict(
-                                  RSHIFT_MASK(leftSamples, 24, 0xFF),
-                                  RSHIFT_MASK(upSamples, 24, 0xFF),
-                                  RSHIFT_MASK(upLeftSamples, 24, 0xFF)
-                                  );
-  
-  uint32_t c2 = gradclamp_predict(
-                                  RSHIFT_MASK(leftSamples, 16, 0xFF),
-                                  RSHIFT_MASK(upSamples, 16, 0xFF),
-                                  RSHIFT_MASK(upLeftSamples, 16, 0xFF)
-                                  );
-  
-  uint32_t c1 = gradclamp_predict(
-                                  RSHIFT_MASK(leftSamples, 8, 0xFF),
-                                  RSHIFT_MASK(upSamples, 8, 0xFF),
-                                  RSHIFT_MASK(upLeftSamples, 8, 0xFF)
-                                  );
-  uint32_t c0 = gradclamp_predict(
-                                  RSHIFT_MASK(leftSamples, 0, 0xFF),
-                                  RSHIFT_MASK(upSamples, 0, 0xFF),
-                                  RSHIFT_MASK(upLeftSamples, 0, 0xFF)
-                                  );
-  
-  if (debug) {
-    printf("c3=%d, c2=%d, c1=%d, c0=%d\n", c3, c2, c1, c0);
-  }
-  
-  // It should not be possible for values larger than a byte range
-  // to be returned, since gradclamp_predict() returns one of the 3 passed
-  // in values and they are all masked to 0xFF.
-  
+  return gradclamp8by4_predict(leftSamples, upSamples, upLeftSamples);
+}
+
+// gradclamp prediction for each 16 bit component of a pixel
+// given the left (a), up (b), and upLeft (c) neighbors.
+
+static inline
+uint64_t gradclamp16(uint64_t leftSamples, uint64_t upSamples, uint64_t upLeftSamples, const int numComp) {
+  uint64_t components = 0;
+  
+  for ( int comp = 0; comp < numComp; comp++ ) {
+    uint64_t c = gradclamp_predict(
+                                   pixel16_component(leftSamples, comp),
+                                   pixel16_component(upSamples, comp),
+                                   pixel16_component(upLeftSamples, comp)
+                                   );
+    
 #if defined(DEBUG)
-  assert(c3 <= 0xFF);
-  assert(c2 <= 0xFF);
-  assert(c1 <= 0xFF);
-  assert(c0 <= 0xFF);
+    assert(c <= 0xFFFF);
 #endif // DEBUG
-  
-  // Mask to 8bit value and shift into component position
-  
-  uint32_t components =
-  MASK_LSHIFT(c3, 0xFF, 24) |
-  MASK_LSHIFT(c2, 0xFF, 16) |
-  MASK_LSHIFT(c1, 0xFF, 8) |
-  MASK_LSHIFT(c0, 0xFF, 0);
+    
+    components |= (c << (comp * 16));
+  }
   
   return components;
 }
@@ -1384,3 +1660,128 @@ void gradclamp8by4_encode_pred_error(uint32_t *inSamplesPtr,
   
   return;
 }
+
+// Add a prediction and a prediction error for each of the 4 byte
+// components of a pixel, each component wraps as an unsigned 8 bit
+// value so that this is the inverse of gradclamp8_encode_predict_error().
+
+static inline
+uint32_t gradclamp8by4_add_pred_error(uint32_t pred, uint32_t predErr) {
+  uint32_t sum = (pred & 0x7F7F7F7F) + (predErr & 0x7F7F7F7F);
+  return sum ^ ((pred ^ predErr) & 0x80808080);
+}
+
+// Inverse of gradclamp8by4_encode_pred_error(), each sample is reconstructed
+// from the prediction error and the samples already decoded. Note that the
+// left neighbor of the first pixel in a row is the last pixel of the previous
+// row, so each row depends on the whole previous row and this logic is serial.
+
+static inline
+void gradclamp8by4_decode_pred_error(const uint32_t *inPredErrPtr,
+                                     uint32_t *outSamplesPtr,
+                                     uint32_t startSampleIndex,
+                                     uint32_t endSampleIndex,
+                                     uint32_t width)
+{
+  for (uint32_t i = startSampleIndex; i < endSampleIndex; i++) {
+    uint32_t pred = gradclamp8by4(outSamplesPtr, width, i);
+    outSamplesPtr[i] = gradclamp8by4_add_pred_error(pred, inPredErrPtr[i]);
+  }
+  
+  return;
+}
+
+// gradclamp prediction where only the current row and the row above are
+// referenced. The first pixel predicts zero, the rest of the first row
+// predicts from the left, and the first column predicts from up. Since no
+// prediction wraps around to the previous row, a pixel depends only on the
+// pixels to the left and the pixels above up to the same column. Pass
+// nullptr as upRowPtr for the first row.
+
+static inline
+uint32_t gradclamp8by4_row_predict(const uint32_t * const rowPtr,
+                                   const uint32_t * const upRowPtr,
+                                   const int x)
+{
+  if (upRowPtr == nullptr) {
+    return (x == 0) ? 0 : rowPtr[x-1];
+  } else if (x == 0) {
+    return upRowPtr[0];
+  } else {
+    return gradclamp8by4_predict(rowPtr[x-1], upRowPtr[x], upRowPtr[x-1]);
+  }
+}
+
+// Encode gradclamp prediction error for rows in the range (startRow, endRow)
+// with the row local edge handling of gradclamp8by4_row_predict().
+
+static inline
+void gradclamp8by4_encode_pred_error_rows(const uint32_t *inSamplesPtr,
+                                          uint32_t *outPredErrPtr,
+                                          int width,
+                                          int startRow,
+                                          int endRow)
+{
+  for (int row = startRow; row < endRow; row++) {
+    const uint32_t * const rowPtr = &inSamplesPtr[row * width];
+    const uint32_t * const upRowPtr = (row == 0) ? nullptr : (rowPtr - width);
+    uint32_t * const outRowPtr = &outPredErrPtr[row * width];
+    
+    for (int x = 0; x < width; x++) {
+      uint32_t pred = gradclamp8by4_row_predict(rowPtr, upRowPtr, x);
+      uint32_t inSamples = rowPtr[x];
+      
+      uint32_t outPredErr = 0;
+      
+      for (int comp = 0; comp < 4; comp++) {
+        const int shift = comp * 8;
+        uint32_t predErr = gradclamp8_encode_predict_error(RSHIFT_MASK(pred, shift, 0xFF), RSHIFT_MASK(inSamples, shift, 0xFF));
+        outPredErr |= (predErr << shift);
+      }
+      
+      outRowPtr[x] = outPredErr;
+    }
+  }
+  
+  return;
+}
+
+// Decode the pixels (startX, endX) in one row that was encoded with
+// gradclamp8by4_encode_pred_error_rows(). The pixels to the left of
+// startX in this row and the pixels up to endX-1 in the row above
+// must already be decoded.
+
+static inline
+void gradclamp8by4_decode_pred_error_row(const uint32_t *inPredErrPtr,
+                                         uint32_t *outSamplesPtr,
+                                         int width,
+                                         int row,
+                                         int startX,
+                                         int endX)
+{
+  uint32_t * const rowPtr = &outSamplesPtr[row * width];
+  const uint32_t * const upRowPtr = (row == 0) ? nullptr : (rowPtr - width);
+  const uint32_t * const predErrRowPtr = &inPredErrPtr[row * width];
+  
+  for (int x = startX; x < endX; x++) {
+    uint32_t pred = gradclamp8by4_row_predict(rowPtr, upRowPtr, x);
+    rowPtr[x] = gradclamp8by4_add_pred_error(pred, predErrRowPtr[x]);
+  }
+  
+  return;
+}
+
+// Serial decode of all the rows encoded with gradclamp8by4_encode_pred_error_rows()
+
+static inline
+void gradclamp8by4_decode_pred_error_rows(const uint32_t *inPredErrPtr,
+                                          uint32_t *outSamplesPtr,
+                                          int width,
+                                          int height)
+{
+  for (int row = 0; row < height; row++) {
+    gradclamp8by4_decode_pred_error_row(inPredErrPtr, outSamplesPtr, width, row, 0, width);
+  }
+  
+  return;
+}
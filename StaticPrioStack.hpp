@@ -78,9 +78,10 @@ public:
   {
   }
 
-  // Allocate structures to handle from (0, N-1) prio values
+  // Allocate structures to handle from (0, N-1) prio values,
+  // each prio vector reserves elemInitSize elements.
   
-  void allocateN(int N) {
+  void allocateN(int N, int elemInitSize = ElemInitSize) {
     elemTable.clear();
     elemTable.reserve(N);
     
@@ -91,7 +92,7 @@ public:
     
     for ( int prio = 0; prio < N; prio++ ) {
       vector<T> vec;
-      vec.reserve(ElemInitSize);
+      vec.reserve(elemInitSize);
       elemTable.push_back(std::move(vec));
       
       nodeTable.push_back(std::move(StaticPrioStackStdNode()));
@@ -415,6 +416,19 @@ public:
     return;
   }
   
+  // Return the next prio after the indicated prio that contains at
+  // least 1 element, -1 indicates the end of the list.
+  
+  int32_t nextPrio(int prio) {
+    return nodeTable[prio].next;
+  }
+  
+  // Access the elements stored for a specific prio
+  
+  vector<T> & elemsAt(int prio) {
+    return elemTable[prio];
+  }
+  
   // Get the first element (the one with the smallest prio) as an O(1) op.
   
   T first(int * prioPtr) {
@@ -482,3 +496,268 @@ public:
   
 };
 
+
+// The sparse priority stack provides the same FILO per prio semantics
+// as StaticPrioStack, but memory use does not scale with the number of
+// prio levels. This is required for 16 bit samples where a sum of 3
+// component deltas can be as large as (3 * 65535). A bitmap with 1 bit
+// per prio level is used to locate the smallest prio and each prio
+// that contains elements is mapped to a slot in a pool of vectors.
+// Slot offsets are stored in pages that are only allocated when a
+// prio in the range of the page is first used.
+
+#define SparsePrioStackPageSize 1024
+#define SparsePrioStackElemInitSize 64
+
+template <class T>
+class SparsePrioStack {
+public:
+  
+  // One bit for each prio level that contains at least 1 element,
+  // a summary bit is set for each non-zero word in levelBits.
+  
+  vector<uint64_t> levelBits;
+  vector<uint64_t> summaryBits;
+  
+  // Each page maps SparsePrioStackPageSize prio values to a slot
+  // offset, -1 indicates no slot for a prio.
+  
+  vector<vector<int32_t> > slotPages;
+  
+  // Pool of elem vectors, an unused slot is kept on the free list
+  // so that the vector memory is reused.
+  
+  vector<vector<T> > slotElems;
+  vector<int32_t> freeSlots;
+  
+  // Smallest prio that contains an element, -1 when empty
+  
+  int32_t headPrio;
+  
+  int numPrio;
+  
+  // Number of elements reserved when a slot vector is created
+  
+  int slotInitSize;
+  
+  // Empty constructor
+  
+  SparsePrioStack()
+  : headPrio(-1), numPrio(0), slotInitSize(SparsePrioStackElemInitSize)
+  {
+  }
+  
+  // Allocate structures to handle from (0, N-1) prio values
+  
+  void allocateN(int N, int elemInitSize = SparsePrioStackElemInitSize) {
+    numPrio = N;
+    slotInitSize = (elemInitSize < SparsePrioStackElemInitSize) ? elemInitSize : SparsePrioStackElemInitSize;
+    
+    int numWords = (N + 63) / 64;
+    int numSummaryWords = (numWords + 63) / 64;
+    int numPages = (N + SparsePrioStackPageSize - 1) / SparsePrioStackPageSize;
+    
+    levelBits = vector<uint64_t>(numWords);
+    summaryBits = vector<uint64_t>(numSummaryWords);
+    
+    slotPages.clear();
+    slotPages.resize(numPages);
+    
+    slotElems.clear();
+    freeSlots.clear();
+    
+    headPrio = -1;
+  }
+  
+  bool isEmpty() {
+    return (headPrio == -1);
+  }
+  
+  int32_t head() {
+    return headPrio;
+  }
+  
+  // Clear all entries from prio stacks, slot memory is retained
+  
+  void clear() {
+    for ( int prio = headPrio; prio != -1; ) {
+      int next = nextPrio(prio);
+      clearPrioSlot(prio);
+      prio = next;
+    }
+    
+    headPrio = -1;
+  }
+  
+  // Return the next prio after the indicated prio that contains at
+  // least 1 element, -1 indicates the end of the list.
+  
+  int32_t nextPrio(int prio) {
+    int wordOffset = (prio + 1) >> 6;
+    int bitOffset = (prio + 1) & 63;
+    
+    const int numWords = (int) levelBits.size();
+    
+    if (wordOffset >= numWords) {
+      return -1;
+    }
+    
+    // Check the remaining bits in the current word
+    
+    if (bitOffset != 0) {
+      uint64_t bits = levelBits[wordOffset] & (~((uint64_t)0) << bitOffset);
+      
+      if (bits != 0) {
+        return (wordOffset << 6) + __builtin_ctzll(bits);
+      }
+      
+      wordOffset += 1;
+    }
+    
+    // Search summary bits for the next non-zero word
+    
+    const int numSummaryWords = (int) summaryBits.size();
+    
+    int summaryOffset = wordOffset >> 6;
+    int summaryBitOffset = wordOffset & 63;
+    
+    for ( ; summaryOffset < numSummaryWords; summaryOffset++ ) {
+      uint64_t bits = summaryBits[summaryOffset];
+      
+      if (summaryBitOffset != 0) {
+        bits &= (~((uint64_t)0) << summaryBitOffset);
+        summaryBitOffset = 0;
+      }
+      
+      if (bits != 0) {
+        int word = (summaryOffset << 6) + __builtin_ctzll(bits);
+        
+#if defined(DEBUG)
+        assert(levelBits[word] != 0);
+#endif // DEBUG
+        
+        return (word << 6) + __builtin_ctzll(levelBits[word]);
+      }
+    }
+    
+    return -1;
+  }
+  
+  // Access the elements stored for a specific prio, the prio must
+  // contain at least 1 element.
+  
+  vector<T> & elemsAt(int prio) {
+    int32_t slot = slotPages[prio / SparsePrioStackPageSize][prio % SparsePrioStackPageSize];
+#if defined(DEBUG)
+    assert(slot != -1);
+#endif // DEBUG
+    return slotElems[slot];
+  }
+  
+  // FILO push to front of list for a specific prio
+  
+  void push(const T & elem, unsigned int prio) {
+#if defined(DEBUG)
+    assert(prio < numPrio);
+#endif // DEBUG
+    
+    vector<int32_t> & page = slotPages[prio / SparsePrioStackPageSize];
+    
+    if (page.size() == 0) {
+      page.resize(SparsePrioStackPageSize, -1);
+    }
+    
+    int32_t & slot = page[prio % SparsePrioStackPageSize];
+    
+    if (slot == -1) {
+      // Prio goes from 0 to 1 elements, map to a slot and set bits
+      
+      if (freeSlots.size() > 0) {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+      } else {
+        slot = (int32_t) slotElems.size();
+        vector<T> vec;
+        vec.reserve(slotInitSize);
+        slotElems.push_back(std::move(vec));
+      }
+      
+      int word = prio >> 6;
+      levelBits[word] |= ((uint64_t)1 << (prio & 63));
+      summaryBits[word >> 6] |= ((uint64_t)1 << (word & 63));
+      
+      if (headPrio == -1 || (int)prio < headPrio) {
+        headPrio = prio;
+      }
+    }
+    
+    slotElems[slot].push_back(elem);
+  }
+  
+  // Get the first element (the one with the smallest prio)
+  
+  T first(int * prioPtr) {
+    if (isEmpty()) {
+      *prioPtr = -1;
+      // Note that a default empty constructor must be defined for T here
+      return T();
+    }
+    
+    int prio = headPrio;
+    *prioPtr = prio;
+    
+    vector<T> & elemVec = elemsAt(prio);
+    
+#if defined(DEBUG)
+    assert(elemVec.size() >= 1);
+#endif // DEBUG
+    
+    T elem = elemVec.back();
+    elemVec.pop_back();
+    
+    if (elemVec.size() == 0) {
+      headPrio = nextPrio(prio);
+      clearPrioSlot(prio);
+    }
+    
+    return elem;
+  }
+  
+  // Release the slot for a prio and clear the bits for the prio
+  
+  void clearPrioSlot(int prio) {
+    int32_t & slot = slotPages[prio / SparsePrioStackPageSize][prio % SparsePrioStackPageSize];
+    
+#if defined(DEBUG)
+    assert(slot != -1);
+#endif // DEBUG
+    
+    slotElems[slot].clear();
+    freeSlots.push_back(slot);
+    slot = -1;
+    
+    int word = prio >> 6;
+    levelBits[word] &= ~((uint64_t)1 << (prio & 63));
+    
+    if (levelBits[word] == 0) {
+      summaryBits[word >> 6] &= ~((uint64_t)1 << (word & 63));
+    }
+  }
+  
+  // Debug output of each elem
+  
+  string toString() {
+    stringstream s;
+    
+    for ( int prio = headPrio; prio != -1; prio = nextPrio(prio) ) {
+      s << "[" << prio << "] " << endl;
+      for ( T & elem : elemsAt(prio) ) {
+        s << elem;
+      }
+      s << endl;
+    }
+    
+    return s.str();
+  }
+  
+};
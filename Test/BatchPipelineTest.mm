@@ -0,0 +1,112 @@
+//
+//  BatchPipelineTest.mm
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Tests for the batch pipeline stages and the bounded queue.
+
+#import <XCTest/XCTest.h>
+
+#import "BatchPipeline.hpp"
+
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+@interface BatchPipelineTest : XCTestCase
+
+@end
+
+@implementation BatchPipelineTest
+
+- (void)setUp {
+    [super setUp];
+    // Put setup code here. This method is called before the invocation of each test method in the class.
+}
+
+- (void)tearDown {
+    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    [super tearDown];
+}
+
+// Each item passes through the 3 pipeline stages in order and a stage
+// never gets more than the queue size ahead of the next stage.
+
+- (void) testBatchPipelineOrder {
+  const int numItems = 23;
+  const int queueSize = 2;
+  
+  typedef struct {
+    int index;
+    int value;
+  } Item;
+  
+  vector<int> readOrder;
+  vector<int> encodeOrder;
+  vector<int> writeOrder;
+  vector<int> values;
+  
+  atomic<int> numRead(0);
+  atomic<int> numWritten(0);
+  atomic<int> maxAhead(0);
+  
+  auto readL = [&](int i, Item & item) {
+    item.index = i;
+    item.value = i * 3;
+    readOrder.push_back(i);
+    int ahead = (numRead += 1) - numWritten.load();
+    int prevAhead = maxAhead.load();
+    while (ahead > prevAhead && !maxAhead.compare_exchange_weak(prevAhead, ahead)) {
+    }
+  };
+  
+  auto encodeL = [&](int i, Item & item) {
+    XCTAssert(item.index == i);
+    item.value += 1;
+    encodeOrder.push_back(i);
+  };
+  
+  auto writeL = [&](int i, Item & item) {
+    XCTAssert(item.index == i);
+    values.push_back(item.value);
+    writeOrder.push_back(i);
+    numWritten += 1;
+  };
+  
+  PipelineStageStats stats[3];
+  
+  double wallSeconds = batch_pipeline_run<Item>(numItems, readL, encodeL, writeL, stats, queueSize);
+  
+  XCTAssert(wallSeconds >= 0.0);
+  
+  for ( int i = 0; i < numItems; i++ ) {
+    XCTAssert(readOrder[i] == i);
+    XCTAssert(encodeOrder[i] == i);
+    XCTAssert(writeOrder[i] == i);
+    XCTAssert(values[i] == ((i * 3) + 1));
+  }
+  
+  for ( int stage = 0; stage < 3; stage++ ) {
+    XCTAssert(stats[stage].numItems == numItems);
+  }
+  
+  // Read queue, write queue, one item in each stage
+  
+  XCTAssert(maxAhead.load() <= ((2 * queueSize) + 3));
+  
+  BoundedQueue<int> queue(3);
+  queue.push(1);
+  queue.push(2);
+  queue.close();
+  
+  int v = 0;
+  XCTAssert(queue.pop(v) && v == 1);
+  XCTAssert(queue.pop(v) && v == 2);
+  XCTAssert(queue.pop(v) == false);
+  XCTAssert(queue.maxSize() == 2);
+}
+
+@end
@@ -1200,5 +1200,34 @@ format2DVec(vector<T> & vec, int width, int height)
   XCTAssert(cacheMat == expectedMat);
 }
 
+- (void) testFrameAllocLargeCache {
+  // A 4K frame is larger than a huge page, the values must still
+  // be initialized when the buffer is advised before the writes.
+  
+  const int width = 3840;
+  const int height = 2160;
+  
+  Cache2D<int16_t, true> cache;
+  
+  cache.allocValues(width, height, -1);
+  
+  XCTAssert(cache.values.size() == (width * height));
+  XCTAssert(cache.values[0] == -1);
+  XCTAssert(cache.values[(width * height) - 1] == -1);
+  
+  const size_t numBytes = width * height * sizeof(uint32_t);
+  
+  uint32_t *pixels = (uint32_t *) frame_calloc(width * height, sizeof(uint32_t));
+  
+  XCTAssert(pixels != NULL);
+  XCTAssert((((uintptr_t) pixels) % FRAME_ALLOC_HUGE_PAGE_SIZE) == 0);
+  XCTAssert(pixels[0] == 0);
+  XCTAssert(pixels[(width * height) - 1] == 0);
+  
+  pixels[(numBytes / sizeof(uint32_t)) - 1] = 1;
+  
+  free(pixels);
+}
+
 @end
 
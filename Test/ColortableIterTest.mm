@@ -11,6 +11,10 @@
 
 #import "ColortableIter.hpp"
 
+#import "ParallelEncode.hpp"
+
+#import "TestPixels.hpp"
+
 #import <set>
 #include <string>
 #include <sstream>
@@ -3102,5 +3106,984 @@ void CTI_IteratePixelsInTable(
   return;
 }
 
+// 4x4 RGBA input where RGB is constant and only alpha changes,
+// the 4 component engine must emit alpha deltas that the 3
+// component engine would ignore.
+
+- (void) test4x4RGBAAlphaOnly {
+  
+  uint32_t pixelsPtr[] = {
+    0xFF3AA3ED, 0xFF3AA3ED, 0x803AA3ED, 0x003AA3ED,
+    0xFF3AA3ED, 0xFF3AA3ED, 0x803AA3ED, 0x003AA3ED,
+    0xFF3AA3ED, 0xFF3AA3ED, 0x803AA3ED, 0x003AA3ED,
+    0xFF3AA3ED, 0xFF3AA3ED, 0x803AA3ED, 0x003AA3ED
+  };
+  
+  int width = 4;
+  int height = 4;
+  
+  vector<uint32_t> iterOrder;
+  
+  uint32_t deltas[16];
+  
+  CTI_IterateRGBA(pixelsPtr,
+                  width, height,
+                  iterOrder,
+                  deltas);
+  
+  XCTAssert(iterOrder.size() == 16);
+  
+  int numAlphaDeltas = 0;
+  
+  for ( int i = 0; i < 16; i++ ) {
+    if (i == 0 || i == 1 || i == width || i == width+1) {
+      // Upper left pixels are emitted as-is
+      XCTAssert(deltas[i] == pixelsPtr[i]);
+      continue;
+    }
+    
+    uint32_t delta = deltas[i];
+    
+    XCTAssert((delta & 0x00FFFFFF) == 0);
+    
+    if ((delta >> 24) != 0) {
+      numAlphaDeltas += 1;
+    }
+  }
+  
+  XCTAssert(numAlphaDeltas > 0);
+  
+  return;
+}
+
+// The sparse prio stack must return elements in exactly the same
+// order as the static prio stack for the same push and pop calls.
+
+- (void) testSparsePrioStackMatchesStatic {
+  const int N = 766;
+  
+  StaticPrioStack<CoordDelta> staticStack;
+  SparsePrioStack<CoordDelta> sparseStack;
+  
+  staticStack.allocateN(N);
+  sparseStack.allocateN(N);
+  
+  srand(1);
+  
+  for ( int i = 0; i < 5000; i++ ) {
+    if ((rand() % 3) != 0) {
+      int prio = rand() % N;
+      CoordDelta cd(i % 100, i / 100, (i % 100) + 1, i / 100, true);
+      staticStack.push(cd, prio);
+      sparseStack.push(cd, prio);
+    } else {
+      int staticPrio, sparsePrio;
+      CoordDelta cd1 = staticStack.first(&staticPrio);
+      CoordDelta cd2 = sparseStack.first(&sparsePrio);
+      XCTAssert(staticPrio == sparsePrio);
+      XCTAssert(cd1.toX() == cd2.toX() && cd1.toY() == cd2.toY());
+    }
+    
+    XCTAssert(staticStack.head() == sparseStack.head());
+  }
+  
+  while (staticStack.isEmpty() == false) {
+    int staticPrio, sparsePrio;
+    CoordDelta cd1 = staticStack.first(&staticPrio);
+    CoordDelta cd2 = sparseStack.first(&sparsePrio);
+    XCTAssert(staticPrio == sparsePrio);
+    XCTAssert(cd1.toX() == cd2.toX() && cd1.toY() == cd2.toY());
+  }
+  
+  XCTAssert(sparseStack.isEmpty());
+}
+
+// The sparse prio stack supports the full (3 * 65535) prio range
+
+- (void) testSparsePrioStackLargePrio {
+  const int N = (65535*3)+1;
+  
+  SparsePrioStack<CoordDelta> sparseStack;
+  sparseStack.allocateN(N);
+  
+  sparseStack.push(CoordDelta(0, 0, 1, 0, true), N-1);
+  sparseStack.push(CoordDelta(0, 1, 1, 1, true), 70000);
+  sparseStack.push(CoordDelta(0, 2, 1, 2, true), 3);
+  
+  XCTAssert(sparseStack.head() == 3);
+  XCTAssert(sparseStack.nextPrio(3) == 70000);
+  XCTAssert(sparseStack.nextPrio(70000) == N-1);
+  XCTAssert(sparseStack.nextPrio(N-1) == -1);
+  
+  int prio;
+  CoordDelta cd;
+  
+  cd = sparseStack.first(&prio);
+  XCTAssert(prio == 3 && cd.toY() == 2);
+  cd = sparseStack.first(&prio);
+  XCTAssert(prio == 70000 && cd.toY() == 1);
+  cd = sparseStack.first(&prio);
+  XCTAssert(prio == N-1 && cd.toY() == 0);
+  cd = sparseStack.first(&prio);
+  XCTAssert(prio == -1 && cd.isEmpty());
+}
+
+// 16 bit grayscale iteration where the deltas are much larger than 8 bits
+
+- (void) test4x4Gray16 {
+  uint16_t samples[] = {
+    1000, 1000, 60000, 60000,
+    1000, 1000, 60000, 60000,
+    1000, 1000, 60000, 60000,
+    1000, 1000, 60000, 60000
+  };
+  
+  int width = 4;
+  int height = 4;
+  
+  vector<uint32_t> iterOrder;
+  uint64_t deltas[16];
+  
+  CTI_IterateGray16(samples, width, height, iterOrder, deltas);
+  
+  XCTAssert(iterOrder.size() == 16);
+  
+  set<uint32_t> seen(iterOrder.begin(), iterOrder.end());
+  XCTAssert(seen.size() == 16);
+  
+  // Upper left pixels are emitted as-is
+  
+  XCTAssert(deltas[0] == 1000);
+  XCTAssert(deltas[1] == 1000);
+  XCTAssert(deltas[4] == 1000);
+  XCTAssert(deltas[5] == 1000);
+  
+  // Every pixel in the left 2 columns is predicted exactly
+  
+  for ( int row = 2; row < height; row++ ) {
+    XCTAssert(deltas[(row * width) + 0] == 0);
+    XCTAssert(deltas[(row * width) + 1] == 0);
+  }
+  
+  // Each residual is a 16 bit value
+  
+  for ( int i = 0; i < 16; i++ ) {
+    XCTAssert(deltas[i] <= 0xFFFF);
+  }
+}
+
+// 16 bit RGB iteration
+
+- (void) test4x4RGB48 {
+  const uint64_t c1 = (((uint64_t)50000) << 32) | (((uint64_t)1234) << 16) | 65535;
+  const uint64_t c2 = (((uint64_t)10) << 32) | (((uint64_t)40000) << 16) | 0;
+  
+  uint64_t pixels[] = {
+    c1, c1, c1, c1,
+    c1, c1, c1, c1,
+    c2, c2, c2, c2,
+    c2, c2, c2, c2
+  };
+  
+  int width = 4;
+  int height = 4;
+  
+  vector<uint32_t> iterOrder;
+  uint64_t deltas[16];
+  
+  CTI_IterateRGB48(pixels, width, height, iterOrder, deltas);
+  
+  XCTAssert(iterOrder.size() == 16);
+  
+  // The top 2 rows are all c1 so each is predicted exactly
+  
+  XCTAssert(deltas[2] == 0);
+  XCTAssert(deltas[3] == 0);
+  XCTAssert(deltas[6] == 0);
+  XCTAssert(deltas[7] == 0);
+  
+  // The bottom rows must contain at least one non-zero residual and
+  // no residual can set bits outside the 48 bit RGB range.
+  
+  int numNonZero = 0;
+  
+  for ( int i = 8; i < 16; i++ ) {
+    if (deltas[i] != 0) {
+      numNonZero += 1;
+    }
+    XCTAssert((deltas[i] >> 48) == 0);
+  }
+  
+  XCTAssert(numNonZero > 0);
+}
+
+// A flat tile is encoded with raster MED while a noisy tile takes the
+// adaptive path, iterOrder must visit each pixel exactly once.
+
+- (void) test8x4TilesFlatAndNoisy {
+  const int width = 8;
+  const int height = 4;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 1, 0x00FFFFFF);
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < 4; x++ ) {
+      pixels[(y * width) + x] = 0x00102030;
+    }
+  }
+  
+  vector<uint32_t> iterOrder;
+  vector<uint8_t> tileModes;
+  uint32_t deltas[width * height];
+  
+  CTI_IterateRGBTiles(pixels.data(), width, height, 4, iterOrder, deltas, tileModes);
+  
+  XCTAssert(tileModes.size() == 2);
+  XCTAssert(tileModes[0] == CTI_TileModeRasterMED);
+  XCTAssert(tileModes[1] == CTI_TileModeAdaptive);
+  
+  XCTAssert(iterOrder.size() == (width * height));
+  set<uint32_t> seen(iterOrder.begin(), iterOrder.end());
+  XCTAssert(seen.size() == (width * height));
+  
+  // Flat tile : raster order, first pixel emitted as a delta from zero
+  
+  XCTAssert(iterOrder[0] == 0);
+  XCTAssert(iterOrder[1] == 1);
+  XCTAssert(iterOrder[4] == 8);
+  XCTAssert(deltas[0] == 0x00102030);
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < 4; x++ ) {
+      if (x == 0 && y == 0) {
+        continue;
+      }
+      XCTAssert(deltas[(y * width) + x] == 0);
+    }
+  }
+  
+  // Adaptive tile : upper left pixel of the tile is emitted directly
+  
+  XCTAssert(iterOrder[16] == 4);
+  XCTAssert(deltas[4] == pixels[4]);
+}
+
+// The neighbor average predictor can be swapped in for the adaptive one,
+// the iteration order depends only on the cost function.
+
+- (void) test4x4RGBNeighborAvePredictor {
+  uint32_t pixels[] = {
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF,
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF,
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF,
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF
+  };
+  
+  vector<uint32_t> iterOrder1;
+  vector<uint32_t> iterOrder2;
+  uint32_t deltas1[16];
+  uint32_t deltas2[16];
+  
+  CTI_IterateRGB(pixels, 4, 4, iterOrder1, deltas1);
+  CTI_IterateRGBWithPredictor<CTI_NeighborAvePredictor>(pixels, 4, 4, iterOrder2, deltas2);
+  
+  XCTAssert(iterOrder1 == iterOrder2);
+  
+  // The left 2 columns are predicted exactly by either predictor
+  
+  XCTAssert(deltas2[8] == 0);
+  XCTAssert(deltas2[12] == 0);
+}
+
+- (void) test4x4RGBEntropySink {
+  uint32_t pixels[] = {
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF,
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF,
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF,
+    0x00000000, 0x00000000, 0x00FFFFFF, 0x00FFFFFF
+  };
+  
+  vector<uint32_t> iterOrder1;
+  vector<uint32_t> iterOrder2;
+  uint32_t deltas1[16];
+  uint32_t deltas2[16];
+  
+  CTI_IterateRGB(pixels, 4, 4, iterOrder1, deltas1);
+  
+  // The entropy sink forwards residuals to the inner deltas sink
+  
+  typedef CTI_EntropyResidualSink<uint32_t, 3, CTI_DeltasResidualSink<uint32_t> > EntropySink;
+  
+  CTI_DeltasResidualSink<uint32_t> deltasSink(deltas2);
+  CTI_IterOrderSink<EntropySink> orderSink(iterOrder2, EntropySink(deltasSink));
+  
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(pixels, 4, 4, orderSink);
+  
+  EntropySink & sink = orderSink.innerSink;
+  
+  XCTAssert(iterOrder1 == iterOrder2);
+  XCTAssert(memcmp(deltas1, deltas2, sizeof(deltas1)) == 0);
+  
+  XCTAssert(sink.numRaw == 4);
+  XCTAssert(sink.numResiduals == 12);
+  XCTAssert(sink.numPixels() == 16);
+  
+  // Each component has the same residuals
+  
+  double bits0 = sink.order0ComponentBits(0);
+  XCTAssert(bits0 == sink.order0ComponentBits(1));
+  XCTAssert(bits0 == sink.order0ComponentBits(2));
+  
+  // A context model can not cost more than order 0
+  
+  XCTAssert(sink.contextBits() <= sink.order0Bits() + 0.0001);
+  XCTAssert(sink.order0BitsPerPixel() >= (4 * 24) / 16.0);
+}
+
+// A sink that only writes residuals needs no iteration order buffer,
+// and an order sink without residuals matches a nullptr deltas buffer.
+
+- (void) testSinkWithoutIterOrder {
+  const int width = 9;
+  const int height = 7;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 3, 0x003F3F3F);
+  
+  vector<uint32_t> iterOrder1;
+  vector<uint32_t> iterOrder2;
+  vector<uint32_t> deltas1(width * height);
+  vector<uint32_t> deltas2(width * height);
+  
+  CTI_IterateRGB(pixels.data(), width, height, iterOrder1, deltas1.data());
+  
+  CTI_DeltasResidualSink<uint32_t> sink(deltas2.data());
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(pixels.data(), width, height, sink);
+  
+  XCTAssert(deltas1 == deltas2);
+  
+  CTI_IterOrderSink<> orderSink(iterOrder2);
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(pixels.data(), width, height, orderSink);
+  
+  XCTAssert(iterOrder1.size() == (width * height));
+  XCTAssert(iterOrder1 == iterOrder2);
+}
+
+// With no budget limit the iteration is not changed, with a step limit
+// the pixels after the switch point are in raster order and decode
+// with gradclamp from the pixels emitted before them.
+
+- (void) testBudgetFallbackToRaster {
+  const int width = 11;
+  const int height = 9;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 5, 0x007F7F7F);
+  
+  vector<uint32_t> iterOrder1;
+  vector<uint32_t> iterOrder2;
+  vector<uint32_t> deltas1(numPixels);
+  vector<uint32_t> deltas2(numPixels);
+  
+  CTI_IterateRGB(pixels.data(), width, height, iterOrder1, deltas1.data());
+  
+  {
+    CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink(iterOrder2, deltas2.data());
+    CTI_IterBudget budget;
+    int switchPoint = CTI_IterateRGBWithBudget<CTI_AdaptivePredictor>(pixels.data(), width, height, budget, sink);
+    
+    XCTAssert(switchPoint == numPixels);
+    XCTAssert(iterOrder1 == iterOrder2);
+    XCTAssert(deltas1 == deltas2);
+  }
+  
+  iterOrder2.clear();
+  
+  const int maxSteps = 20;
+  
+  CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink(iterOrder2, deltas2.data());
+  CTI_IterBudget budget(maxSteps);
+  int switchPoint = CTI_IterateRGBWithBudget<CTI_AdaptivePredictor>(pixels.data(), width, height, budget, sink);
+  
+  // 4 upper left pixels and then one pixel for each step
+  
+  XCTAssert(switchPoint == (4 + maxSteps));
+  XCTAssert(iterOrder2.size() == numPixels);
+  
+  for ( int i = 0; i < switchPoint; i++ ) {
+    XCTAssert(iterOrder1[i] == iterOrder2[i]);
+  }
+  
+  for ( int i = switchPoint + 1; i < numPixels; i++ ) {
+    XCTAssert(iterOrder2[i-1] < iterOrder2[i]);
+  }
+  
+  // Decode the raster pixels given the pixels before the switch point
+  
+  vector<uint32_t> decoded(numPixels, 0);
+  
+  for ( int i = 0; i < switchPoint; i++ ) {
+    int offset = iterOrder2[i];
+    decoded[offset] = pixels[offset];
+  }
+  
+  for ( int i = switchPoint; i < numPixels; i++ ) {
+    int offset = iterOrder2[i];
+    int x = offset % width;
+    int y = offset / width;
+    const uint32_t * const rowPtr = &decoded[y * width];
+    const uint32_t * const upRowPtr = (y == 0) ? nullptr : (rowPtr - width);
+    uint32_t predPixel = gradclamp8by4_row_predict(rowPtr, upRowPtr, x);
+    decoded[offset] = pixel_component_sum(predPixel, deltas2[offset], 3) & 0x00FFFFFF;
+  }
+  
+  XCTAssert(decoded == pixels);
+}
+
+// The base level of a pyramid is the adaptive iteration of the decimated
+// image and each finer level codes only the pixels that are new.
+
+- (void) testPyramidLevels {
+  const int width = 13;
+  const int height = 10;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 9, 0x003F3F3F);
+  
+  vector<CTI_PyramidLevel> levels;
+  
+  // A 4th level would be 2x2 and a 5th level would be 1x1
+  
+  CTI_IterateRGBPyramid(pixels.data(), width, height, 5, levels);
+  
+  XCTAssert(levels.size() == 4);
+  
+  XCTAssert(levels[0].level == 3);
+  XCTAssert(levels[0].width == 2);
+  XCTAssert(levels[0].height == 2);
+  
+  XCTAssert(levels[1].level == 2);
+  XCTAssert(levels[1].width == 4);
+  XCTAssert(levels[1].height == 3);
+  
+  XCTAssert(levels[3].level == 0);
+  XCTAssert(levels[3].width == width);
+  XCTAssert(levels[3].height == height);
+  
+  // Each pixel is coded once over all the levels
+  
+  int numCoded = 0;
+  
+  for ( CTI_PyramidLevel & level : levels ) {
+    numCoded += (int) level.iterOrder.size();
+    
+    for ( uint32_t offset : level.iterOrder ) {
+      int x = offset % level.width;
+      int y = offset / level.width;
+      XCTAssert(level.level == levels[0].level || ((x | y) & 0x1) != 0);
+    }
+  }
+  
+  XCTAssert(numCoded == numPixels);
+  
+  // The base level matches the iteration over the decimated image
+  
+  vector<uint32_t> basePixels(4);
+  basePixels[0] = pixels[CTIOffset2d(0, 0, width)];
+  basePixels[1] = pixels[CTIOffset2d(8, 0, width)];
+  basePixels[2] = pixels[CTIOffset2d(0, 8, width)];
+  basePixels[3] = pixels[CTIOffset2d(8, 8, width)];
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(4);
+  
+  CTI_IterateRGB(basePixels.data(), 2, 2, iterOrder, deltas.data());
+  
+  XCTAssert(iterOrder == levels[0].iterOrder);
+  XCTAssert(deltas == levels[0].deltas);
+  
+  // A pixel between two known pixels predicts the average
+  
+  uint32_t known[] = {
+    0x00102030, 0x00FFFFFF, 0x00304050,
+    0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF,
+    0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF
+  };
+  
+  CTI_Struct ctiStruct;
+  ctiStruct.width = 3;
+  ctiStruct.height = 3;
+  ctiStruct.allocCache(3, 3);
+  
+  auto lookupL = [&known] (int offset)->uint32_t {
+    return known[offset];
+  };
+  
+  uint32_t pred = CTI_PyramidPredictor::predict(ctiStruct, lookupL, 1, 0);
+  XCTAssert(pred == 0x00203040);
+}
+
+// Packed 24 bit pixels give the same iteration order and RGB residuals
+// as BGRA pixels, the alpha of the BGRA pixels is ignored.
+
+- (void) testIterateRGB24MatchesRGB {
+  const int width = 23;
+  const int height = 19;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 41, 0x0000FF3F);
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    pixels[i] |= 0xFF000000 | ((((i % width) * 9) & 0xFF) << 16);
+  }
+  
+  vector<uint8_t> packed(numPixels * 3);
+  rgb24_pack(pixels.data(), numPixels, packed.data());
+  
+  vector<uint32_t> unpacked(numPixels);
+  rgb24_unpack(packed.data(), numPixels, unpacked.data());
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(unpacked[i] == (pixels[i] & 0x00FFFFFF));
+  }
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  CTI_IterateRGB(pixels.data(), width, height, iterOrder, deltas.data());
+  
+  vector<uint32_t> packedIterOrder;
+  vector<uint32_t> packedDeltas(numPixels);
+  CTI_IterateRGB24(packed.data(), width, height, packedIterOrder, packedDeltas.data());
+  
+  XCTAssert(packedIterOrder == iterOrder);
+  
+  // The alpha byte of a residual for a BGRA pixel is not coded
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(packedDeltas[i] == (deltas[i] & 0x00FFFFFF));
+  }
+}
+
+// Planar RGB pixels generate the same iteration order as BGRA pixels
+// and the residual planes hold the residual stream split by channel
+
+- (void) testIterateRGBPlanarMatchesRGB {
+  const int width = 27;
+  const int height = 15;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 73, 0x003F003F);
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    pixels[i] |= 0xFF000000 | ((((i / width) * 11) & 0xFF) << 8);
+  }
+  
+  CTI_PlanarRGB planes;
+  planes.fromPixels(pixels.data(), numPixels);
+  
+  XCTAssert(planes.pixelAt(0) == (pixels[0] & 0x00FFFFFF));
+  
+  vector<uint32_t> joined(numPixels);
+  planes.toPixels(joined.data());
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(joined[i] == (pixels[i] & 0x00FFFFFF));
+  }
+  
+  vector<uint32_t> iterOrder;
+  vector<uint32_t> deltas(numPixels);
+  CTI_IterateRGB(pixels.data(), width, height, iterOrder, deltas.data());
+  
+  vector<uint32_t> planarIterOrder;
+  CTI_PlanarRGB residualPlanes;
+  CTI_IterateRGBPlanar(planes, width, height, planarIterOrder, &residualPlanes);
+  
+  XCTAssert(planarIterOrder == iterOrder);
+  XCTAssert(residualPlanes.numPixels == numPixels);
+  
+  vector<uint32_t> residuals(numPixels);
+  residualPlanes.toPixels(residuals.data());
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(residuals[i] == (deltas[iterOrder[i]] & 0x00FFFFFF));
+  }
+}
+
+// Residuals stored in iteration order decode back to the RGB pixels
+
+- (void) testDecodeRGB {
+  const int width = 17;
+  const int height = 12;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 11, 0x001F1F1F);
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      uint32_t ramp = ((x * 9) << 16) | ((y * 13) << 8) | ((x * y) & 0xFF);
+      pixels[CTIOffset2d(x, y, width)] = (ramp + pixels[CTIOffset2d(x, y, width)]) & 0x00FFFFFF;
+    }
+  }
+  
+  vector<uint32_t> stream;
+  CTI_StreamResidualSink sink(stream);
+  
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor>(pixels.data(), width, height, sink);
+  
+  XCTAssert(stream.size() == numPixels);
+  
+  vector<uint32_t> decoded(numPixels);
+  
+  CTI_DecodeRGB(stream.data(), width, height, decoded.data());
+  
+  XCTAssert(decoded == pixels);
+}
+
+// Decode a rectangle from a tiled stream, only the tiles that intersect
+// the rectangle are decoded.
+
+- (void) testDecodeTileRect {
+  const int width = 21;
+  const int height = 18;
+  const int numPixels = width * height;
+  const int tileSize = 8;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 13, 0x003F3F3F);
+  
+  // Left side is flat so that both tile modes are used
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < 8; x++ ) {
+      pixels[CTIOffset2d(x, y, width)] = 0x00406080;
+    }
+  }
+  
+  vector<uint32_t> stream;
+  CTI_TileIndex index;
+  
+  CTI_EncodeRGBTileStream(pixels.data(), width, height, tileSize, stream, index);
+  
+  XCTAssert(index.numTilesX == 3);
+  XCTAssert(index.numTilesY == 3);
+  XCTAssert(index.tileStarts[9] == numPixels);
+  XCTAssert(index.tileModes[0] == CTI_TileModeRasterMED);
+  XCTAssert(index.tileModes[1] == CTI_TileModeAdaptive);
+  
+  vector<int> tileNums;
+  index.tilesInRect(7, 3, 2, 6, tileNums);
+  
+  XCTAssert(tileNums.size() == 4);
+  XCTAssert(tileNums[0] == 0);
+  XCTAssert(tileNums[1] == 1);
+  XCTAssert(tileNums[2] == 3);
+  XCTAssert(tileNums[3] == 4);
+  
+  // Rectangle inside the middle tile and the tile to its right
+  
+  const int rectX = 10;
+  const int rectY = 9;
+  const int rectWidth = 11;
+  const int rectHeight = 5;
+  
+  vector<uint32_t> rectPixels(rectWidth * rectHeight);
+  
+  int numDecoded = CTI_DecodeRGBTileRect(stream.data(), index, rectX, rectY, rectWidth, rectHeight, rectPixels.data());
+  
+  XCTAssert(numDecoded == 2);
+  
+  for ( int y = 0; y < rectHeight; y++ ) {
+    for ( int x = 0; x < rectWidth; x++ ) {
+      uint32_t expected = pixels[CTIOffset2d(rectX + x, rectY + y, width)];
+      XCTAssert(rectPixels[CTIOffset2d(x, y, rectWidth)] == expected);
+    }
+  }
+  
+  // The whole image
+  
+  vector<uint32_t> decoded(numPixels);
+  
+  numDecoded = CTI_DecodeRGBTileRect(stream.data(), index, 0, 0, width, height, decoded.data());
+  
+  XCTAssert(numDecoded == 9);
+  XCTAssert(decoded == pixels);
+}
+
+// Banded encoding reads one row of tiles at a time and writes the same
+// stream as the in memory tiled encoding.
+
+- (void) testBandedTileStream {
+  const int width = 70;
+  const int height = 45;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 17, 0x003F3F3F);
+  
+  for ( int i = 0; i < (16 * width); i++ ) {
+    pixels[i] = 0x00102030;
+  }
+  
+  int maxRowRead = 0;
+  
+  auto readRowsL = [&](int y, int numRows, uint32_t * rowsPtr) {
+    XCTAssert(y == maxRowRead);
+    memcpy(rowsPtr, &pixels[CTIOffset2d(0, y, width)], width * numRows * sizeof(uint32_t));
+    maxRowRead = y + numRows;
+  };
+  
+  // The budget fits a tile size of 16 but not 32
+  
+  size_t budget = CTI_BandedPeakBytes(width, height, 16);
+  XCTAssert(budget < CTI_BandedPeakBytes(width, height, 32));
+  
+  // The tile index for a 60000x60000 image at the smallest tile size
+  // holds a mode and a stream offset for each of 3750x3750 tiles
+  
+  XCTAssert(CTI_BandedPeakBytes(60000, 60000, 16) > ((size_t) 3750 * 3750 * 9));
+  
+  FILE *fp = tmpfile();
+  
+  CTI_TileIndex index;
+  size_t peakBytes = 0;
+  
+  bool worked = CTI_EncodeRGBBandedTileStream(readRowsL, width, height, 64, budget, fp, index, &peakBytes);
+  
+  XCTAssert(worked);
+  XCTAssert(index.tileSize == 16);
+  XCTAssert(peakBytes <= budget);
+  XCTAssert(maxRowRead == height);
+  XCTAssert(index.tileStarts[index.numTilesX * index.numTilesY] == numPixels);
+  
+  vector<uint32_t> stream(numPixels);
+  
+  rewind(fp);
+  size_t numRead = fread(stream.data(), sizeof(uint32_t), numPixels, fp);
+  fclose(fp);
+  
+  XCTAssert(numRead == numPixels);
+  
+  vector<uint32_t> expectedStream;
+  CTI_TileIndex expectedIndex;
+  
+  CTI_EncodeRGBTileStream(pixels.data(), width, height, 16, expectedStream, expectedIndex);
+  
+  XCTAssert(stream == expectedStream);
+  XCTAssert(index.tileModes == expectedIndex.tileModes);
+  XCTAssert(index.tileStarts == expectedIndex.tileStarts);
+  
+  vector<uint32_t> decoded(numPixels);
+  CTI_DecodeRGBTileRect(stream.data(), index, 0, 0, width, height, decoded.data());
+  
+  XCTAssert(decoded == pixels);
+  
+  // A budget smaller than the minimum tile size fails
+  
+  fp = tmpfile();
+  maxRowRead = 0;
+  worked = CTI_EncodeRGBBandedTileStream(readRowsL, width, height, 64, 1024, fp, index);
+  fclose(fp);
+  
+  XCTAssert(worked == false);
+}
+
+// The parallel tiled stream is identical for any number of threads
+// and matches the serial tiled stream.
+
+- (void) testParallelTileStreamDeterministic {
+  const int width = 150;
+  const int height = 90;
+  const int numPixels = width * height;
+  const int tileSize = 32;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 23, 0x001F1F1F);
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < 64; x++ ) {
+      pixels[CTIOffset2d(x, y, width)] = 0x00204060 + (y << 8);
+    }
+  }
+  
+  vector<uint32_t> expectedStream;
+  CTI_TileIndex expectedIndex;
+  
+  CTI_EncodeRGBTileStream(pixels.data(), width, height, tileSize, expectedStream, expectedIndex);
+  
+  for ( int numThreads : { 1, 2, 3, 8 } ) {
+    vector<uint32_t> stream;
+    CTI_TileIndex index;
+    
+    CTI_EncodeRGBTileStreamParallel(pixels.data(), width, height, tileSize, numThreads, stream, index);
+    
+    XCTAssert(stream.size() == expectedStream.size());
+    XCTAssert(memcmp(stream.data(), expectedStream.data(), stream.size() * sizeof(uint32_t)) == 0);
+    XCTAssert(index.tileModes == expectedIndex.tileModes);
+    XCTAssert(index.tileStarts == expectedIndex.tileStarts);
+  }
+}
+
+// A batch with a large RGB image, small RGB, BGRA, and gray images.
+// The large image is split into tiles, the small images are grouped,
+// and every image is coded the same as the serial entry points.
+
+- (void) testEncodeBatchMixedSizes {
+  const int tileSize = 32;
+  const int groupPixels = 24 * 24;
+  
+  const int sizes[][2] = { { 100, 70 }, { 8, 8 }, { 12, 9 }, { 16, 16 }, { 20, 30 }, { 5, 7 } };
+  const int numImages = sizeof(sizes) / sizeof(sizes[0]);
+  
+  vector<vector<uint32_t> > rgbPixels(numImages);
+  vector<vector<uint8_t> > grayPixels(numImages);
+  vector<CTI_BatchImage> images(numImages);
+  
+  for ( int i = 0; i < numImages; i++ ) {
+    const int width = sizes[i][0];
+    const int height = sizes[i][1];
+    const bool isGray = (i == 3) || (i == 5);
+    const bool hasAlpha = (i == 2);
+    
+    vector<uint32_t> noisePixels = makeTestPixels(width, height, 29 + i, 0x000F0F0F);
+    
+    for ( int y = 0; y < height; y++ ) {
+      for ( int x = 0; x < width; x++ ) {
+        uint32_t noise = noisePixels[CTIOffset2d(x, y, width)];
+        uint32_t A = ((uint32_t) (x * 17)) & 0xFF;
+        uint32_t R = (((uint32_t) (x * 3)) + ((noise >> 16) & 0xFF)) & 0xFF;
+        uint32_t G = (((uint32_t) y) + ((noise >> 8) & 0xFF)) & 0xFF;
+        uint32_t B = noise & 0xFF;
+        rgbPixels[i].push_back((A << 24) | (R << 16) | (G << 8) | B);
+        grayPixels[i].push_back((uint8_t) ((x * 5) + (noise & 0xF)));
+      }
+    }
+    
+    images[i].width = width;
+    images[i].height = height;
+    
+    if (isGray) {
+      images[i].grayPixels = grayPixels[i].data();
+    } else {
+      images[i].rgbPixels = rgbPixels[i].data();
+      images[i].hasAlpha = hasAlpha;
+    }
+  }
+  
+  vector<CTI_BatchJob> jobs;
+  CTI_BatchMakeJobs(images, tileSize, groupPixels, jobs);
+  
+  // 4x3 tiles for the large image, then a group that is extended
+  // until it holds at least groupPixels (8x8 12x9 16x16 20x30) and
+  // a group with (5x7)
+  
+  XCTAssert(jobs.size() == (12 + 2));
+  XCTAssert(jobs[12].firstImage == 1 && jobs[12].numImages == 4 && jobs[12].tileNum == -1);
+  XCTAssert(jobs[13].firstImage == 5 && jobs[13].numImages == 1 && jobs[13].tileNum == -1);
+  
+  for ( int numThreads : { 1, 3 } ) {
+    WorkStealingStats stats;
+    
+    CTI_EncodeBatch(images, numThreads, stats, tileSize, groupPixels);
+    
+    int numJobs = 0;
+    for ( int worker = 0; worker < numThreads; worker++ ) {
+      numJobs += stats.numJobs[worker];
+      XCTAssert(stats.utilisation(worker) >= 0.0);
+    }
+    XCTAssert(numJobs == (int) jobs.size());
+    
+    if (numThreads == 1) {
+      XCTAssert(stats.totalSteals() == 0);
+    }
+    
+    vector<uint32_t> expectedStream;
+    CTI_TileIndex expectedIndex;
+    CTI_EncodeRGBTileStream(rgbPixels[0].data(), sizes[0][0], sizes[0][1], tileSize, expectedStream, expectedIndex);
+    
+    XCTAssert(images[0].isTiled);
+    XCTAssert(images[0].stream == expectedStream);
+    XCTAssert(images[0].index.tileModes == expectedIndex.tileModes);
+    XCTAssert(images[0].index.tileStarts == expectedIndex.tileStarts);
+    
+    for ( int i = 1; i < numImages; i++ ) {
+      const int width = sizes[i][0];
+      const int height = sizes[i][1];
+      
+      vector<uint32_t> iterOrder;
+      vector<uint32_t> deltas(width * height);
+      
+      if (images[i].grayPixels) {
+        CTI_IterateGray(grayPixels[i].data(), width, height, iterOrder, deltas.data());
+      } else if (images[i].hasAlpha) {
+        CTI_IterateRGBA(rgbPixels[i].data(), width, height, iterOrder, deltas.data());
+      } else {
+        CTI_IterateRGB(rgbPixels[i].data(), width, height, iterOrder, deltas.data());
+      }
+      
+      vector<uint32_t> expected;
+      for ( uint32_t offset : iterOrder ) {
+        expected.push_back(deltas[offset]);
+      }
+      
+      XCTAssert(images[i].isTiled == false);
+      XCTAssert(images[i].stream == expected);
+    }
+  }
+}
+
+- (void) testEntropySinkContextForPrio {
+  typedef CTI_EntropyResidualSink<uint32_t, 3> SinkT;
+  
+  XCTAssert(SinkT::contextForPrio(0) == 0);
+  XCTAssert(SinkT::contextForPrio(1) == 1);
+  XCTAssert(SinkT::contextForPrio(2) == 2);
+  XCTAssert(SinkT::contextForPrio(3) == 2);
+  XCTAssert(SinkT::contextForPrio(4) == 3);
+  XCTAssert(SinkT::contextForPrio(765) == (CTI_ENTROPY_NUM_CONTEXTS - 1));
+  
+  // A constant residual costs zero bits
+  
+  SinkT sink;
+  for (int i = 0; i < 10; i++) {
+    sink.emit(i, 0x00010203, 5);
+  }
+  XCTAssert(sink.order0Bits() == 0.0);
+  XCTAssert(sink.contextBits() == 0.0);
+  
+  // 2 equally likely values cost 1 bit each in one component
+  
+  SinkT sink2;
+  for (int i = 0; i < 10; i++) {
+    sink2.emit(i, (i & 1), 0);
+  }
+  XCTAssert(fabs(sink2.order0Bits() - 10.0) < 0.0001);
+  XCTAssert(fabs(sink2.order0BitsPerPixel() - 1.0) < 0.0001);
+}
+
+- (void) testInterleavedCacheLayoutMatchesSplit {
+  const int width = 37;
+  const int height = 23;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 1, 0x000F0F0F);
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      uint32_t ramp = ((x * 5) << 16) | ((y * 7) << 8) | ((x + y) * 3);
+      pixels[CTIOffset2d(x, y, width)] = (ramp + pixels[CTIOffset2d(x, y, width)]) & 0x00FFFFFF;
+    }
+  }
+  
+  vector<uint32_t> iterOrder1;
+  vector<uint32_t> iterOrder2;
+  vector<uint32_t> deltas1(width * height);
+  vector<uint32_t> deltas2(width * height);
+  
+  CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink1(iterOrder1, deltas1.data());
+  CTI_IterOrderSink<CTI_DeltasResidualSink<uint32_t> > sink2(iterOrder2, deltas2.data());
+  
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor, CTI_Struct>(pixels.data(), width, height, sink1);
+  CTI_IterateRGBWithSink<CTI_AdaptivePredictor, CTI_StructInterleaved>(pixels.data(), width, height, sink2);
+  
+  XCTAssert(iterOrder1.size() == (width * height));
+  XCTAssert(iterOrder1 == iterOrder2);
+  XCTAssert(deltas1 == deltas2);
+}
+
 @end
 
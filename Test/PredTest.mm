@@ -11,6 +11,10 @@
 
 #import "ColortableIter.hpp"
 
+#import "WavefrontDecode.hpp"
+
+#import "TestPixels.hpp"
+
 #import <set>
 #include <string>
 #include <sstream>
@@ -1261,5 +1265,328 @@ void CTI_IteratePixelsInTable(
 }
 
 
+// CTIPredict2 with 4 components must include the alpha delta in the cost
+
+- (void) testPredict2Alpha {
+  uint32_t pixelsPtr[] = {
+    0xFF102030, 0x80102030, 0x7F112233
+  };
+  
+  XCTAssert(CTIPredict2(pixelsPtr, 0, 1) == 0);
+  XCTAssert(CTIPredict2(pixelsPtr, 0, 1, 4) == 0x7F);
+  XCTAssert(CTIPredict2(pixelsPtr, 1, 2, 3) == (1 + 2 + 3));
+  XCTAssert(CTIPredict2(pixelsPtr, 1, 2, 4) == (1 + 1 + 2 + 3));
+}
+
+// Each color transform must roundtrip every 24 bit RGB value, alpha must pass through.
+// The buffer length is not a multiple of 4 so that the scalar tail is also covered.
+
+- (void) testColorTransformRoundtrip {
+  const int numPixels = 256 * 256 + 3;
+  
+  vector<uint32_t> inPixels(numPixels);
+  vector<uint32_t> encPixels(numPixels);
+  vector<uint32_t> decPixels(numPixels);
+  
+  CTI_ColorTransform transforms[] = { CTI_ColorTransformSubtractGreen, CTI_ColorTransformYCoCgR };
+  
+  for ( CTI_ColorTransform transform : transforms ) {
+    for (uint32_t R = 0; R < 256; R++) {
+      for (int i = 0; i < numPixels; i++) {
+        uint32_t GB = (uint32_t) i & 0xFFFF;
+        uint32_t A = (uint32_t) (i * 7) & 0xFF;
+        inPixels[i] = (A << 24) | (R << 16) | GB;
+      }
+      
+      color_transform_encode(transform, inPixels.data(), encPixels.data(), numPixels);
+      color_transform_decode(transform, encPixels.data(), decPixels.data(), numPixels);
+      
+      bool same = (inPixels == decPixels);
+      XCTAssert(same);
+      
+      for (int i = 0; i < numPixels; i += 97) {
+        uint32_t enc = (transform == CTI_ColorTransformYCoCgR) ? ycocgr_encode_pixel(inPixels[i]) : subgreen_encode_pixel(inPixels[i]);
+        XCTAssert(enc == encPixels[i]);
+        XCTAssert((enc >> 24) == (inPixels[i] >> 24));
+      }
+    }
+  }
+}
+
+// A gray pixel has zero chroma, so both transforms store the 128 bias in the chroma components
+
+- (void) testColorTransformGray {
+  uint32_t pixel = 0xFF404040;
+  
+  XCTAssert(subgreen_encode_pixel(pixel) == 0xFF804080);
+  XCTAssert(ycocgr_encode_pixel(pixel) == 0xFF804080);
+  
+  // R = 0x41 G = 0x40 B = 0x40 : Co = 1, t = 0x40, Cg = 0, Y = 0x40
+  
+  XCTAssert(ycocgr_encode_pixel(0x00414040) == 0x00814080);
+  XCTAssert(ycocgr_decode_pixel(0x00814080) == 0x00414040);
+}
+
+// The byte wise add must match a component by component add mod 256
+
+- (void) testGradclampAddPredError {
+  uint32_t values[] = { 0x00000000, 0xFFFFFFFF, 0x80808080, 0x7F7F7F7F, 0x01FF8000, 0x12345678, 0xFEDCBA98 };
+  
+  for ( uint32_t pred : values ) {
+    for ( uint32_t err : values ) {
+      uint32_t expected = 0;
+      for (int comp = 0; comp < 4; comp++) {
+        uint32_t c = (((pred >> (comp * 8)) & 0xFF) + ((err >> (comp * 8)) & 0xFF)) & 0xFF;
+        expected |= (c << (comp * 8));
+      }
+      XCTAssert(gradclamp8by4_add_pred_error(pred, err) == expected);
+    }
+  }
+}
+
+// Encode and then serial decode must return the original pixels for both edge rules
+
+- (void) testGradclampDecodeRoundtrip {
+  const int width = 13;
+  const int height = 7;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 3, 0xFFFFFFFF);
+  vector<uint32_t> predErr(numPixels);
+  vector<uint32_t> decoded(numPixels);
+  
+  for (int i = 0; i < numPixels; i++) {
+    if (i % 3 != 0) {
+      pixels[i] = 0x40404040 + i;
+    }
+  }
+  
+  gradclamp8by4_encode_pred_error(pixels.data(), predErr.data(), 0, numPixels, width);
+  gradclamp8by4_decode_pred_error(predErr.data(), decoded.data(), 0, numPixels, width);
+  
+  XCTAssert(pixels == decoded);
+  
+  decoded = vector<uint32_t>(numPixels);
+  
+  gradclamp8by4_encode_pred_error_rows(pixels.data(), predErr.data(), width, 0, height);
+  gradclamp8by4_decode_pred_error_rows(predErr.data(), decoded.data(), width, height);
+  
+  XCTAssert(pixels == decoded);
+}
+
+// Wavefront decode must be identical to the serial decode for any thread count and block width
+
+- (void) testGradclampWavefrontDecode {
+  const int width = 61;
+  const int height = 37;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> pixels = makeTestPixels(width, height, 7, 0xFFFFFFFF);
+  vector<uint32_t> predErr(numPixels);
+  vector<uint32_t> serial(numPixels);
+  
+  for (int i = 0; i < numPixels; i++) {
+    if ((i / 5) % 2 != 0) {
+      pixels[i] = 0x10203040 + (i % width);
+    }
+  }
+  
+  gradclamp8by4_encode_pred_error_rows(pixels.data(), predErr.data(), width, 0, height);
+  gradclamp8by4_decode_pred_error_rows(predErr.data(), serial.data(), width, height);
+  
+  XCTAssert(pixels == serial);
+  
+  int threadCounts[] = { 1, 2, 3, 8, 64 };
+  int blockWidths[] = { 1, 7, 61, 256 };
+  
+  for ( int numThreads : threadCounts ) {
+    for ( int blockWidth : blockWidths ) {
+      vector<uint32_t> decoded(numPixels);
+      gradclamp8by4_decode_pred_error_wavefront(predErr.data(), decoded.data(), width, height, numThreads, blockWidth);
+      XCTAssert(decoded == serial);
+    }
+  }
+}
+
+// The table based neighbor prediction matches the branching version
+// for every processed pattern around every pixel in a 3x3 grid.
+
+template <typename CTIStruct>
+static
+int neighborPredictMismatches(const uint32_t * const pixelsPtr)
+{
+  const int width = 3;
+  const int height = 3;
+  
+  auto lookupL = [pixelsPtr] (int offset)->uint32_t {
+    return pixelsPtr[offset];
+  };
+  
+  int numMismatches = 0;
+  
+  for ( int center = 0; center < (width * height); center++ ) {
+    for ( int pattern = 0; pattern < 256; pattern++ ) {
+      CTIStruct ctiStruct;
+      ctiStruct.width = width;
+      ctiStruct.height = height;
+      ctiStruct.allocCache(width, height);
+      
+      int bit = 0;
+      for ( int offset = 0; offset < (width * height); offset++ ) {
+        if (offset == center) {
+          continue;
+        }
+        if ((pattern >> bit) & 0x1) {
+          ctiStruct.setProcessed(offset);
+        }
+        bit++;
+      }
+      
+      const int x = center % width;
+      const int y = center / width;
+      
+      // The branching version requires a processed N S E W neighbor
+      
+      bool hasNeighbor = false;
+      hasNeighbor = hasNeighbor || ((x > 0) && ctiStruct.wasProcessed(x-1, y));
+      hasNeighbor = hasNeighbor || ((x < (width - 1)) && ctiStruct.wasProcessed(x+1, y));
+      hasNeighbor = hasNeighbor || ((y > 0) && ctiStruct.wasProcessed(x, y-1));
+      hasNeighbor = hasNeighbor || ((y < (height - 1)) && ctiStruct.wasProcessed(x, y+1));
+      
+      uint32_t branchPixel = 0;
+      
+      if (hasNeighbor) {
+        branchPixel = CTI_NeighborPredict2Branches(ctiStruct, lookupL, nullptr, x, y);
+      }
+      
+      uint32_t tablePixel = CTI_NeighborPredict2(ctiStruct, lookupL, nullptr, x, y);
+      
+      if (branchPixel != tablePixel) {
+        numMismatches++;
+      }
+    }
+  }
+  
+  return numMismatches;
+}
+
+- (void) testNeighborPredictTableMatchesBranches {
+  for ( int trial = 0; trial < 16; trial++ ) {
+    vector<uint32_t> pixels = makeTestPixels(3, 3, 3 + trial, 0xFFFFFFFF);
+    
+    XCTAssert(neighborPredictMismatches<CTI_Struct>(pixels.data()) == 0);
+    XCTAssert(neighborPredictMismatches<CTI_StructRGBA>(pixels.data()) == 0);
+  }
+}
+
+// Each cost in the table must match the cost computed for the same
+// pair of table offsets, for both the wrapped offset cost and the
+// palette distance cost.
+
+- (void) testTableCostTableMatchesPredict {
+  for ( int N : { 1, 2, 3, 17, 256 } ) {
+    vector<uint32_t> colortable(N);
+    
+    for ( int i = 0; i < N; i++ ) {
+      colortable[i] = 0xFF000000 | ((i * 7) << 16) | ((255 - i) << 8) | ((i * 13) & 0xFF);
+    }
+    
+    CTI_TableCostTable wrapped;
+    wrapped.init(colortable.data(), N, CTI_TableCostWrappedOffset);
+    
+    CTI_TableCostTable distance;
+    distance.init(colortable.data(), N, CTI_TableCostPaletteDistance);
+    
+    vector<uint8_t> offsets(2);
+    
+    for ( int o1 = 0; o1 < N; o1++ ) {
+      for ( int o2 = 0; o2 < N; o2++ ) {
+        if (o1 == o2) {
+          XCTAssert(wrapped.costs[(o1 << 8) | o2] == 0);
+          continue;
+        }
+        
+        offsets[0] = o1;
+        offsets[1] = o2;
+        
+        int cost = CTITablePredict2(offsets.data(), colortable.data(), 0, 1, N);
+        XCTAssert(CTITablePredict2WithCosts(offsets.data(), wrapped.data(), 0, 1) == cost);
+        XCTAssert(cost <= wrapped.maxCost);
+        
+        int distanceCost = CTIPredict2(colortable.data(), o1, o2);
+        XCTAssert(CTITablePredict2WithCosts(offsets.data(), distance.data(), 0, 1) == distanceCost);
+      }
+    }
+  }
+}
+
+// The fused residual stats must match a simple per component calculation,
+// including a residual of -128 and the upper left pixels counted as zero.
+
+- (void) testResidualStats {
+  const int width = 7;
+  const int height = 5;
+  const int numPixels = width * height;
+  
+  vector<uint32_t> residuals = makeTestPixels(width, height, 11, 0xFFFFFFFF);
+  
+  residuals[9] = 0x80808080;
+  
+  // Upper left pixels contain raw pixels that must be ignored
+  
+  residuals[0] = 0xFF808080;
+  residuals[1] = 0xFF808080;
+  residuals[width] = 0xFF808080;
+  residuals[width+1] = 0xFF808080;
+  
+  uint64_t sumAbs[4] = { 0, 0, 0, 0 };
+  uint64_t sumSqr[4] = { 0, 0, 0, 0 };
+  uint32_t maxAbs[4] = { 0, 0, 0, 0 };
+  
+  for (int i = 0; i < numPixels; i++) {
+    if (i == 0 || i == 1 || (i == width) || (i == width+1)) {
+      continue;
+    }
+    for (int comp = 0; comp < 4; comp++) {
+      int v = (int8_t) ((residuals[i] >> (comp * 8)) & 0xFF);
+      uint32_t a = (uint32_t) abs(v);
+      sumAbs[comp] += a;
+      sumSqr[comp] += a * a;
+      maxAbs[comp] = max(maxAbs[comp], a);
+    }
+  }
+  
+  ResidualStats stats;
+  calc_residual_stats(numPixels, residuals.data(), width, &stats);
+  
+  for (int comp = 0; comp < 4; comp++) {
+    XCTAssert(stats.sumAbs[comp] == sumAbs[comp]);
+    XCTAssert(stats.sumSqr[comp] == sumSqr[comp]);
+    XCTAssert(stats.maxAbs[comp] == maxAbs[comp]);
+    
+    uint32_t histTotal = 0;
+    for (int bin = 0; bin < 256; bin++) {
+      histTotal += stats.histogram[comp][bin];
+    }
+    XCTAssert(histTotal == numPixels);
+  }
+  
+  XCTAssert(stats.maxError == 128);
+  XCTAssert(stats.histogram[0][0x80] == 1);
+  
+  double expectedMAE = ((double) (sumAbs[0] + sumAbs[1] + sumAbs[2])) / numPixels;
+  XCTAssert(fabs(stats.combinedMAE - expectedMAE) < 0.000001);
+  
+  // All zero residuals
+  
+  vector<uint32_t> zeros(numPixels);
+  calc_residual_stats(numPixels, zeros.data(), 0, &stats);
+  
+  XCTAssert(stats.combinedMAE == 0.0);
+  XCTAssert(stats.maxError == 0);
+  XCTAssert(isinf(stats.psnr));
+  XCTAssert(stats.histogram[2][0] == numPixels);
+}
+
 @end
 
@@ -0,0 +1,34 @@
+//
+//  TestPixels.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Deterministic noise pixels for the tests. The same width, height,
+//  and seed always generate the same pixels, each pixel is masked with
+//  mask so that a test can limit the range of each channel.
+
+#ifndef TEST_PIXELS_H
+#define TEST_PIXELS_H
+
+#include <vector>
+
+using namespace std;
+
+static inline
+vector<uint32_t> makeTestPixels(const int width, const int height, uint32_t seed, const uint32_t mask)
+{
+  const int numPixels = width * height;
+
+  vector<uint32_t> pixels(numPixels);
+
+  for ( int i = 0; i < numPixels; i++ ) {
+    seed = (seed * 1103515245) + 12345;
+    pixels[i] = ((seed >> 8) ^ (seed << 13)) & mask;
+  }
+
+  return pixels;
+}
+
+#endif // TEST_PIXELS_H
@@ -0,0 +1,74 @@
+//
+//  WorkStealingTest.mm
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Tests for the work stealing scheduler.
+
+#import <XCTest/XCTest.h>
+
+#import "WorkStealing.hpp"
+
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+@interface WorkStealingTest : XCTestCase
+
+@end
+
+@implementation WorkStealingTest
+
+- (void)setUp {
+    [super setUp];
+    // Put setup code here. This method is called before the invocation of each test method in the class.
+}
+
+- (void)tearDown {
+    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    [super tearDown];
+}
+
+// Every job runs exactly once for any number of workers, including
+// more workers than jobs.
+
+- (void) testWorkStealingRunsEachJobOnce {
+  const int numJobs = 37;
+  
+  for ( int numWorkers : { 1, 2, 3, 8, 64 } ) {
+    vector<atomic<int> > runCounts(numJobs);
+    atomic<int> maxWorker(0);
+    
+    for ( int i = 0; i < numJobs; i++ ) {
+      runCounts[i].store(0);
+    }
+    
+    WorkStealingScheduler scheduler(numWorkers);
+    WorkStealingStats stats;
+    
+    scheduler.run(numJobs, [&](int jobIndex, int worker) {
+      runCounts[jobIndex] += 1;
+      int prevWorker = maxWorker.load();
+      while (worker > prevWorker && !maxWorker.compare_exchange_weak(prevWorker, worker)) {
+      }
+    }, &stats);
+    
+    for ( int i = 0; i < numJobs; i++ ) {
+      XCTAssert(runCounts[i].load() == 1);
+    }
+    
+    XCTAssert(maxWorker.load() < min(numWorkers, numJobs));
+    
+    int sumJobs = 0;
+    for ( int worker = 0; worker < numWorkers; worker++ ) {
+      sumJobs += stats.numJobs[worker];
+      XCTAssert(stats.numSteals[worker] <= stats.numJobs[worker]);
+    }
+    XCTAssert(sumJobs == numJobs);
+  }
+}
+
+@end
@@ -0,0 +1,107 @@
+//
+//  WavefrontDecode.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  Multi-threaded gradclamp decoding where rows are decoded as a
+//  wavefront. Each row is assigned to a thread and decoded in blocks
+//  of pixels, a block is decoded once the row above has been decoded
+//  past the end of the block. Rows run in parallel with a lag of one
+//  block so that a single large image is decoded on many cores.
+
+#include "assert.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+#import "PredFuncs.hpp"
+
+using namespace std;
+
+// Default number of pixels decoded between progress updates
+
+#define WAVEFRONT_BLOCK_WIDTH 256
+
+// Decode a buffer encoded with gradclamp8by4_encode_pred_error_rows() using
+// numThreads threads, the output is identical to the serial decode in
+// gradclamp8by4_decode_pred_error_rows(). The calling thread decodes rows
+// along with (numThreads - 1) worker threads.
+
+static inline
+void gradclamp8by4_decode_pred_error_wavefront(const uint32_t * const inPredErrPtr,
+                                               uint32_t * const outSamplesPtr,
+                                               const int width,
+                                               const int height,
+                                               int numThreads,
+                                               const int blockWidth = WAVEFRONT_BLOCK_WIDTH)
+{
+  const bool debug = false;
+
+#if defined(DEBUG)
+  assert(blockWidth > 0);
+#endif // DEBUG
+
+  if (numThreads > height) {
+    numThreads = height;
+  }
+
+  if (numThreads <= 1) {
+    gradclamp8by4_decode_pred_error_rows(inPredErrPtr, outSamplesPtr, width, height);
+    return;
+  }
+
+  if (debug) {
+    printf("gradclamp8by4_decode_pred_error_wavefront %d x %d : %d threads : block %d\n", width, height, numThreads, blockWidth);
+  }
+
+  // Number of decoded pixels in each row, a row is only read by the
+  // thread that decodes the row below it.
+
+  unique_ptr<atomic<int>[]> rowProgress(new atomic<int>[height]);
+
+  for (int row = 0; row < height; row++) {
+    rowProgress[row].store(0, memory_order_relaxed);
+  }
+
+  auto decodeRowsL = [&](int threadIndex) {
+    for (int row = threadIndex; row < height; row += numThreads) {
+      for (int startX = 0; startX < width; startX += blockWidth) {
+        int endX = startX + blockWidth;
+        if (endX > width) {
+          endX = width;
+        }
+
+        // The up and upLeft neighbors of the block must be decoded
+
+        if (row > 0) {
+          while (rowProgress[row-1].load(memory_order_acquire) < endX) {
+            this_thread::yield();
+          }
+        }
+
+        gradclamp8by4_decode_pred_error_row(inPredErrPtr, outSamplesPtr, width, row, startX, endX);
+
+        rowProgress[row].store(endX, memory_order_release);
+      }
+    }
+  };
+
+  vector<thread> threads;
+  threads.reserve(numThreads - 1);
+
+  for (int i = 1; i < numThreads; i++) {
+    threads.push_back(thread(decodeRowsL, i));
+  }
+
+  decodeRowsL(0);
+
+  for ( thread & t : threads ) {
+    t.join();
+  }
+
+  return;
+}
@@ -0,0 +1,217 @@
+//
+//  WorkStealing.hpp
+//
+//  Copyright 2016 Mo DeJong.
+//
+//  See LICENSE for terms.
+//
+//  A work stealing scheduler for a fixed set of jobs. The jobs are
+//  split into one contiguous block per worker, each worker runs the
+//  jobs in its own block from the front, and a worker that runs out
+//  of jobs steals from the back of another worker's block. A job is
+//  identified only by its index, so a job that writes its result to
+//  a slot for that index produces the same output no matter which
+//  worker runs it or how many workers there are.
+
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include "assert.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+using namespace std;
+
+// Job indexes for one worker, the owner pops from the front and
+// other workers steal from the back.
+
+class WorkStealingQueue
+{
+public:
+  void push(const int jobIndex) {
+    lock_guard<mutex> lock(queueMutex);
+    jobs.push_back(jobIndex);
+  }
+
+  bool pop(int & jobIndex) {
+    lock_guard<mutex> lock(queueMutex);
+    if (jobs.empty()) {
+      return false;
+    }
+    jobIndex = jobs.front();
+    jobs.pop_front();
+    return true;
+  }
+
+  bool steal(int & jobIndex) {
+    lock_guard<mutex> lock(queueMutex);
+    if (jobs.empty()) {
+      return false;
+    }
+    jobIndex = jobs.back();
+    jobs.pop_back();
+    return true;
+  }
+
+private:
+  deque<int> jobs;
+  mutex queueMutex;
+};
+
+// Per worker counts of the jobs run and the jobs stolen from other
+// workers along with the time spent running jobs.
+
+class WorkStealingStats
+{
+public:
+  vector<int> numJobs;
+  vector<int> numSteals;
+  vector<double> busySeconds;
+  double wallSeconds;
+
+  WorkStealingStats()
+  : wallSeconds(0.0)
+  {
+  }
+
+  void reset(const int numWorkers) {
+    numJobs.assign(numWorkers, 0);
+    numSteals.assign(numWorkers, 0);
+    busySeconds.assign(numWorkers, 0.0);
+    wallSeconds = 0.0;
+  }
+
+  int totalSteals() const {
+    int sum = 0;
+    for ( int steals : numSteals ) {
+      sum += steals;
+    }
+    return sum;
+  }
+
+  // Fraction of the wall time that a worker was running jobs
+
+  double utilisation(const int worker) const {
+    if (wallSeconds <= 0.0) {
+      return 0.0;
+    }
+    return busySeconds[worker] / wallSeconds;
+  }
+};
+
+class WorkStealingScheduler
+{
+public:
+  const int numWorkers;
+
+  WorkStealingScheduler(int inNumWorkers)
+  : numWorkers(max(inNumWorkers, 1))
+  {
+  }
+
+  // Invoke jobFunc(jobIndex, workerIndex) once for each job in the
+  // range (0, numJobs). The calling thread runs as worker 0 along with
+  // (numWorkers - 1) threads. No jobs are added once the run starts,
+  // so a worker that finds every queue empty is done. When statsPtr
+  // is not nullptr the stats for each worker are written to it.
+
+  template <typename JobFunc>
+  void run(const int numJobs, JobFunc jobFunc, WorkStealingStats *statsPtr = nullptr)
+  {
+    const bool debug = false;
+
+    typedef chrono::steady_clock Clock;
+
+    const int numThreads = min(numWorkers, max(numJobs, 1));
+
+    vector<WorkStealingQueue> queues(numThreads);
+
+    // Each worker only writes its own stats
+
+    WorkStealingStats stats;
+    stats.reset(numWorkers);
+
+    Clock::time_point wallStartT = Clock::now();
+
+    auto runJobL = [&](const int jobIndex, const int worker) {
+      Clock::time_point startT = Clock::now();
+      jobFunc(jobIndex, worker);
+      chrono::duration<double> elapsed = Clock::now() - startT;
+      stats.busySeconds[worker] += elapsed.count();
+      stats.numJobs[worker] += 1;
+    };
+
+    for (int worker = 0; worker < numThreads; worker++) {
+      const int startJob = (int) (((int64_t) numJobs * worker) / numThreads);
+      const int endJob = (int) (((int64_t) numJobs * (worker + 1)) / numThreads);
+
+      for (int jobIndex = startJob; jobIndex < endJob; jobIndex++) {
+        queues[worker].push(jobIndex);
+      }
+    }
+
+    auto workerL = [&](const int worker) {
+      int jobIndex;
+
+      while (1) {
+        if (queues[worker].pop(jobIndex)) {
+          runJobL(jobIndex, worker);
+          continue;
+        }
+
+        // Scan the other workers starting with the next one
+
+        bool stole = false;
+
+        for (int i = 1; i < numThreads; i++) {
+          const int victim = (worker + i) % numThreads;
+
+          if (queues[victim].steal(jobIndex)) {
+            if (debug) {
+              printf("worker %d stole job %d from worker %d\n", worker, jobIndex, victim);
+            }
+
+            stats.numSteals[worker] += 1;
+            runJobL(jobIndex, worker);
+            stole = true;
+            break;
+          }
+        }
+
+        if (!stole) {
+          break;
+        }
+      }
+    };
+
+    vector<thread> threads;
+    threads.reserve(numThreads - 1);
+
+    for (int worker = 1; worker < numThreads; worker++) {
+      threads.push_back(thread(workerL, worker));
+    }
+
+    workerL(0);
+
+    for ( thread & t : threads ) {
+      t.join();
+    }
+
+    chrono::duration<double> wallElapsed = Clock::now() - wallStartT;
+    stats.wallSeconds = wallElapsed.count();
+
+    if (statsPtr) {
+      *statsPtr = stats;
+    }
+  }
+};
+
+#endif // WORK_STEALING_H